@@ -1,14 +1,94 @@
 #ifndef LLP_LAB1_ALLOCATOR_H
 #define LLP_LAB1_ALLOCATOR_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
 typedef struct Allocator Allocator;
 
-Allocator* alloc_create(char const* filename, size_t initial_size);
+Allocator* alloc_create(char const* filename, size_t initial_size); // creates an empty heap
+// Reopens a heap created earlier, NULL if invalid. A logged heap is mapped
+// privately: changes stay in memory until alloc_checkpoint writes them out.
+// So is a heap that had to be relocated (see alloc_get_relocation), until
+// the caller has shifted its own pointers, checkpoints it and turns logging
+// off.
+Allocator* alloc_open(char const* filename, bool logged);
+// Allocations and frees may come from several threads at once; the rest
+// of the functions must not run concurrently with anything else. Small
+// blocks are cached per thread, so a heap that is not logged gets the
+// cached blocks back only when it is destroyed.
 void* alloc_malloc(Allocator* allocator, size_t size);
+size_t alloc_malloc_bulk(Allocator* allocator, size_t size, size_t n, void** res); // the number of blocks allocated
 void alloc_free(Allocator* allocator, void* ptr);
+size_t alloc_block_size(Allocator* allocator, void const* ptr); // bytes the block can hold, at least the size asked for
+// Allocates from the chunk *chunk, replacing it with a fresh one when it is
+// full; the caller keeps *chunk, NULL at first, and releases it when done.
+void* alloc_malloc_in(Allocator* allocator, size_t size, void** chunk);
+void alloc_release_chunk(Allocator* allocator, void* chunk);
+// Blocks that readers may still be looking at are retired instead of freed.
+// Readers bracket their accesses with alloc_read_lock and alloc_read_unlock,
+// which nest and never block; alloc_reclaimable counts the oldest retired
+// blocks that no reader can see any more, and alloc_reclaim frees the oldest
+// n of them. Nothing is freed unless asked, so a log can record it.
+bool alloc_read_lock(Allocator* allocator); // false if out of memory
+void alloc_read_unlock(Allocator* allocator);
+bool alloc_reading(Allocator* allocator); // whether the calling thread is in a read section
+bool alloc_read_anywhere(Allocator* allocator); // whether any thread is in a read section or holds a pin
+size_t alloc_readers(Allocator* allocator); // threads in read sections, without taking a lock
+bool alloc_retire(Allocator* allocator, void* ptr);
+size_t alloc_retire_bulk(Allocator* allocator, void* const* ptrs, size_t n); // returns how many were retired
+// Retires all but the slots at the end that share a slab, which are moved to
+// the start of ptrs for the next call to retire with the rest of that slab;
+// returns how many were kept
+size_t alloc_retire_most(Allocator* allocator, void** ptrs, size_t n);
+size_t alloc_retired(Allocator* allocator);
+size_t alloc_reclaimable(Allocator* allocator);
+size_t alloc_reclaim(Allocator* allocator, size_t n);
+// Keeps every block retired from now on until the pin is dropped, for readers
+// that are not in read sections. Returns the pinned epoch, 0 if out of memory.
+uint64_t alloc_pin(Allocator* allocator);
+void alloc_unpin(Allocator* allocator, uint64_t epoch);
+// Compaction empties the last arenas so that the file can be cut short.
+// alloc_compact_begin picks the arenas to empty, false if none is worth it;
+// until alloc_compact_end, nothing is allocated from them, and the caller
+// moves every block for which alloc_moving holds. alloc_compact_end drops
+// the arenas if they are empty by then and tells whether it did.
+bool alloc_compact_begin(Allocator* allocator);
+bool alloc_moving(Allocator const* allocator, void const* ptr);
+bool alloc_compact_end(Allocator* allocator);
+void* alloc_get_root(Allocator const* allocator);
+void alloc_set_root(Allocator* allocator, void* root);
+ptrdiff_t alloc_get_relocation(Allocator const* allocator); // non-zero if stored pointers were moved on open
+uint64_t alloc_offset(Allocator const* allocator, void const* ptr); // position of ptr in the file
+void* alloc_at(Allocator const* allocator, uint64_t offset);
+// Statistics. Every thread counts its own allocations and frees, and the
+// counts are added up when they are read, so counting costs next to nothing.
+// Blocks fall into classes: slots of 16, 32, 48, 64 and 80 bytes, then buddy
+// blocks of 128 bytes and up, each class twice the size of the one before.
+#define ALLOC_NCLASSES 39 // up to blocks as large as the largest file
+
+typedef struct AllocStats {
+    uint64_t file_bytes;      // length of the file
+    uint64_t heap_bytes;      // that blocks are handed out from, the allocator's own metadata aside
+    uint64_t used_bytes;      // of the buddy blocks handed out, slabs included
+    uint64_t free_bytes;      // of the buddy blocks not handed out
+    uint64_t largest_free;    // bytes of the largest free buddy block
+    double fragmentation;     // share of the free bytes outside the largest free block
+    uint64_t class_size[ALLOC_NCLASSES];  // bytes of a block of each class
+    uint64_t live_blocks[ALLOC_NCLASSES]; // allocated and not freed yet, retired ones included
+    uint64_t live_bytes[ALLOC_NCLASSES];
+    uint64_t mallocs;         // blocks allocated since the heap was opened
+    uint64_t frees;           // and freed
+    uint64_t requested_bytes; // asked for by those allocations
+    uint64_t rounding_bytes;  // added to them by rounding up to the sizes of the classes
+    uint64_t retired;         // blocks waiting for readers to leave, a slab retired whole counting once
+    int narenas;
+} AllocStats;
+
+void alloc_get_stats(Allocator* allocator, AllocStats* res); // may run concurrently with anything
+bool alloc_sync(Allocator* allocator); // writes a heap that is not logged back to the file
+bool alloc_set_logged(Allocator* allocator, bool logged); // turning logging off needs a checkpoint first
 void alloc_destroy(Allocator* allocator);
 
 #endif //LLP_LAB1_ALLOCATOR_H
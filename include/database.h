@@ -1,6 +1,7 @@
 #ifndef LLP_LAB1_DATABASE_H
 #define LLP_LAB1_DATABASE_H
 
+#include "allocator.h"
 #include "types.h"
 #include "database_iterator.h"
 
@@ -9,8 +10,28 @@
 typedef struct Database Database;
 typedef struct Node Directory;
 typedef struct Node Leaf;
+typedef struct Snapshot Snapshot;
 
-Database* database_create_database(char const* filename, size_t initial_size);
+// Thread safety. Creating, opening, shutting down and destroying a database
+// must not overlap with any other call on it; the rest of the functions may
+// be called from several threads at once. Changes take the lock of their
+// directory, so threads changing different directories rarely wait for
+// each other. With a write-ahead log, changes are made one at a time, in
+// the order they are logged in. A transaction keeps other changes out from
+// begin to commit. Reads take no locks and do not wait for transactions or
+// snapshots; a lookup in a directory that has no index yet builds one only
+// if the locks it needs are free, and scans the directory otherwise. Reads
+// wait only while a checkpoint, a compaction or database_set_wal runs.
+//
+// Deleted nodes, replaced strings and the like are freed only once no
+// reader can be looking at them. A thread keeps what it reads valid by
+// reading inside of a read section: handles, iterators and values it gets
+// there stay readable until database_read_end, even if other threads
+// delete or update them meanwhile. Outside of read sections, handles are
+// valid only as long as nobody deletes their nodes. Iterators over ordered
+// directories (iterator_seek) must not run while their directory changes.
+Database* database_create_database(char const* filename, size_t initial_size); // erases existing file
+Database* database_open_database(char const* filename); // opens an existing file, NULL if it is not a database
 
 void database_shutdown_database(Database* ptr); // does not erase any data
 void database_destroy_database(Database* ptr); // clears all data before shutting down
@@ -23,11 +44,119 @@ void database_clear_directory(Database* db, Directory* dir);
 
 Leaf* database_create_leaf(Database* db, Directory* parent, char const* name,
                            Types type, Value value);
-bool database_update_leaf(Database* db, Leaf* leaf, Value new_value);
-Value const* database_get_leaf_value(Database const* db, Leaf const* leaf);
+bool database_update_leaf(Database* db, Leaf* leaf, Value new_value); // false if the leaf was deleted meanwhile
+Value const* database_get_leaf_value(Database const* db, Leaf const* leaf); // may change under concurrent updates
+// Copies the value of a leaf as it was at some point, even while other
+// threads update it; a string it points to stays valid until the end of
+// the read section it was read in.
+bool database_read_leaf_value(Database* db, Leaf const* leaf, Value* res);
 bool database_delete_leaf(Database* db, Leaf* ptr);
 
+// Finds a child by name in constant time. The directory gets a hash index of
+// its children on the first call, which is kept up to date afterwards.
+Node* database_find_child(Database* db, Directory* dir, char const* name);
+// Resolves a slash separated path like "/a/b/c" starting at the root.
+// Resolved paths are cached, so repeated lookups skip the walk.
+Node* database_resolve_path(Database* db, char const* path);
+// Keeps the children of dir ordered by name in a B+-tree, so that they can
+// be iterated in order and from any key with iterator_seek.
+bool database_set_ordered(Database* db, Directory* dir, bool ordered);
+// Makes creating a child with a name that is already taken in dir fail.
+// Returns false if dir already has children with equal names.
+bool database_set_unique_names(Database* db, Directory* dir, bool unique);
+// Keeps the values of the children of dir, which must all be leaves of the
+// type INT, FLOAT or BOOL, in a dense column as well, so that aggregates
+// over them scan an array of numbers rather than the nodes. Creating a
+// child of another type in dir fails then; type 0 drops the column.
+// Returns false if dir already has children of another type.
+bool database_set_columnar(Database* db, Directory* dir, Types type);
+// Sums, counts, or finds the least or the greatest of the INT, FLOAT and BOOL
+// children of dir, a BOOL counting as 0 or 1. Fast for columnar directories,
+// a walk over the children otherwise. False if there is no MIN or MAX.
+bool database_aggregate(Database* db, Directory* dir, Aggregate op, double* res);
+
+// Makes the file crash safe with a write-ahead log kept next to it, in
+// "<filename>-wal". Changes then stay in memory and are logged; the log is
+// synced once per group of changes, and checkpoints copy the changes into
+// the file. After a crash, opening the file replays the log, losing at most
+// the changes after the last sync. A file opened with a log keeps using it.
+bool database_set_wal(Database* db, bool enabled);
+bool database_sync(Database* db); // makes all changes made so far durable
+bool database_checkpoint(Database* db); // writes all logged changes into the file
+// Moves what is allocated towards the start of the file and cuts off the
+// end of the file that is left empty, so that the file tracks the data it
+// holds rather than the most it ever held. Handles, iterators and values got
+// before are invalid afterwards. Fails while snapshots are open, or inside
+// a transaction or a read section.
+bool database_compact(Database* db);
+
+// Groups changes into a transaction, which is applied on commit all at once
+// or not at all, and is synced to the log once. Nodes created in it are
+// allocated in bulk and can be used right away, as parents of other new
+// nodes too, but appear in their directories only on commit. Likewise,
+// updates and deletions of nodes that existed before show on commit.
+bool database_begin(Database* db);
+bool database_commit(Database* db); // false if the transaction had to be aborted
+void database_abort(Database* db);
+
+// Read sections nest and never wait for other readers or for writers, only
+// for transactions and checkpoints. A thread in a read section may make
+// changes, but cannot begin a transaction or checkpoint, and a read section
+// must not span the beginning or end of a transaction.
+bool database_read_begin(Database* db);
+void database_read_end(Database* db);
+
+// A snapshot is a read-only view of the whole tree as it was when it was
+// taken. Its iterators see neither the changes made after that nor the
+// nodes created since, and still see the nodes deleted since, while other
+// threads go on changing the tree. They take no locks, so long scans and
+// backups neither wait for writers nor hold them up, and everything they
+// return stays readable until the snapshot is released.
+// While snapshots are open, changes keep what they replace in memory,
+// deleted nodes are freed only once no open snapshot sees them, and a
+// write-ahead log is not checkpointed. Taking and releasing a snapshot
+// waits for the calls inside the database to finish, and fails inside of
+// transactions and read sections. Snapshots left open are released by
+// shutting the database down.
+Snapshot* database_snapshot(Database* db);
+bool database_release_snapshot(Database* db, Snapshot* snapshot);
+
 Iterator database_get_directory_content_iterator(Database const* db, Directory const* dir);
+// Iterates the children of dir as the snapshot sees them; handles of
+// directories it gives can be passed back to it. Invalid if the snapshot
+// does not see dir.
+Iterator database_get_snapshot_iterator(Snapshot const* snapshot, Directory const* dir);
+
+// Statistics. Every thread counts its own calls and the nodes it creates
+// and frees, and the counts are added up when they are read, so counting
+// costs next to nothing. The nodes there were when the database was opened
+// are counted by a walk over the tree the first time statistics are asked
+// for, which waits for the calls inside the database like taking a snapshot
+// does, and fails inside of read sections.
+typedef enum DbOp {
+    DB_OP_CREATE,    // of directories and leaves
+    DB_OP_UPDATE,
+    DB_OP_DELETE,    // of directories and leaves
+    DB_OP_CLEAR,
+    DB_OP_READ,      // of leaf values
+    DB_OP_LOOKUP,    // of children and paths
+    DB_OP_SCAN,      // iterators
+    DB_OP_AGGREGATE,
+    DB_OP_COMMIT,
+    DB_OP_ABORT,
+    DB_NOPS,
+} DbOp;
+
+#define DB_NTYPES 5
+
+typedef struct DatabaseStats {
+    uint64_t nodes[DB_NTYPES]; // DIR, INT, STR, FLOAT and BOOL nodes, deleted ones kept for snapshots included
+    uint64_t ops[DB_NOPS];     // calls since the database was opened, replayed changes included
+    uint64_t snapshots;        // open
+    AllocStats heap;
+} DatabaseStats;
+
+bool database_get_stats(Database* db, DatabaseStats* res);
 
 void database_traverse_and_print_database(Database const* db);
 
@@ -3,8 +3,14 @@
 
 #include "types.h"
 
+#include <stdint.h>
+
 typedef struct Iterator {
     Node* _ptr;
+    struct BTreeNode const* _leaf; // position in the ordered index, NULL for plain iteration
+    uint32_t _pos;
+    struct Snapshot const* _snapshot; // NULL for the live tree
+    Value _value; // of the current leaf, as the snapshot sees it
 } Iterator;
 
 Node const* iterator_get(Iterator const* it);
@@ -15,4 +21,8 @@ bool iterator_is_valid(Iterator const* it);
 bool iterator_has_next(Iterator const* it);
 bool iterator_next(Iterator* it);
 
+// Iterates the children of an ordered directory by name, starting with the
+// first one not less than key. Gives an invalid iterator for other directories.
+Iterator iterator_seek(Node const* dir, char const* key);
+
 #endif //LLP_LAB1_DATABASE_ITERATOR_H
@@ -1,8 +1,16 @@
 #ifndef LLP_LAB1_INTERNALS_H
 #define LLP_LAB1_INTERNALS_H
 
+#include "allocator.h"
 #include "types.h"
 
+#include <stddef.h>
+
+// Shift a pointer into the mapped file by delta bytes; NULL stays NULL
+#define RELOCATE(p, delta) do {                        \
+    if (p) (p) = (void*) ((char*) (p) + (delta));      \
+} while (0)
+
 typedef struct List {
     struct List* next;
     struct List* prev;
@@ -14,16 +22,298 @@ void lst_push(List*, void*);
 void* lst_pop(List*);
 void lst_print(List*);
 int lst_empty(List*);
+void lst_relocate(List*, ptrdiff_t);
 
+// Names and string values that are short enough are kept right in the node,
+// which saves an allocation and a dependent load per access. The name goes
+// first in inline_data; a string value is stored inline if it fits in the
+// rest, and data.str_value.data then points into the node itself.
+// If the name is too long, inline_data starts with a pointer to it instead.
+// Both are stored with their NULs, so a name of up to 31 bytes is inline,
+// and a name of 7 bytes leaves room for a value of up to 23.
+#define NODE_INLINE_SIZE 32
+
+enum NodeFlags {
+    NODE_INLINE_NAME = 1, // the name is stored in inline_data
+    NODE_INLINE_STR = 2,  // the string value is stored in inline_data
+    NODE_CACHED = 4,      // the node may be in the path cache
+    NODE_PENDING = 8,     // created in a transaction, linked into its directory on commit
+    NODE_DELETING = 16,   // deleted in a transaction, unlinked on commit
+    NODE_UNLINKED = 32,   // taken out of its directory, freed once readers are done with it
+    NODE_DEAD = 64,       // deleted, but kept in its directory for the snapshots that still see it
+    NODE_HISTORY = 128,   // has changes in the history of the database
+};
+
+typedef struct DirMeta DirMeta;
+
+// What scans and lookups read comes first, in 64 bytes; the links that
+// only changes follow go after it.
 struct Node {
     Types type;
+    uint8_t flags;       // NodeFlags
+    uint8_t inline_used; // bytes of inline_data taken by the name or by the pointer to it
+    uint32_t value_seq;  // odd while the value of the leaf is being changed
     Node* next; // todo use List
-    Node* prev;
-    char* name;
     union {
-        Node* child;
+        struct {
+            Node* child;
+            DirMeta* meta; // NULL until the directory needs it
+        };
         Value data;
     };
+    union {
+        char* name;
+        char inline_data[NODE_INLINE_SIZE];
+    };
+    Node* prev;
+    Node* parent;
+};
+
+_Static_assert(offsetof(Node, prev) == 64, "what scans read should fit in a cache line");
+_Static_assert(sizeof(Node) == 80, "nodes should be a whole number of slab leaves");
+
+// Lock-free readers look at nodes while they change: the flags of a node
+// that others can see change atomically, and links are published with
+// release stores after everything they lead to is filled in.
+static inline uint8_t node_flags(Node const* node) {
+    return __atomic_load_n(&node->flags, __ATOMIC_RELAXED);
+}
+
+static inline uint8_t node_set_flags(Node* node, uint8_t flags) { // returns the old flags
+    return __atomic_fetch_or(&node->flags, flags, __ATOMIC_SEQ_CST);
+}
+
+static inline void node_clear_flags(Node* node, uint8_t flags) {
+    __atomic_fetch_and(&node->flags, (uint8_t) ~flags, __ATOMIC_SEQ_CST);
+}
+
+static inline Types node_type(Node const* node) {
+    return __atomic_load_n(&node->type, __ATOMIC_RELAXED);
+}
+
+static inline Node* node_link(Node* const* link) {
+    return __atomic_load_n(link, __ATOMIC_ACQUIRE);
+}
+
+static inline char const* node_name(Node const* node) {
+    return (node_flags(node) & NODE_INLINE_NAME) ? node->inline_data : node->name;
+}
+
+// Hash index of the children of a directory by name
+typedef struct IndexEntry {
+    uint64_t hash; // 0 if the entry is empty
+    Node* node;
+} IndexEntry;
+
+typedef struct Index {
+    IndexEntry* table; // NULL if the index is not built
+    uint64_t capacity; // power of 2
+    uint64_t size;
+    uint64_t seq;      // odd while the table is being changed
+} Index;
+
+uint64_t idx_hash(char const* name);
+bool idx_init(Allocator*, Index*, uint64_t capacity); // of an index nobody reads yet
+void idx_replace(Allocator*, Index*, Index const* built); // publishes a complete index at once
+void idx_destroy(Allocator*, Index*);
+bool idx_insert(Allocator*, Index*, Node*);
+Node* idx_find(Index const*, char const* name);
+void idx_remove(Index*, Node*);
+void idx_relocate(Index*, ptrdiff_t);
+
+// B+-tree of the children of a directory ordered by name
+#define BT_LEAF_CAPACITY 30
+#define BT_INNER_CAPACITY 9
+
+typedef struct BTreeKey {
+    char* name; // own copy of the name
+    Node* tie;  // orders equal names
+} BTreeKey;
+
+typedef struct BTreeNode BTreeNode;
+
+struct BTreeNode {
+    uint16_t leaf;
+    uint16_t count; // the number of entries or keys
+    uint32_t reserved;
+    BTreeNode* next; // next leaf
+    union {
+        Node* entries[BT_LEAF_CAPACITY];
+        struct {
+            BTreeKey keys[BT_INNER_CAPACITY];
+            BTreeNode* children[BT_INNER_CAPACITY + 1];
+        };
+    };
 };
 
+_Static_assert(sizeof(BTreeNode) == 256, "b-tree nodes should take four cache lines");
+
+typedef struct BTree {
+    BTreeNode* root; // NULL if the directory is not ordered
+} BTree;
+
+bool bt_init(Allocator*, BTree*);
+void bt_destroy(Allocator*, BTree*);
+bool bt_insert(Allocator*, BTree*, Node*);
+void bt_remove(BTree*, Node*);
+bool bt_seek(BTree const*, char const* name, BTreeNode const** leaf, uint32_t* pos);
+bool bt_next(BTreeNode const** leaf, uint32_t* pos);
+void bt_relocate(BTree*, ptrdiff_t);
+
+// Hash tables keyed by the addresses of nodes, see node_table.c. A table is
+// a power of 2 of entries of entry_size bytes, each starting with its node;
+// empty entries are all zeros.
+void* ntab_entry(void* table, size_t entry_size, uint64_t nslots, Node const*); // or the empty one it would take
+void ntab_remove(void* table, size_t entry_size, uint64_t nslots, void* entry);
+
+// Dense column of the values of the children of a directory whose
+// children are all INT, FLOAT or BOOL leaves of the same type. The header,
+// the values, their leaves and the positions of the leaves are one block.
+typedef struct ColumnSlot {
+    Node* node; // NULL if the slot is empty; must be first, see ntab_entry
+    uint64_t pos;
+} ColumnSlot;
+
+typedef struct Column {
+    Types type;
+    uint64_t size;
+    uint64_t capacity; // power of 2
+    _Alignas(16) unsigned char values[]; // in no particular order
+} Column;
+
+Column* col_create(Allocator*, Types type, uint64_t capacity); // NULL if out of memory
+size_t col_bytes(Column const*);
+bool col_insert(Allocator*, Column**, Node*); // may replace the column with a larger one
+void col_remove(Column*, Node*);
+void col_update(Column*, Node const*); // copies the value of the leaf again
+void col_clear(Column*);
+bool col_aggregate(Column const*, Aggregate, double* res); // false if there are no values to take MIN or MAX of
+void col_relocate(Column*, ptrdiff_t);
+
+// Data that only some directories need
+struct DirMeta {
+    Index index;    // built on the first lookup by name
+    BTree order;    // built when the directory is made ordered
+    bool unique;    // children must have distinct names
+    void* chunk;    // the children are allocated from, once there are a few of them
+    Column* column; // NULL unless the directory is columnar
+};
+
+// Bounded cache of resolved paths, kept in memory only
+#define PATH_CACHE_SIZE 1024
+
+typedef struct PathCacheEntry {
+    uint64_t hash;
+    char* path; // NULL if the entry is empty
+    Node* node;
+} PathCacheEntry;
+
+typedef struct PathCache {
+    PathCacheEntry entries[PATH_CACHE_SIZE];
+} PathCache;
+
+void pc_init(PathCache*);
+void pc_clear(PathCache*);
+Node* pc_find(PathCache const*, char const* path, uint64_t hash);
+void pc_insert(PathCache*, char const* path, uint64_t hash, Node*);
+void pc_invalidate(PathCache*, Node*);
+
+// Changes that open snapshots must not see, kept in memory. A record tells
+// what the change replaced, so that older snapshots can read around it.
+typedef enum HistoryType {
+    HST_CREATE, // the node was created
+    HST_UPDATE, // the value of the leaf was old
+    HST_DELETE, // the node was buried
+} HistoryType;
+
+typedef struct HistoryRecord {
+    List link; // in the history, newest first
+    uint64_t version;
+    HistoryType type;
+    bool owns_str; // old holds a copy of a string
+    Node* node;
+    Value old;
+    struct HistoryRecord* older; // the previous record of the same node
+} HistoryRecord;
+
+typedef struct HistoryEntry {
+    Node* node; // NULL if the entry is empty; must be first, see ntab_entry
+    HistoryRecord* newest;
+} HistoryEntry;
+
+typedef struct History {
+    List records;
+    HistoryEntry* table; // the newest record of each node, by address
+    uint64_t capacity;   // power of 2, or 0
+    uint64_t size;
+} History;
+
+void hst_init(History*);
+HistoryRecord* hst_add(History*, uint64_t version, HistoryType, Node*, Value const* old); // NULL if out of memory
+HistoryRecord* hst_find(History const*, Node const*); // the newest record of the node
+HistoryRecord* hst_newest(History const*);
+HistoryRecord* hst_oldest(History const*);
+void hst_remove(History*, HistoryRecord*);
+void hst_free(HistoryRecord*);
+void hst_destroy(History*);
+
+// Reads of a snapshot, see database.c
+struct Snapshot;
+bool snapshot_sees(struct Snapshot const*, Node const*);
+Value snapshot_value(struct Snapshot const*, Node const* leaf);
+
+// Position an iterator at the first node from ptr on that it shows
+struct Iterator;
+void iterator_settle(struct Iterator*, Node* ptr);
+
+// Write-ahead log of changes to a database, kept next to its file
+#define WAL_BUFFER_SIZE (1 << 16)      // records are written in batches of this size
+#define WAL_GROUP_SIZE (1 << 18)       // bytes of records made durable by one sync
+#define WAL_CHECKPOINT_SIZE (1 << 26)  // log size that triggers a checkpoint
+
+typedef enum WalRecordType {
+    WAL_CREATE_DIR = 1, // args: parent, new node; data: name
+    WAL_CREATE_LEAF,    // args: parent, new node, type; data: name, value
+    WAL_UPDATE,         // args: leaf; data: -, value
+    WAL_DELETE,         // args: node, whether it was buried
+    WAL_CLEAR,          // args: directory
+    WAL_INDEX,          // args: directory whose index was built
+    WAL_ORDERED,        // args: directory, flag
+    WAL_UNIQUE,         // args: directory, flag
+    WAL_COLUMNAR,       // args: directory, type of the column or 0
+    WAL_BEGIN,          // args: whether deleted nodes are buried; the changes up to the next commit or abort are a transaction
+    WAL_COMMIT,         // args: whether the commit succeeded
+    WAL_ABORT,
+    WAL_RECLAIM,        // args: the number of retired blocks freed
+    WAL_PURGE,          // args: buried node that was freed
+    WAL_COMPACT,        // the file was compacted; replay does it again
+    WAL_PAGE,           // args: offset in the file; data: page image
+    WAL_CHECKPOINT,     // args: length of the file; all pages before it are in the file
+} WalRecordType;
+
+// Nodes are referred to by their offset in the file, which does not change
+// when the file is mapped at another address
+typedef struct WalRecord {
+    uint64_t checksum; // of the rest of the record, including the data
+    uint32_t type;     // WalRecordType
+    uint32_t reserved;
+    uint64_t len[2];   // lengths of the two byte strings that follow the record
+    uint64_t args[3];
+} WalRecord;
+
+typedef struct Wal Wal;
+
+bool wal_exists(char const* filename);
+void wal_remove(char const* filename);
+Wal* wal_open(char const* filename); // finishes a checkpoint that was interrupted by a crash
+bool wal_replay(Wal*, bool (*apply)(void* ctx, WalRecord const*), void* ctx);
+bool wal_append(Wal*, WalRecord*, void const* data0, void const* data1);
+bool wal_sync(Wal*);
+uint64_t wal_pending(Wal const*); // bytes appended since the last sync
+uint64_t wal_size(Wal const*);
+bool wal_reset(Wal*);
+void wal_close(Wal*);
+
+bool alloc_checkpoint(Allocator*, Wal*);
+
 #endif //LLP_LAB1_INTERNALS_H
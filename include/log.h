@@ -0,0 +1,43 @@
+#ifndef LLP_LAB1_LOG_H
+#define LLP_LAB1_LOG_H
+
+#include <stdbool.h>
+
+// Diagnostics. Messages go to a sink, stderr unless the embedding process
+// sets one, and only those at the level set at run time or above do; the
+// rest cost a load and a comparison. Statements below LOG_MIN_LEVEL are not
+// compiled in at all, arguments included, so trace statements can sit on
+// hot paths. Sinks are called one at a time.
+typedef enum LogLevel {
+    LOG_LEVEL_TRACE,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF,
+} LogLevel;
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Gets a message without the line break, formatted already
+typedef void (*LogSink)(void* ctx, LogLevel level, char const* message);
+
+void log_set_level(LogLevel level); // LOG_LEVEL_WARN at first
+void log_set_sink(LogSink sink, void* ctx); // NULL for stderr
+char const* log_level_name(LogLevel level);
+void log_write(LogLevel level, char const* format, ...) __attribute__((format(printf, 2, 3)));
+
+extern int log_level;
+
+#define LOG_ENABLED(level) ((level) >= LOG_MIN_LEVEL && (int) (level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+// LOG(DEBUG, "format", ...)
+#define LOG(level, ...) do {                                \
+    if (LOG_ENABLED(LOG_LEVEL_##level)) {                   \
+        log_write(LOG_LEVEL_##level, __VA_ARGS__);          \
+    }                                                       \
+} while (0)
+
+#endif //LLP_LAB1_LOG_H
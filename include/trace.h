@@ -0,0 +1,67 @@
+#ifndef LLP_LAB1_TRACE_H
+#define LLP_LAB1_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Tracing of single operations on hot paths: creating, updating and
+// deleting nodes, and allocating and freeing buddy blocks. The trace points
+// are compiled in only with the TRACING definition (the LLP_LAB1_TRACING
+// CMake option), and then cost a load and a branch until tracing is turned
+// on. Each traced operation becomes an event with its duration, which goes
+// to the hook if one is set and into a ring buffer otherwise. Writers never
+// wait for each other; when the ring is full, the oldest events not drained
+// yet are overwritten and counted as lost.
+typedef enum TraceOp {
+    TRACE_CREATE_LEAF,
+    TRACE_UPDATE_LEAF,
+    TRACE_DELETE_NODE,
+    TRACE_BD_ALLOC,
+    TRACE_BD_FREE,
+    NTRACE_OPS,
+} TraceOp;
+
+typedef struct TraceEvent {
+    uint64_t start_ns;    // by the monotonic clock
+    uint64_t duration_ns;
+    uint64_t size;        // bytes asked for or freed, or of the value written
+    uint8_t op;           // TraceOp
+    int8_t size_class;    // k of the buddy block, for bd_alloc and bd_free
+    uint8_t levels;       // blocks bd_alloc split, or bd_free merged
+    bool failed;
+} TraceEvent;
+
+// Runs on the thread of the operation, possibly under locks of the allocator
+// or the database, which it must not call back into
+typedef void (*TraceHook)(void* ctx, TraceEvent const* event);
+
+void trace_set_enabled(bool enabled); // off at first
+void trace_set_hook(TraceHook hook, void* ctx); // NULL for the ring buffer
+// Moves the oldest events of the ring buffer into res, at most n of them
+size_t trace_drain(TraceEvent* res, size_t n);
+uint64_t trace_lost(void); // events overwritten before they were drained
+char const* trace_op_name(TraceOp op);
+uint64_t trace_now(void);
+void trace_emit(TraceEvent const* event);
+
+extern bool trace_on;
+
+#ifdef TRACING
+// Start timing an operation, into a variable of the given name
+#define TRACE_BEGIN(start) uint64_t start = __atomic_load_n(&trace_on, __ATOMIC_RELAXED) ? trace_now() : 0
+// Emit the event of an operation, given its fields: TRACE_END(start, .op = ..., .size = ...)
+#define TRACE_END(start, ...) do {                                                                     \
+    if (start) {                                                                                       \
+        TraceEvent _trace_event = { .start_ns = (start), __VA_ARGS__ };                                \
+        _trace_event.duration_ns = trace_now() - (start);                                              \
+        trace_emit(&_trace_event);                                                                     \
+    }                                                                                                  \
+} while (0)
+#else
+#define TRACE_BEGIN(start)
+// the fields are still looked at, so the variables kept for them are used
+#define TRACE_END(start, ...) do { (void) sizeof((TraceEvent) { __VA_ARGS__ }); } while (0)
+#endif
+
+#endif //LLP_LAB1_TRACE_H
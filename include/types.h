@@ -24,6 +24,13 @@ typedef union Value {
     bool bool_value;
 } Value;
 
+typedef enum Aggregate {
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_COUNT
+} Aggregate;
+
 typedef struct Node Node;
 
 #endif //LLP_LAB1_TYPES_H
@@ -1,11 +1,16 @@
 #include "allocator.h"
 #include "internals.h"
+#include "log.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <memory.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 // Buddy allocator
@@ -13,27 +18,89 @@
 // The allocator has sz_info for each size k. Each sz_info has a free
 // list, an array alloc to keep track which blocks have been
 // allocated, and a split array to keep track which blocks have
-// been split. The arrays are of type char (which is 1 byte), but the
-// allocator uses 1 bit per block (thus, one char records the info of
-// 8 blocks).
+// been split. The arrays are of bytes, but the allocator uses 1 bit per
+// block (thus, one byte records the info of 8 blocks).
+// Besides that, the allocator keeps one byte per LEAF_SIZE block with the
+// size k of the allocated block starting there, so that free does not have
+// to search the split arrays.
 // Allocator supports allocation up to 8e6 TB of memory.
 typedef struct {
     List free;
-    char* split;
-    char* pair_state;
+    uint8_t* split;
+    uint8_t* pair_state;
 } Sz_info;
 
 typedef struct {
     int nsizes;     // the number of entries in bd_sizes array
     Sz_info* sizes; // array of size levels
     void* base;     // start address of memory managed by the buddy allocator
+    void* end;      // end address of memory managed by the buddy allocator
+    uint8_t* size_class; // size k of the allocated block at each LEAF_SIZE block
+    uint64_t used;  // bytes of the blocks handed out, not counting buddy's metadata
+    uint64_t avail; // bytes of the blocks it can hand out, used or free
 } BuddyAllocator;
 
+// The superblock lives at offset 0 of the file. Everything the allocator
+// needs to pick the heap up again after a restart is stored here, so
+// reopening a file is just an mmap. All pointers inside the file are plain
+// addresses valid at `base_addr`; the file is mapped back at that address
+// when possible and relocated otherwise (see alloc_open).
+//
+// The file grows by appending arenas, each managed by its own buddy
+// allocator. Every new arena is as large as the whole file before it, so the
+// file doubles on each growth. A large range of address space is reserved
+// up front, so that arenas are mapped right after each other and pointers
+// stay valid while the file grows.
+#define SUPERBLOCK_MAGIC 0x3162646c61707c6cULL // "l|paldb1"
+#define SUPERBLOCK_VERSION 14
+#define MAX_ARENAS 48
+#define NSLAB_CLASSES 5 // slabs of 16, 32, 48, 64 and 80 byte slots, the last for nodes
+#define MAX_MAPPING_SIZE (1ULL << 40) // address space reserved for one file
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    void* base_addr;   // address the file was mapped at when last used
+    uint64_t file_len; // length of the file
+    void* root;        // root object of the allocator's user
+    int narenas;       // the number of entries in arenas array
+    BuddyAllocator arenas[MAX_ARENAS]; // arenas in address order
+    List slabs[NSLAB_CLASSES]; // slabs with free slots for each size class
+    uint64_t live_blocks[ALLOC_NCLASSES]; // blocks in use in each class when the counters were last saved
+} Superblock;
+
+// Allocations and frees of each class of the statistics, since the heap was
+// opened. Each thread keeps its own in its cache; the ones made under the
+// lock anyway are kept by the allocator.
+typedef struct AllocCounters {
+    uint64_t mallocs[ALLOC_NCLASSES];
+    uint64_t frees[ALLOC_NCLASSES];
+    uint64_t requested; // bytes asked for by the allocations
+} AllocCounters;
+
 struct Allocator {
-    BuddyAllocator bd; // buddy allocator
-    FILE* mmap_file;   // memory mapped file with data
-    void* mmap_addr;   // start of memory mapped region
-    size_t mmap_len;   // length of memory mapped file
+    Superblock* sb;      // superblock at the start of the mapped region
+    FILE* mmap_file;     // memory mapped file with data
+    void* mmap_addr;     // start of memory mapped region (and of reserved address space)
+    size_t mmap_len;     // length of memory mapped file
+    ptrdiff_t relocation; // how far the file moved since it was last mapped
+    bool logged;         // mapped privately, changes reach the file only at checkpoints
+    pthread_mutex_t lock; // taken by allocations and frees that miss the thread caches
+    uint64_t id;         // tells the thread caches of allocators apart
+    struct ThreadCache* caches; // of all threads that used the allocator
+    uint64_t epoch;      // advanced once every reader has seen the current value
+    struct Retired* retired; // blocks waiting for readers to finish, oldest first
+    size_t retired_head; // index of the oldest entry in retired
+    size_t retired_len;
+    size_t retired_cap;
+    uint64_t* pins;      // epochs held by alloc_pin
+    size_t npins;
+    size_t pins_cap;
+    uint64_t readers;    // threads in read sections, counted so they can be told of without the lock
+    int keep;            // arenas allocations come from while compacting, 0 otherwise
+    AllocCounters counters; // of the allocations and frees made under the lock
+    AllocCounters saved; // sums of all counters when the live blocks were last saved
 };
 
 #define LEAF_SIZE 16          // The smallest block size
@@ -45,39 +112,45 @@ struct Allocator {
   (((((n) - 1) / (sz)) + 1) * (sz))  // Round up to the next multiple of sz
 
 
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "cppcoreguidelines-narrowing-conversions"
-
 // Return 1 if a bit at position `index` in `array` is set to 1
-bool bit_isset(char const* array, size_t index) {
-    char b = array[index / 8];
-    char m = (1 << (index % 8));
-    return (b & m) == m;
+bool bit_isset(uint8_t const* array, size_t index) {
+    return (array[index / 8] >> (index % 8)) & 1;
 }
 
 // Set a bit at position `index` in `array` to 1
-void bit_set(char* array, size_t index) {
-    char b = array[index / 8];
-    char m = (1 << (index % 8));
-    array[index / 8] = (b | m);
+void bit_set(uint8_t* array, size_t index) {
+    array[index / 8] |= (uint8_t) (1u << (index % 8));
 }
 
 // Clear bit at position `index` in `array`
-void bit_clear(char* array, size_t index) {
-    char b = array[index / 8];
-    char m = (1 << (index % 8));
-    array[index / 8] = (b & ~m);
+void bit_clear(uint8_t* array, size_t index) {
+    array[index / 8] &= (uint8_t) ~(1u << (index % 8));
 }
 
 // Flip bit at position `index` in `array`
-void bit_flip(char* array, size_t index) {
-    array[index / 8] ^= (1 << (index % 8));
+void bit_flip(uint8_t* array, size_t index) {
+    array[index / 8] ^= (uint8_t) (1u << (index % 8));
 }
 
-#pragma clang diagnostic pop
+// Set the bits [from, to) of `array`: the partial bytes at the ends by
+// masks, and the whole bytes between them by memset, which goes as wide as
+// the machine does
+void bit_set_range(uint8_t* array, size_t from, size_t to) {
+    if (from >= to) return;
+    size_t first = from / 8, last = (to - 1) / 8;
+    uint8_t head = (uint8_t) (0xffu << (from % 8));
+    uint8_t tail = (uint8_t) (0xffu >> (7 - (to - 1) % 8));
+    if (first == last) {
+        array[first] |= head & tail;
+        return;
+    }
+    array[first] |= head;
+    memset(array + first + 1, 0xff, last - first - 1);
+    array[last] |= tail;
+}
 
 // Print a bit vector as a list of ranges of 1 bits
-void bd_print_vector(char const* vector, size_t len) {
+void bd_print_vector(uint8_t const* vector, size_t len) {
     bool last = 1;
     size_t lb = 0;
     for (size_t b = 0; b < len; b++) {
@@ -133,6 +206,7 @@ void* addr(BuddyAllocator const* bd, int k, size_t bi) {
 
 // allocate nbytes, but malloc won't return anything smaller than LEAF_SIZE
 void* bd_alloc(BuddyAllocator* bd, size_t nbytes) {
+    TRACE_BEGIN(start);
 
     // Find a free block >= nbytes, starting with smallest k possible
     int fk = firstk(nbytes);
@@ -141,13 +215,10 @@ void* bd_alloc(BuddyAllocator* bd, size_t nbytes) {
         if (!lst_empty(&bd->sizes[k].free)) break;
     }
     if (k >= bd->nsizes) {  // No free blocks?
-        // todo grow file size (setup another buddy allocator for next mmap_len batch of bytes, call ftruncate)
-        assert(false);
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "UnreachableCode"
+        TRACE_END(start, .op = TRACE_BD_ALLOC, .size = nbytes, .size_class = fk, .failed = true);
         return NULL;
-#pragma clang diagnostic pop
     }
+    int found = k;
 
     // Found a block; pop it and potentially split it.
     char* p = lst_pop(&bd->sizes[k].free);
@@ -160,29 +231,36 @@ void* bd_alloc(BuddyAllocator* bd, size_t nbytes) {
         bit_set(bd->sizes[k - 1].pair_state, blk_index(bd, k, p));
         lst_push(&bd->sizes[k - 1].free, q);
     }
+    bd->size_class[blk_index(bd, 0, p)] = fk;
+    bd->used += BLK_SIZE(fk);
 
+    TRACE_END(start, .op = TRACE_BD_ALLOC, .size = nbytes, .size_class = fk, .levels = found - fk);
     return p;
 }
 
-void* alloc_malloc(Allocator* allocator, size_t size) {
-    return bd_alloc(&allocator->bd, size);
-}
+bool alloc_grow(Allocator* allocator, size_t nbytes);
 
-// Find the size of the block that p points to.
-int size(BuddyAllocator const* bd, char* p) {
-    for (int k = 0; k < bd->nsizes; k++) {
-        if (bit_isset(bd->sizes[k + 1].split, blk_index(bd, k + 1, p))) {
-            return k;
-        }
+// Allocate a buddy block from the first arena that has one, growing the file
+// if none has. Compaction empties the last arenas, so it does not grow.
+void* buddy_malloc(Allocator* allocator, size_t nbytes) {
+    Superblock* sb = allocator->sb;
+    // lower arenas first, so that data gathers at the start of the file
+    for (int i = 0; i < (allocator->keep ? allocator->keep : sb->narenas); i++) {
+        void* res = bd_alloc(&sb->arenas[i], nbytes);
+        if (res) return res;
     }
-    return 0;
+    if (allocator->keep || !alloc_grow(allocator, nbytes)) return NULL;
+    return bd_alloc(&sb->arenas[sb->narenas - 1], nbytes);
 }
 
 // Free memory pointed to by p, which was earlier allocated using bd_alloc.
 void bd_free(BuddyAllocator* bd, void* p) {
-    int k;
+    TRACE_BEGIN(start);
+    int k = bd->size_class[blk_index(bd, 0, p)];
+    int fk = k;
+    bd->used -= BLK_SIZE(k);
 
-    for (k = size(bd, p); k < MAXSIZE(bd->nsizes); k++) {
+    for (; k < MAXSIZE(bd->nsizes); k++) {
         size_t bi = blk_index(bd, k, p);
         size_t buddy = (bi % 2 == 0) ? bi + 1 : bi - 1;
         bit_flip(bd->sizes[k].pair_state, bi / 2);         // flip state
@@ -199,10 +277,583 @@ void bd_free(BuddyAllocator* bd, void* p) {
         bit_clear(bd->sizes[k + 1].split, blk_index(bd, k + 1, p));
     }
     lst_push(&bd->sizes[k].free, p);
+    TRACE_END(start, .op = TRACE_BD_FREE, .size = BLK_SIZE(fk), .size_class = fk, .levels = k - fk);
+}
+
+// Find the arena that manages address p
+BuddyAllocator* arena_of(Superblock* sb, void const* p) {
+    int i = __atomic_load_n(&sb->narenas, __ATOMIC_ACQUIRE) - 1; // frees may not hold the lock
+    while (i > 0 && (char const*) p < (char const*) sb->arenas[i].base) i--;
+    return &sb->arenas[i];
+}
+
+// Slab allocator
+
+// Small objects (nodes, short strings) are not worth a buddy block each.
+// They are served from slabs: SLAB_SIZE buddy blocks carved into slots of
+// one size class, with a bitmap of free slots in the slab header. Slabs
+// that have free slots are kept on the partial list of their class.
+// The size class map entries of all leaf blocks in a slab are set to
+// SLAB_MARK, which is how alloc_free tells slots from buddy blocks; the
+// header of a slot is found by rounding its address down to SLAB_SIZE.
+// A slab owned as a chunk (see alloc_malloc_in) is on no list; its free
+// slots are for its owner only.
+#define SLAB_SIZE 4096
+#define SLAB_MARK 0xff
+#define SLAB_HEADER_SIZE 64  // keeps 64-byte slots cache line aligned
+#define SLAB_MAX_SLOTS ((SLAB_SIZE - SLAB_HEADER_SIZE) / LEAF_SIZE)
+#define SLAB_CLASS(size) (((size) + LEAF_SIZE - 1) / LEAF_SIZE - 1) // slot size is (class + 1) * LEAF_SIZE
+#define SLOT_SIZE(class) (((class) + 1ULL) * LEAF_SIZE) // unsigned like BLK_SIZE
+
+typedef struct {
+    List link;         // entry of the partial list; must be first
+    uint16_t class;    // size class of the slots
+    uint16_t nfree;    // the number of free slots
+    uint16_t nslots;   // the total number of slots
+    uint16_t owned;    // a chunk, see alloc_malloc_in
+    uint64_t free[ROUNDUP(SLAB_MAX_SLOTS, 64) / 64]; // bit i is set if slot i is free
+} Slab;
+
+_Static_assert(sizeof(Slab) <= SLAB_HEADER_SIZE, "slab header does not fit");
+
+// Take a fresh slab of the given class from buddy
+Slab* slab_create(Allocator* allocator, int class) {
+    Slab* slab = (Slab*) buddy_malloc(allocator, SLAB_SIZE);
+    if (!slab) return NULL;
+    BuddyAllocator* bd = arena_of(allocator->sb, slab);
+    memset(bd->size_class + blk_index(bd, 0, (char*) slab), SLAB_MARK, SLAB_SIZE / LEAF_SIZE);
+
+    slab->class = class;
+    slab->nslots = (SLAB_SIZE - SLAB_HEADER_SIZE) / SLOT_SIZE(class);
+    slab->nfree = slab->nslots;
+    slab->owned = 0;
+    memset(slab->free, 0, sizeof(slab->free));
+    for (size_t i = 0; i < slab->nslots / 64; i++) slab->free[i] = ~0ULL;
+    if (slab->nslots % 64) slab->free[slab->nslots / 64] = (1ULL << (slab->nslots % 64)) - 1;
+    lst_push(&allocator->sb->slabs[class], slab);
+    return slab;
+}
+
+// Give a slab that is on no list back to buddy, whatever is left in it
+void slab_release(Allocator* allocator, Slab* slab) {
+    BuddyAllocator* bd = arena_of(allocator->sb, slab);
+    bd->size_class[blk_index(bd, 0, (char*) slab)] = firstk(SLAB_SIZE);
+    bd_free(bd, slab);
+}
+
+// Give an empty slab back to buddy
+void slab_destroy(Allocator* allocator, Slab* slab) {
+    lst_remove(&slab->link);
+    slab_release(allocator, slab);
+}
+
+// Take the first free slot of a slab that has one
+void* slab_take(Slab* slab) {
+    size_t w = 0;
+    while (!slab->free[w]) w++;
+    size_t i = w * 64 + __builtin_ctzll(slab->free[w]);
+    slab->free[w] &= slab->free[w] - 1;
+    slab->nfree--;
+    return (char*) slab + SLAB_HEADER_SIZE + i * SLOT_SIZE(slab->class);
+}
+
+bool alloc_moving(Allocator const* allocator, void const* ptr);
+
+// First slab of the class with free slots, skipping the ones compaction
+// empties, or a new one
+Slab* slab_partial(Allocator* allocator, int class) {
+    List* partial = &allocator->sb->slabs[class];
+    for (List* p = partial->next; p != partial; p = p->next) {
+        if (!alloc_moving(allocator, p)) return (Slab*) p;
+    }
+    return slab_create(allocator, class);
+}
+
+void* slab_alloc(Allocator* allocator, int class) {
+    Slab* slab = slab_partial(allocator, class);
+    if (!slab) return NULL;
+    void* res = slab_take(slab);
+    if (slab->nfree == 0) lst_remove(&slab->link); // full
+    return res;
+}
+
+Slab* slab_of(BuddyAllocator const* bd, void const* ptr) {
+    return (Slab*) ((char const*) ptr - ((char const*) ptr - (char const*) bd->base) % SLAB_SIZE);
+}
+
+void slab_free(Allocator* allocator, BuddyAllocator const* bd, void* ptr) {
+    Slab* slab = slab_of(bd, ptr);
+    size_t i = ((char*) ptr - (char*) slab - SLAB_HEADER_SIZE) / SLOT_SIZE(slab->class);
+    slab->free[i / 64] |= 1ULL << (i % 64);
+    if (slab->owned) {
+        slab->nfree++;
+        return;
+    }
+
+    List* partial = &allocator->sb->slabs[slab->class];
+    if (slab->nfree++ == 0) {
+        lst_push(partial, slab); // was full
+    } else if (slab->nfree == slab->nslots && partial->next != partial->prev) {
+        slab_destroy(allocator, slab); // empty, and not the last one with free slots
+    }
+}
+
+// Take up to n slots of a class, a whole bitmap word of free slots at a time
+size_t slab_alloc_bulk(Allocator* allocator, int class, size_t n, void** res) {
+    size_t got = 0;
+    while (got < n) {
+        Slab* slab = slab_partial(allocator, class);
+        if (!slab) break;
+        char* slots = (char*) slab + SLAB_HEADER_SIZE;
+        for (size_t w = 0; got < n && slab->nfree > 0; w++) {
+            for (uint64_t bits = slab->free[w]; bits && got < n; bits &= bits - 1) {
+                res[got++] = slots + (w * 64 + __builtin_ctzll(bits)) * SLOT_SIZE(class);
+                slab->free[w] &= slab->free[w] - 1;
+                slab->nfree--;
+            }
+        }
+        if (slab->nfree == 0) lst_remove(&slab->link); // full
+    }
+    return got;
+}
+
+// How many of the blocks ptrs starts with are slots of one slab, 0 if the
+// first is not a slot
+size_t slab_run(Allocator const* allocator, void* const* ptrs, size_t n) {
+    BuddyAllocator const* bd = arena_of(allocator->sb, ptrs[0]);
+    if (bd->size_class[blk_index(bd, 0, ptrs[0])] != SLAB_MARK) return 0;
+    uintptr_t slab = (uintptr_t) slab_of(bd, ptrs[0]);
+    size_t res = 1;
+    while (res < n && (uintptr_t) ptrs[res] - slab < SLAB_SIZE) res++;
+    return res;
+}
+
+// Make a chunk an ordinary slab again; needs the lock
+void slab_disown(Allocator* allocator, Slab* slab) {
+    slab->owned = 0;
+    if (slab->nfree == 0) return; // goes on the partial list when a slot is freed
+    List* partial = &allocator->sb->slabs[slab->class];
+    lst_push(partial, slab);
+    if (slab->nfree == slab->nslots && partial->next != partial->prev) slab_destroy(allocator, slab);
+}
+
+// Counting for the statistics
+
+// Classes of the statistics: the slab classes, then buddy blocks by size
+#define STAT_FIRST_K firstk(SLOT_SIZE(NSLAB_CLASSES - 1) + 1) // of the smallest buddy block handed out
+
+int stat_class(size_t size) {
+    if (size <= SLOT_SIZE(NSLAB_CLASSES - 1)) return SLAB_CLASS(size ? size : 1);
+    int res = NSLAB_CLASSES + firstk(size) - STAT_FIRST_K;
+    return res < ALLOC_NCLASSES ? res : ALLOC_NCLASSES - 1;
+}
+
+uint64_t stat_class_size(int class) {
+    return class < NSLAB_CLASSES ? SLOT_SIZE(class) : BLK_SIZE(class - NSLAB_CLASSES + STAT_FIRST_K);
+}
+
+// Class of an allocated block
+int block_class(BuddyAllocator const* bd, void const* ptr) {
+    uint8_t k = bd->size_class[blk_index(bd, 0, ptr)];
+    return k == SLAB_MARK ? slab_of(bd, ptr)->class : stat_class(BLK_SIZE(k));
+}
+
+// Counters have one writer, the thread or the holder of the lock, and are
+// read by others, hence the atomic stores
+void count(uint64_t* counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void count_mallocs(AllocCounters* counters, size_t size, size_t n) {
+    count(&counters->mallocs[stat_class(size)], n);
+    count(&counters->requested, size * n);
+}
+
+// Thread caches
+
+// Every thread keeps a magazine of free slots for each slab class. Slots are
+// taken from and returned to the magazine without any locking; only an
+// empty magazine is refilled, and a full one is drained by half, under the
+// allocator lock, so most allocations and frees never touch shared state.
+// Magazines are emptied back into the slabs when the allocator is destroyed
+// or becomes logged: replaying a log repeats allocations in one thread, so
+// a logged heap must hand out blocks in a deterministic order, and it does
+// not use the caches.
+#define MAGAZINE_SIZE 64
+#define THREAD_CACHE_SLOTS 4 // allocators a thread finds its caches of quickly
+
+typedef struct Magazine {
+    size_t len;
+    void* slots[MAGAZINE_SIZE];
+} Magazine;
+
+typedef struct ThreadCache {
+    struct ThreadCache* next; // in the list of the allocator
+    pthread_t thread;
+    uint64_t epoch;   // seen by the thread when it started reading, 0 if it is not
+    unsigned reading; // nesting depth of read sections, touched by the thread only
+    Magazine magazines[NSLAB_CLASSES];
+    AllocCounters counters; // of the allocations and frees the thread made without the lock
+} ThreadCache;
+
+typedef struct ThreadCacheRef {
+    uint64_t id; // of the allocator, 0 if unused
+    ThreadCache* cache;
+} ThreadCacheRef;
+
+static _Thread_local ThreadCacheRef thread_caches[THREAD_CACHE_SLOTS];
+
+// The cache of the calling thread, NULL if it cannot be made
+ThreadCache* thread_cache(Allocator* allocator) {
+    ThreadCacheRef* ref = &thread_caches[allocator->id % THREAD_CACHE_SLOTS];
+    if (ref->id == allocator->id) return ref->cache;
+    pthread_mutex_lock(&allocator->lock);
+    ThreadCache* cache = allocator->caches;
+    while (cache && !pthread_equal(cache->thread, pthread_self())) cache = cache->next;
+    if (!cache && (cache = (ThreadCache*) calloc(1, sizeof(ThreadCache)))) {
+        cache->thread = pthread_self();
+        cache->next = allocator->caches;
+        allocator->caches = cache;
+    }
+    pthread_mutex_unlock(&allocator->lock);
+    if (cache) {
+        ref->id = allocator->id;
+        ref->cache = cache;
+    }
+    return cache;
+}
+
+// Return the last n slots of a magazine to their slabs; needs the lock
+void drain_magazine(Allocator* allocator, Magazine* magazine, size_t n) {
+    for (; n > 0; n--) {
+        void* ptr = magazine->slots[--magazine->len];
+        slab_free(allocator, arena_of(allocator->sb, ptr), ptr);
+    }
+}
+
+void drain_caches(Allocator* allocator) {
+    pthread_mutex_lock(&allocator->lock);
+    for (ThreadCache* cache = allocator->caches; cache; cache = cache->next) {
+        for (int i = 0; i < NSLAB_CLASSES; i++) {
+            drain_magazine(allocator, &cache->magazines[i], cache->magazines[i].len);
+        }
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+void init_threads(Allocator* allocator) {
+    static uint64_t next_id = 1;
+    pthread_mutex_init(&allocator->lock, NULL);
+    allocator->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    allocator->caches = NULL;
+    allocator->epoch = 1;
+    allocator->retired = NULL;
+    allocator->retired_head = allocator->retired_len = allocator->retired_cap = 0;
+    allocator->pins = NULL;
+    allocator->npins = allocator->pins_cap = 0;
+    allocator->readers = 0;
+    allocator->keep = 0;
+    memset(&allocator->counters, 0, sizeof(AllocCounters));
+    memset(&allocator->saved, 0, sizeof(AllocCounters));
+}
+
+size_t alloc_malloc_bulk(Allocator* allocator, size_t size, size_t n, void** res) {
+    size_t got = 0;
+    pthread_mutex_lock(&allocator->lock);
+    if (size <= SLOT_SIZE(NSLAB_CLASSES - 1)) {
+        got = slab_alloc_bulk(allocator, SLAB_CLASS(size ? size : 1), n, res);
+    } else {
+        while (got < n && (res[got] = buddy_malloc(allocator, size))) got++;
+    }
+    count_mallocs(&allocator->counters, size, got);
+    pthread_mutex_unlock(&allocator->lock);
+    return got;
+}
+
+void* alloc_malloc(Allocator* allocator, size_t size) {
+    ThreadCache* cache;
+    if (size <= SLOT_SIZE(NSLAB_CLASSES - 1) && !allocator->logged && !allocator->keep && (cache = thread_cache(allocator))) {
+        int class = SLAB_CLASS(size ? size : 1);
+        Magazine* magazine = &cache->magazines[class];
+        if (magazine->len == 0) {
+            pthread_mutex_lock(&allocator->lock);
+            magazine->len = slab_alloc_bulk(allocator, class, MAGAZINE_SIZE / 2, magazine->slots);
+            pthread_mutex_unlock(&allocator->lock);
+            if (magazine->len == 0) return NULL;
+            // pop the slots in address order, which the hardware prefetches best
+            for (size_t i = 0, j = magazine->len - 1; i < j; i++, j--) {
+                void* tmp = magazine->slots[i];
+                magazine->slots[i] = magazine->slots[j];
+                magazine->slots[j] = tmp;
+            }
+        }
+        count_mallocs(&cache->counters, size, 1);
+        return magazine->slots[--magazine->len];
+    }
+    void* res;
+    pthread_mutex_lock(&allocator->lock);
+    if (size <= SLOT_SIZE(NSLAB_CLASSES - 1)) {
+        res = slab_alloc(allocator, SLAB_CLASS(size ? size : 1));
+    } else {
+        res = buddy_malloc(allocator, size);
+    }
+    if (res) count_mallocs(&allocator->counters, size, 1);
+    pthread_mutex_unlock(&allocator->lock);
+    return res;
 }
 
 void alloc_free(Allocator* allocator, void* ptr) {
-    bd_free(&allocator->bd, ptr);
+    BuddyAllocator* bd = arena_of(allocator->sb, ptr);
+    bool slot = bd->size_class[blk_index(bd, 0, ptr)] == SLAB_MARK;
+    ThreadCache* cache;
+    // a slot of a chunk goes back to the chunk, not to this thread; a chunk
+    // only ever stops being owned under the lock, which the slow path takes
+    if (slot && !allocator->logged && !allocator->keep && !__atomic_load_n(&slab_of(bd, ptr)->owned, __ATOMIC_RELAXED)
+        && (cache = thread_cache(allocator))) {
+        int class = slab_of(bd, ptr)->class;
+        count(&cache->counters.frees[class], 1);
+        Magazine* magazine = &cache->magazines[class];
+        if (magazine->len == MAGAZINE_SIZE) {
+            pthread_mutex_lock(&allocator->lock);
+            drain_magazine(allocator, magazine, MAGAZINE_SIZE / 2);
+            pthread_mutex_unlock(&allocator->lock);
+        }
+        magazine->slots[magazine->len++] = ptr;
+        return;
+    }
+    pthread_mutex_lock(&allocator->lock);
+    count(&allocator->counters.frees[block_class(bd, ptr)], 1);
+    if (slot) {
+        slab_free(allocator, bd, ptr);
+    } else {
+        bd_free(bd, ptr);
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+// Chunks. Blocks that are used together, like the children of one directory,
+// are best kept together: an owner keeps a chunk, a slab nobody else takes
+// slots from, in a field of its own and allocates from it until it is full.
+// A full chunk is then left to the slab allocator and a fresh one taken.
+// Chunks bypass the thread caches, so that the slots come in address order,
+// and their freed slots are for their owners again.
+void* alloc_malloc_in(Allocator* allocator, size_t size, void** chunk) {
+    if (size > SLOT_SIZE(NSLAB_CLASSES - 1)) return alloc_malloc(allocator, size);
+    int class = SLAB_CLASS(size ? size : 1);
+    pthread_mutex_lock(&allocator->lock);
+    Slab* slab = (Slab*) *chunk;
+    if (slab && (slab->class != class || slab->nfree == 0 || alloc_moving(allocator, slab))) {
+        slab_disown(allocator, slab);
+        slab = NULL;
+    }
+    if (!slab && (slab = slab_create(allocator, class))) {
+        lst_remove(&slab->link);
+        slab->owned = 1;
+    }
+    *chunk = slab;
+    void* res = slab ? slab_take(slab) : NULL;
+    if (res) count_mallocs(&allocator->counters, size, 1);
+    pthread_mutex_unlock(&allocator->lock);
+    return res;
+}
+
+void alloc_release_chunk(Allocator* allocator, void* chunk) {
+    if (!chunk) return;
+    pthread_mutex_lock(&allocator->lock);
+    slab_disown(allocator, (Slab*) chunk);
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+size_t alloc_block_size(Allocator* allocator, void const* ptr) {
+    BuddyAllocator const* bd = arena_of(allocator->sb, ptr);
+    uint8_t k = bd->size_class[blk_index(bd, 0, ptr)];
+    return k == SLAB_MARK ? SLOT_SIZE(slab_of(bd, ptr)->class) : BLK_SIZE(k);
+}
+
+// Deferred frees
+
+// Epoch based reclamation. A reader publishes the global epoch it saw in its
+// thread cache for the duration of a read section. A retired block is tagged
+// with the epoch at the time it was retired, which is after it became
+// unreachable. The epoch advances only when every active reader has seen the
+// current one, so once it is two past the tag of a block, no reader can
+// still be holding on to the block.
+// Blocks are freed only on request and strictly oldest first, so that a log
+// can record how many were freed and replaying it frees the same ones.
+typedef struct Retired {
+    void* ptr;
+    uint64_t epoch;
+} Retired;
+
+bool alloc_read_lock(Allocator* allocator) {
+    ThreadCache* cache = thread_cache(allocator);
+    if (!cache) return false;
+    if (cache->reading++ > 0) return true;
+    __atomic_fetch_add(&allocator->readers, 1, __ATOMIC_SEQ_CST);
+    uint64_t epoch = __atomic_load_n(&allocator->epoch, __ATOMIC_SEQ_CST);
+    for (;;) { // the epoch may have moved on before the reader became visible
+        __atomic_store_n(&cache->epoch, epoch, __ATOMIC_SEQ_CST);
+        uint64_t now = __atomic_load_n(&allocator->epoch, __ATOMIC_SEQ_CST);
+        if (now == epoch) return true;
+        epoch = now;
+    }
+}
+
+void alloc_read_unlock(Allocator* allocator) {
+    ThreadCache* cache = thread_cache(allocator);
+    if (--cache->reading > 0) return;
+    __atomic_store_n(&cache->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&allocator->readers, 1, __ATOMIC_RELEASE);
+}
+
+bool alloc_reading(Allocator* allocator) {
+    ThreadCache* cache = thread_cache(allocator);
+    return cache && cache->reading > 0;
+}
+
+bool alloc_read_anywhere(Allocator* allocator) {
+    return alloc_readers(allocator) > 0 || __atomic_load_n(&allocator->npins, __ATOMIC_SEQ_CST) > 0;
+}
+
+size_t alloc_readers(Allocator* allocator) {
+    return __atomic_load_n(&allocator->readers, __ATOMIC_SEQ_CST);
+}
+
+bool alloc_retire(Allocator* allocator, void* ptr) {
+    return alloc_retire_bulk(allocator, &ptr, 1) == 1;
+}
+
+// Retire n blocks under one lock, as many as there is memory to keep track of.
+// A run of slots that are all a slab has in use, like the children of a
+// directory dropped together, retires the slab instead: it is taken off its
+// list, so nobody allocates from it, and goes back to buddy in one piece.
+size_t alloc_retire_bulk(Allocator* allocator, void* const* ptrs, size_t n) {
+    pthread_mutex_lock(&allocator->lock);
+    if (allocator->retired_head > 0 && allocator->retired_head + allocator->retired_len + n > allocator->retired_cap) {
+        memmove(allocator->retired, allocator->retired + allocator->retired_head, sizeof(Retired) * allocator->retired_len);
+        allocator->retired_head = 0;
+    }
+    if (allocator->retired_len + n > allocator->retired_cap) {
+        size_t cap = allocator->retired_cap ? allocator->retired_cap : 256;
+        while (cap < allocator->retired_len + n) cap *= 2;
+        Retired* retired = (Retired*) realloc(allocator->retired, sizeof(Retired) * cap);
+        if (retired) {
+            allocator->retired = retired;
+            allocator->retired_cap = cap;
+        } else {
+            n = allocator->retired_cap - allocator->retired_len;
+        }
+    }
+    uint64_t epoch = __atomic_load_n(&allocator->epoch, __ATOMIC_SEQ_CST);
+    Retired* tail = allocator->retired + allocator->retired_head + allocator->retired_len;
+    size_t len = 0;
+    for (size_t i = 0; i < n;) {
+        size_t run = slab_run(allocator, ptrs + i, n - i);
+        Slab* slab = run ? slab_of(arena_of(allocator->sb, ptrs[i]), ptrs[i]) : NULL;
+        if (slab && !slab->owned && run == (size_t) (slab->nslots - slab->nfree)) {
+            if (slab->nfree > 0) lst_remove(&slab->link);
+            tail[len++] = (Retired) { slab, epoch };
+            i += run;
+            continue;
+        }
+        for (size_t end = i + (run ? run : 1); i < end; i++) tail[len++] = (Retired) { ptrs[i], epoch };
+    }
+    allocator->retired_len += len;
+    pthread_mutex_unlock(&allocator->lock);
+    return n;
+}
+
+size_t alloc_retire_most(Allocator* allocator, void** ptrs, size_t n) {
+    size_t kept = 0;
+    if (n > 0 && slab_run(allocator, ptrs + n - 1, 1)) {
+        uintptr_t slab = (uintptr_t) slab_of(arena_of(allocator->sb, ptrs[n - 1]), ptrs[n - 1]);
+        while (kept < n && (uintptr_t) ptrs[n - kept - 1] - slab < SLAB_SIZE) kept++;
+    }
+    if (kept == n) kept = 0; // all of one slab
+    alloc_retire_bulk(allocator, ptrs, n - kept);
+    memmove(ptrs, ptrs + n - kept, sizeof(void*) * kept);
+    return kept;
+}
+
+size_t alloc_retired(Allocator* allocator) {
+    pthread_mutex_lock(&allocator->lock);
+    size_t res = allocator->retired_len;
+    pthread_mutex_unlock(&allocator->lock);
+    return res;
+}
+
+size_t alloc_reclaimable(Allocator* allocator) {
+    pthread_mutex_lock(&allocator->lock);
+    uint64_t epoch = __atomic_load_n(&allocator->epoch, __ATOMIC_SEQ_CST);
+    bool behind = false;
+    for (ThreadCache* cache = allocator->caches; cache && !behind; cache = cache->next) {
+        uint64_t seen = __atomic_load_n(&cache->epoch, __ATOMIC_SEQ_CST);
+        behind = seen != 0 && seen != epoch;
+    }
+    for (size_t i = 0; i < allocator->npins && !behind; i++) behind = allocator->pins[i] != epoch;
+    if (!behind) __atomic_store_n(&allocator->epoch, ++epoch, __ATOMIC_SEQ_CST);
+    size_t res = 0;
+    Retired const* retired = allocator->retired + allocator->retired_head;
+    while (res < allocator->retired_len && retired[res].epoch + 2 <= epoch) res++;
+    pthread_mutex_unlock(&allocator->lock);
+    return res;
+}
+
+// A pin holds the epoch like a reader that never leaves
+uint64_t alloc_pin(Allocator* allocator) {
+    pthread_mutex_lock(&allocator->lock);
+    if (allocator->npins == allocator->pins_cap) {
+        size_t cap = allocator->pins_cap ? allocator->pins_cap * 2 : 8;
+        uint64_t* pins = (uint64_t*) realloc(allocator->pins, sizeof(uint64_t) * cap);
+        if (!pins) {
+            pthread_mutex_unlock(&allocator->lock);
+            return 0;
+        }
+        allocator->pins = pins;
+        allocator->pins_cap = cap;
+    }
+    uint64_t epoch = __atomic_load_n(&allocator->epoch, __ATOMIC_SEQ_CST);
+    allocator->pins[allocator->npins] = epoch;
+    __atomic_store_n(&allocator->npins, allocator->npins + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&allocator->lock);
+    return epoch;
+}
+
+void alloc_unpin(Allocator* allocator, uint64_t epoch) {
+    pthread_mutex_lock(&allocator->lock);
+    for (size_t i = 0; i < allocator->npins; i++) {
+        if (allocator->pins[i] == epoch) {
+            allocator->pins[i] = allocator->pins[allocator->npins - 1];
+            __atomic_store_n(&allocator->npins, allocator->npins - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+size_t alloc_reclaim(Allocator* allocator, size_t n) {
+    pthread_mutex_lock(&allocator->lock);
+    if (n > allocator->retired_len) n = allocator->retired_len;
+    for (size_t i = 0; i < n; i++) {
+        void* ptr = allocator->retired[allocator->retired_head++].ptr;
+        BuddyAllocator* bd = arena_of(allocator->sb, ptr);
+        if (bd->size_class[blk_index(bd, 0, ptr)] == SLAB_MARK && slab_of(bd, ptr) == ptr) { // retired whole
+            Slab* slab = (Slab*) ptr;
+            count(&allocator->counters.frees[slab->class], slab->nslots - slab->nfree);
+            slab_release(allocator, slab);
+            continue;
+        }
+        count(&allocator->counters.frees[block_class(bd, ptr)], 1);
+        if (bd->size_class[blk_index(bd, 0, ptr)] == SLAB_MARK) {
+            slab_free(allocator, bd, ptr);
+        } else {
+            bd_free(bd, ptr);
+        }
+    }
+    allocator->retired_len -= n;
+    if (allocator->retired_len == 0) allocator->retired_head = 0;
+    pthread_mutex_unlock(&allocator->lock);
+    return n;
 }
 
 // Compute the first block at size k that doesn't contain p
@@ -222,6 +873,10 @@ int ilog2(uint64_t n) {
 }
 
 // Mark memory from [start, stop), starting at size 0, as allocated.
+// Marking a block flips the bit of its pair, so a pair that lies wholly in
+// the range is flipped twice and stays as it was; only the pairs at the
+// ends of the range change. The split bits are set for the whole range at
+// once, so each size takes a few operations rather than one per block.
 void bd_mark(BuddyAllocator* bd, void* start, void* stop) {
 
     assert(((uint64_t) start % LEAF_SIZE == 0) && ((uint64_t) stop % LEAF_SIZE == 0));
@@ -229,15 +884,17 @@ void bd_mark(BuddyAllocator* bd, void* start, void* stop) {
     for (int k = 0; k < bd->nsizes; k++) {
         size_t bi = blk_index(bd, k, start);
         size_t bj = blk_index_next(bd, k, stop);
-        for (; bi < bj; bi++) {
-            if (k > 0) {
-                // if a block is allocated at size k, mark it as split too.
-                bit_set(bd->sizes[k].split, bi);
-            }
+        if (bi >= bj) continue;
+        if (k > 0) {
+            // if a block is allocated at size k, mark it as split too.
+            bit_set_range(bd->sizes[k].split, bi, bj);
+        }
+        if (bi % 2 == 1) { // the right half of a pair whose left half is outside
             bit_flip(bd->sizes[k].pair_state, bi / 2);
-            // maybe u can consider all cases like bi % 2 == 0,
-            // bi % 2 != 0, bj % 2 == 0, bj % 2 != 0,
-            // and that'll save us a few operations, but i'm too lazy
+            bi++;
+        }
+        if (bi < bj && bj % 2 == 1) { // the left half of a pair whose right half is outside
+            bit_flip(bd->sizes[k].pair_state, bj / 2);
         }
     }
 }
@@ -282,8 +939,7 @@ size_t bd_initfree(BuddyAllocator* bd, void* bd_left, void* bd_right) {
 // Mark the range [bd_base,p) as allocated
 size_t bd_mark_data_structures(BuddyAllocator* bd, char* p) {
     size_t meta = p - (char*) bd->base;
-    fprintf(stderr, "bd: %td meta bytes for managing %llu bytes of memory\n",
-            meta, HEAP_SIZE(bd->nsizes));
+    LOG(DEBUG, "bd: %zu meta bytes for managing %llu bytes of memory", meta, HEAP_SIZE(bd->nsizes));
     bd_mark(bd, bd->base, p);
     return meta;
 }
@@ -292,7 +948,7 @@ size_t bd_mark_data_structures(BuddyAllocator* bd, char* p) {
 size_t bd_mark_unavailable(BuddyAllocator* bd, void* end) {
     size_t unavailable = HEAP_SIZE(bd->nsizes) - (end - bd->base);
     if (unavailable > 0) unavailable = ROUNDUP(unavailable, LEAF_SIZE);
-    fprintf(stderr, "bd: 0x%zx bytes unavailable\n", unavailable);
+    LOG(DEBUG, "bd: 0x%zx bytes unavailable", unavailable);
 
     void* bd_end = bd->base + HEAP_SIZE(bd->nsizes) - unavailable;
     bd_mark(bd, bd_end, bd->base + HEAP_SIZE(bd->nsizes));
@@ -305,6 +961,8 @@ void bd_init(BuddyAllocator* bd, void* base, void* end) {
 
     char* p = (char*) ROUNDUP((uint64_t) base, LEAF_SIZE);
     bd->base = (void*) p;
+    bd->end = end;
+    bd->used = 0;
 
     // compute the number of sizes we need to manage [base, end)
     bd->nsizes = ilog2(((char*) end - p) / LEAF_SIZE) + 1;
@@ -312,8 +970,7 @@ void bd_init(BuddyAllocator* bd, void* base, void* end) {
         bd->nsizes++;  // round up to the next power of 2
     }
 
-    fprintf(stderr, "bd: memory sz is %ld bytes; allocate an size array of length %d\n",
-            (char*) end - p, bd->nsizes);
+    LOG(DEBUG, "bd: memory sz is %td bytes; allocate an size array of length %d", (char*) end - p, bd->nsizes);
 
     // allocate bd_sizes array
     bd->sizes = (Sz_info*) p;
@@ -326,7 +983,7 @@ void bd_init(BuddyAllocator* bd, void* base, void* end) {
         size_t sz = sizeof(char) * ROUNDUP((k < MAXSIZE(bd->nsizes)
                                             ? NBLK(k + 1, bd->nsizes)
                                             : NBLK(k, bd->nsizes)), 8) / 8;
-        bd->sizes[k].pair_state = p;
+        bd->sizes[k].pair_state = (uint8_t*) p;
         memset(bd->sizes[k].pair_state, 0, sz);
         p += sz;
     }
@@ -335,10 +992,15 @@ void bd_init(BuddyAllocator* bd, void* base, void* end) {
     // we will not split blocks of size k = 0, the smallest size.
     for (int k = 1; k < bd->nsizes; k++) {
         size_t sz = sizeof(char) * (ROUNDUP(NBLK(k, bd->nsizes), 8)) / 8;
-        bd->sizes[k].split = p;
+        bd->sizes[k].split = (uint8_t*) p;
         memset(bd->sizes[k].split, 0, sz);
         p += sz;
     }
+
+    // allocate the size class map, one byte per leaf block of [base, end).
+    // It is only read for allocated blocks, so it does not need clearing.
+    bd->size_class = (uint8_t*) p;
+    p += ROUNDUP((char*) end - (char*) bd->base, LEAF_SIZE) / LEAF_SIZE;
     p = (char*) ROUNDUP((uint64_t) p, LEAF_SIZE);
 
     // done allocating; mark the memory range [base, p) as allocated, so
@@ -352,47 +1014,444 @@ void bd_init(BuddyAllocator* bd, void* base, void* end) {
 
     // initialize free lists for each size k
     size_t free = bd_initfree(bd, p, bd_end);
+    bd->avail = free;
 
     // check if the amount that is free is what we expect
     if (free != HEAP_SIZE(bd->nsizes) - meta - unavailable) {
-        fprintf(stderr, "free %zu %llu\n", free, HEAP_SIZE(bd->nsizes) - meta - unavailable);
+        LOG(ERROR, "bd: %zu bytes free instead of %llu", free, HEAP_SIZE(bd->nsizes) - meta - unavailable);
         assert(false);
     }
 }
 
+// Shift every pointer kept in buddy's metadata by delta bytes
+void bd_relocate(BuddyAllocator* bd, ptrdiff_t delta) {
+    RELOCATE(bd->base, delta);
+    RELOCATE(bd->end, delta);
+    RELOCATE(bd->sizes, delta);
+    RELOCATE(bd->size_class, delta);
+    for (int k = 0; k < bd->nsizes; k++) {
+        RELOCATE(bd->sizes[k].split, delta);
+        RELOCATE(bd->sizes[k].pair_state, delta);
+        lst_relocate(&bd->sizes[k].free, delta);
+    }
+}
+
+size_t page_size() {
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+int map_flags(bool logged) {
+    return (logged ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED;
+}
+
+// Reserve MAX_MAPPING_SIZE bytes of address space, preferably at hint, and
+// map the first len bytes of fd there
+void* map_file(FILE* fd, size_t len, void* hint, bool logged) {
+    void* addr = mmap(hint, MAX_MAPPING_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+    if (mmap(addr, len, PROT_READ | PROT_WRITE, map_flags(logged), fileno(fd), 0) == MAP_FAILED) {
+        munmap(addr, MAX_MAPPING_SIZE);
+        return NULL;
+    }
+    return addr;
+}
+
+// Extend the file with a new arena that can hold an allocation of nbytes.
+// The arena is at least as large as the file, so the amortized cost of
+// growing stays constant.
+bool alloc_grow(Allocator* allocator, size_t nbytes) {
+    Superblock* sb = allocator->sb;
+    if (sb->narenas == MAX_ARENAS) return false;
+
+    // leave room for buddy's metadata and block alignment
+    size_t len = allocator->mmap_len;
+    while (len < 4 * nbytes) len *= 2;
+    size_t new_len = allocator->mmap_len + len;
+    if (new_len > MAX_MAPPING_SIZE) return false;
+
+    int fd = fileno(allocator->mmap_file);
+    char* start = (char*) allocator->mmap_addr + allocator->mmap_len;
+    if (ftruncate(fd, (off_t) new_len)
+        || mmap(start, len, PROT_READ | PROT_WRITE, map_flags(allocator->logged),
+                fd, (off_t) allocator->mmap_len) == MAP_FAILED) {
+        return false;
+    }
+    bd_init(&sb->arenas[sb->narenas], start, start + len);
+    __atomic_store_n(&sb->narenas, sb->narenas + 1, __ATOMIC_RELEASE);
+    allocator->mmap_len = new_len;
+    sb->file_len = new_len;
+    LOG(INFO, "Heap grew by an arena of %zu bytes to %zu bytes.", len, new_len);
+    return true;
+}
+
+// Cut off what the file has beyond the mapping, which a crash while growing
+// or a compaction leaves
+bool trim_file(Allocator* allocator) {
+    struct stat st;
+    int fd = fileno(allocator->mmap_file);
+    if (fstat(fd, &st)) return false;
+    return (uint64_t) st.st_size <= allocator->mmap_len || ftruncate(fd, (off_t) allocator->mmap_len) == 0;
+}
+
+// Compaction. The file can only shrink by whole arenas, from the end. The
+// arenas to keep are the fewest whose free space holds twice what the others
+// have allocated, and while the caller moves that out of the others, no
+// block is allocated from them.
+bool alloc_compact_begin(Allocator* allocator) {
+    Superblock* sb = allocator->sb;
+    uint64_t above = 0, free = 0;
+    for (int i = 1; i < sb->narenas; i++) above += sb->arenas[i].used;
+    int keep = 1;
+    for (; keep < sb->narenas; keep++) {
+        BuddyAllocator const* bd = &sb->arenas[keep - 1];
+        free += (uint64_t) ((char*) bd->end - (char*) bd->base) - bd->used;
+        if (free >= 2 * above) break;
+        above -= sb->arenas[keep].used;
+    }
+    if (keep == sb->narenas) return false;
+    drain_caches(allocator);
+    allocator->keep = keep;
+    return true;
+}
+
+// Does the block lie in an arena that compaction empties?
+bool alloc_moving(Allocator const* allocator, void const* ptr) {
+    if (!allocator->keep) return false;
+    return (char const*) ptr >= (char const*) allocator->sb->arenas[allocator->keep - 1].end;
+}
+
+bool alloc_compact_end(Allocator* allocator) {
+    Superblock* sb = allocator->sb;
+    pthread_mutex_lock(&allocator->lock);
+    for (int i = 0; i < NSLAB_CLASSES; i++) { // left on the partial lists when they emptied
+        List* partial = &sb->slabs[i];
+        for (List* p = partial->next; p != partial;) {
+            Slab* slab = (Slab*) p;
+            p = p->next;
+            if (alloc_moving(allocator, slab) && slab->nfree == slab->nslots) slab_destroy(allocator, slab);
+        }
+    }
+    int keep = allocator->keep;
+    allocator->keep = 0;
+    bool empty = true;
+    for (int i = keep; i < sb->narenas; i++) empty = empty && sb->arenas[i].used == 0;
+    if (empty) {
+        size_t len = (char*) sb->arenas[keep - 1].end - (char*) allocator->mmap_addr;
+        char* start = (char*) allocator->mmap_addr + len;
+        __atomic_store_n(&sb->narenas, keep, __ATOMIC_RELEASE);
+        sb->file_len = len;
+        // back to reserved address space
+        mmap(start, allocator->mmap_len - len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        allocator->mmap_len = len;
+        if (!allocator->logged) trim_file(allocator); // a logged file shrinks at the next checkpoint
+    }
+    pthread_mutex_unlock(&allocator->lock);
+    return empty;
+}
+
 Allocator* alloc_create(char const* filename, size_t initial_size) {
-    FILE* fd;
-    fd = fopen(filename, "r");
+    // always start from an empty file, so that the whole heap is sparse
+    FILE* fd = fopen(filename, "w+");
     if (!fd) {
-        // the file does not exist
-        // try to create
-        fd = fopen(filename, "w+");
-        if (!fd) {
-            fprintf(stderr, "Unable to create file %s.", filename);
-            return NULL;
-        }
-    } else {
+        LOG(ERROR, "Unable to create file %s.", filename);
+        return NULL;
+    }
+
+    Allocator* res = (Allocator*) malloc(sizeof(Allocator));
+    if (!res) {
         fclose(fd);
-        fd = fopen(filename, "r+");
-        if (!fd) {
-            fprintf(stderr, "Unable to open existing file %s for reading and writing.", filename);
-        }
+        return NULL;
+    }
+    res->mmap_file = fd;
+    res->mmap_len = ROUNDUP(initial_size + sizeof(Superblock), page_size());
+    res->relocation = 0;
+    res->logged = false;
+    init_threads(res);
+    if (ftruncate(fileno(fd), res->mmap_len) // NOLINT(*-narrowing-conversions)
+        || !(res->mmap_addr = map_file(fd, res->mmap_len, NULL, false))) {
+        fclose(fd);
+        free(res);
+        return NULL;
+    }
+
+    res->sb = (Superblock*) res->mmap_addr;
+    res->sb->magic = SUPERBLOCK_MAGIC;
+    res->sb->version = SUPERBLOCK_VERSION;
+    res->sb->base_addr = res->mmap_addr;
+    res->sb->file_len = res->mmap_len;
+    res->sb->root = NULL;
+    res->sb->narenas = 1;
+    for (int i = 0; i < NSLAB_CLASSES; i++) lst_init(&res->sb->slabs[i]);
+    memset(res->sb->live_blocks, 0, sizeof(res->sb->live_blocks));
+    bd_init(&res->sb->arenas[0], res->mmap_addr + sizeof(Superblock), res->mmap_addr + res->mmap_len);
+    return res;
+}
+
+bool remap_file(Allocator* allocator, bool logged);
+
+Allocator* alloc_open(char const* filename, bool logged) {
+    FILE* fd = fopen(filename, "r+");
+    if (!fd) return NULL;
+
+    Superblock sb;
+    struct stat st;
+    if (fread(&sb, sizeof(sb), 1, fd) != 1 || fstat(fileno(fd), &st)
+        || sb.magic != SUPERBLOCK_MAGIC || sb.version != SUPERBLOCK_VERSION
+        || sb.file_len > (uint64_t) st.st_size) { // a crash while growing leaves extra bytes
+        LOG(ERROR, "File %s is not a valid database file.", filename);
+        fclose(fd);
+        return NULL;
     }
 
     Allocator* res = (Allocator*) malloc(sizeof(Allocator));
-    if (!res) return NULL;
+    if (!res) {
+        fclose(fd);
+        return NULL;
+    }
     res->mmap_file = fd;
-    res->mmap_len = initial_size;
-    res->mmap_addr = mmap(NULL, res->mmap_len, PROT_READ | PROT_WRITE,
-                          MAP_SHARED, fileno(fd), 0);
-    if (res->mmap_addr == MAP_FAILED) return NULL;
-    if (ftruncate(fileno(fd), res->mmap_len)) return NULL; // NOLINT(*-narrowing-conversions)
-    bd_init(&res->bd, res->mmap_addr, res->mmap_addr + res->mmap_len);
+    res->mmap_len = sb.file_len;
+    res->logged = logged;
+    init_threads(res);
+    res->mmap_addr = map_file(fd, res->mmap_len, sb.base_addr, logged);
+    if (!res->mmap_addr) {
+        fclose(fd);
+        free(res);
+        return NULL;
+    }
+    res->sb = (Superblock*) res->mmap_addr;
+
+    // The previous mapping address is usually free in a new process. If it is
+    // not, every pointer stored in the file has to be shifted. That happens in
+    // a private mapping, so that the file is not left half shifted if the
+    // caller fails halfway; the caller writes it back with a checkpoint.
+    res->relocation = (char*) res->mmap_addr - (char*) sb.base_addr;
+    if (res->relocation != 0 && !logged) {
+        if (!remap_file(res, true)) {
+            munmap(res->mmap_addr, MAX_MAPPING_SIZE);
+            fclose(fd);
+            free(res);
+            return NULL;
+        }
+        res->logged = true;
+    }
+    if (res->relocation != 0) {
+        for (int i = 0; i < res->sb->narenas; i++) {
+            bd_relocate(&res->sb->arenas[i], res->relocation);
+        }
+        for (int i = 0; i < NSLAB_CLASSES; i++) lst_relocate(&res->sb->slabs[i], res->relocation);
+        RELOCATE(res->sb->root, res->relocation);
+        res->sb->base_addr = res->mmap_addr;
+    }
     return res;
 }
 
+void* alloc_get_root(Allocator const* allocator) {
+    return allocator->sb->root;
+}
+
+void alloc_set_root(Allocator* allocator, void* root) {
+    allocator->sb->root = root;
+}
+
+ptrdiff_t alloc_get_relocation(Allocator const* allocator) {
+    return allocator->relocation;
+}
+
+uint64_t alloc_offset(Allocator const* allocator, void const* ptr) {
+    return (char const*) ptr - (char const*) allocator->mmap_addr;
+}
+
+void* alloc_at(Allocator const* allocator, uint64_t offset) {
+    return (char*) allocator->mmap_addr + offset;
+}
+
+// Statistics
+
+// Sums of the counters of all threads; needs the lock
+void sum_counters(Allocator* allocator, AllocCounters* res) {
+    *res = allocator->counters;
+    for (ThreadCache* cache = allocator->caches; cache; cache = cache->next) {
+        for (int i = 0; i < ALLOC_NCLASSES; i++) {
+            res->mallocs[i] += __atomic_load_n(&cache->counters.mallocs[i], __ATOMIC_RELAXED);
+            res->frees[i] += __atomic_load_n(&cache->counters.frees[i], __ATOMIC_RELAXED);
+        }
+        res->requested += __atomic_load_n(&cache->counters.requested, __ATOMIC_RELAXED);
+    }
+}
+
+// Blocks in use in each class: the ones saved in the file, and those
+// allocated and not freed since
+void live_blocks(Allocator* allocator, AllocCounters const* sums, uint64_t* res) {
+    for (int i = 0; i < ALLOC_NCLASSES; i++) {
+        res[i] = allocator->sb->live_blocks[i] + (sums->mallocs[i] - allocator->saved.mallocs[i])
+                 - (sums->frees[i] - allocator->saved.frees[i]);
+    }
+}
+
+// Keep the blocks in use in the file, which only knows them as of the last
+// save, so that a heap opened again starts counting from there
+void save_counters(Allocator* allocator) {
+    pthread_mutex_lock(&allocator->lock);
+    AllocCounters sums;
+    sum_counters(allocator, &sums);
+    live_blocks(allocator, &sums, allocator->sb->live_blocks);
+    allocator->saved = sums;
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+void alloc_get_stats(Allocator* allocator, AllocStats* res) {
+    memset(res, 0, sizeof(AllocStats));
+    Superblock* sb = allocator->sb;
+    pthread_mutex_lock(&allocator->lock);
+    res->file_bytes = allocator->mmap_len;
+    res->narenas = sb->narenas;
+    for (int i = 0; i < sb->narenas; i++) {
+        BuddyAllocator* bd = &sb->arenas[i];
+        res->heap_bytes += bd->avail;
+        res->used_bytes += bd->used;
+        int k = bd->nsizes - 1;
+        while (k >= 0 && lst_empty(&bd->sizes[k].free)) k--;
+        if (k >= 0 && BLK_SIZE(k) > res->largest_free) res->largest_free = BLK_SIZE(k);
+    }
+    res->free_bytes = res->heap_bytes - res->used_bytes;
+    res->fragmentation = res->free_bytes ? 1 - (double) res->largest_free / (double) res->free_bytes : 0;
+    AllocCounters sums;
+    sum_counters(allocator, &sums);
+    live_blocks(allocator, &sums, res->live_blocks);
+    res->retired = allocator->retired_len;
+    pthread_mutex_unlock(&allocator->lock);
+
+    uint64_t granted = 0;
+    for (int i = 0; i < ALLOC_NCLASSES; i++) {
+        res->class_size[i] = stat_class_size(i);
+        res->live_bytes[i] = res->live_blocks[i] * res->class_size[i];
+        res->mallocs += sums.mallocs[i];
+        res->frees += sums.frees[i];
+        granted += sums.mallocs[i] * res->class_size[i];
+    }
+    res->requested_bytes = sums.requested;
+    res->rounding_bytes = granted - sums.requested;
+}
+
+bool alloc_sync(Allocator* allocator) {
+    save_counters(allocator);
+    return allocator->logged || msync(allocator->mmap_addr, allocator->mmap_len, MS_SYNC) == 0;
+}
+
+// Map the whole file again over the current mapping. A private mapping
+// loses its private copies of pages and sees the file as it is now.
+bool remap_file(Allocator* allocator, bool logged) {
+    return mmap(allocator->mmap_addr, allocator->mmap_len, PROT_READ | PROT_WRITE, map_flags(logged),
+                fileno(allocator->mmap_file), 0) != MAP_FAILED;
+}
+
+bool alloc_set_logged(Allocator* allocator, bool logged) {
+    if (allocator->logged == logged) return true;
+    if (logged) drain_caches(allocator);
+    // a private mapping starts from the file, so it has to be up to date
+    if (!alloc_sync(allocator) || !remap_file(allocator, logged)) return false;
+    allocator->logged = logged;
+    return true;
+}
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE (1ULL << 61)
+#define PAGEMAP_BATCH 512
+
+// Find the pages of the private mapping that were written since it was mapped.
+// A written page is a private copy, which pagemap reports as anonymous memory.
+// Where pagemap cannot be read, the pages are compared with the file instead.
+size_t* dirty_pages(Allocator const* allocator, size_t* count) {
+    size_t psz = page_size();
+    size_t npages = allocator->mmap_len / psz;
+    size_t cap = 64;
+    size_t* res = (size_t*) malloc(sizeof(size_t) * cap);
+    char* buf = (char*) malloc(psz > sizeof(uint64_t) * PAGEMAP_BATCH ? psz : sizeof(uint64_t) * PAGEMAP_BATCH);
+    int pagemap = open("/proc/self/pagemap", O_RDONLY);
+    int fd = fileno(allocator->mmap_file);
+    size_t first = (uintptr_t) allocator->mmap_addr / psz;
+    uint64_t* entries = (uint64_t*) buf;
+    *count = 0;
+
+    bool ok = res && buf;
+    for (size_t i = 0; ok && i < npages; i++) {
+        char const* page = (char const*) allocator->mmap_addr + i * psz;
+        bool dirty;
+        if (pagemap >= 0) {
+            size_t batch = i % PAGEMAP_BATCH;
+            if (batch == 0) {
+                size_t n = npages - i < PAGEMAP_BATCH ? npages - i : PAGEMAP_BATCH;
+                ok = pread(pagemap, entries, n * sizeof(uint64_t), (off_t) ((first + i) * sizeof(uint64_t)))
+                     == (ssize_t) (n * sizeof(uint64_t));
+            }
+            uint64_t e = entries[batch];
+            dirty = (e & PAGEMAP_SWAPPED) || ((e & PAGEMAP_PRESENT) && !(e & PAGEMAP_FILE));
+        } else {
+            ok = pread(fd, buf, psz, (off_t) (i * psz)) == (ssize_t) psz;
+            dirty = memcmp(buf, page, psz) != 0;
+        }
+        if (ok && dirty) {
+            if (*count == cap) {
+                size_t* tmp = (size_t*) realloc(res, sizeof(size_t) * (cap *= 2));
+                if (!tmp) {
+                    ok = false;
+                    break;
+                }
+                res = tmp;
+            }
+            res[(*count)++] = i;
+        }
+    }
+    if (pagemap >= 0) close(pagemap);
+    free(buf);
+    if (!ok) {
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+// Write all pages changed since the last checkpoint into the file, first into
+// the log and then in place, so that a crash at any point loses nothing
+bool alloc_checkpoint(Allocator* allocator, Wal* wal) {
+    if (!allocator->logged) return alloc_sync(allocator);
+    save_counters(allocator);
+    size_t npages;
+    size_t* pages = dirty_pages(allocator, &npages);
+    if (!pages) return false;
+
+    size_t psz = page_size();
+    char const* base = (char const*) allocator->mmap_addr;
+    bool ok = true;
+    for (size_t i = 0; ok && i < npages; i++) {
+        WalRecord rec = { .type = WAL_PAGE, .len = { psz }, .args = { pages[i] * psz } };
+        ok = wal_append(wal, &rec, base + pages[i] * psz, NULL);
+    }
+    WalRecord end = { .type = WAL_CHECKPOINT, .args = { allocator->mmap_len } };
+    ok = ok && wal_append(wal, &end, NULL, NULL) && wal_sync(wal);
+
+    int fd = fileno(allocator->mmap_file);
+    for (size_t i = 0; ok && i < npages; i++) {
+        ok = pwrite(fd, base + pages[i] * psz, psz, (off_t) (pages[i] * psz)) == (ssize_t) psz;
+    }
+    free(pages);
+    return ok && fdatasync(fd) == 0 && trim_file(allocator) && wal_reset(wal) && remap_file(allocator, true);
+}
+
 void alloc_destroy(Allocator* allocator) {
-    munmap(allocator->mmap_addr, allocator->mmap_len);
+    drain_caches(allocator);
+    save_counters(allocator);
+    while (allocator->caches) {
+        ThreadCache* next = allocator->caches->next;
+        free(allocator->caches);
+        allocator->caches = next;
+    }
+    free(allocator->retired);
+    free(allocator->pins);
+    munmap(allocator->mmap_addr, MAX_MAPPING_SIZE);
     fclose(allocator->mmap_file);
+    pthread_mutex_destroy(&allocator->lock);
     free(allocator);
 }
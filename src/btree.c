@@ -0,0 +1,229 @@
+#include "internals.h"
+
+#include <string.h>
+
+// B+-tree of the children of a directory ordered by name.
+// Keys are (name, node address) pairs, so children with equal names still
+// have distinct keys and every child can be found and removed exactly.
+// Leaves hold pointers to the children and are chained for range scans;
+// inner nodes hold separators with their own copy of the name, so that a
+// separator stays valid after the child it was taken from is deleted.
+// Removal never rebalances: a leaf that becomes empty stays in the tree
+// and is skipped by iterators until new keys fall into it.
+
+#define BT_MAX_HEIGHT 32
+
+// Compare key (name_a, tie_a) with key (name_b, tie_b)
+int bt_compare(char const* name_a, void const* tie_a, char const* name_b, void const* tie_b) {
+    int res = strcmp(name_a, name_b);
+    if (res != 0) return res;
+    return (tie_a > tie_b) - (tie_a < tie_b);
+}
+
+// Index of the child of an inner node that may contain key
+int bt_child_index(BTreeNode const* t, char const* name, void const* tie) {
+    int lo = 0, hi = t->count;  // the first separator greater than key
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (bt_compare(t->keys[mid].name, t->keys[mid].tie, name, tie) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Index of the first entry of a leaf that is not less than key
+int bt_leaf_index(BTreeNode const* t, char const* name, void const* tie) {
+    int lo = 0, hi = t->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (bt_compare(node_name(t->entries[mid]), t->entries[mid], name, tie) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+BTreeNode* bt_create_node(Allocator* allocator, bool leaf) {
+    BTreeNode* res = (BTreeNode*) alloc_malloc(allocator, sizeof(BTreeNode));
+    if (!res) return NULL;
+    memset(res, 0, sizeof(BTreeNode));
+    res->leaf = leaf;
+    return res;
+}
+
+bool bt_init(Allocator* allocator, BTree* tree) {
+    tree->root = bt_create_node(allocator, true);
+    return tree->root != NULL;
+}
+
+void bt_destroy_node(Allocator* allocator, BTreeNode* t) { // NOLINT(*-no-recursion)
+    if (!t->leaf) {
+        for (int i = 0; i < t->count; i++) alloc_free(allocator, t->keys[i].name);
+        for (int i = 0; i <= t->count; i++) bt_destroy_node(allocator, t->children[i]);
+    }
+    alloc_free(allocator, t);
+}
+
+void bt_destroy(Allocator* allocator, BTree* tree) {
+    if (tree->root) bt_destroy_node(allocator, tree->root);
+    tree->root = NULL;
+}
+
+bool bt_insert(Allocator* allocator, BTree* tree, Node* node) {
+    char const* name = node_name(node);
+
+    // find the leaf and remember the way down
+    BTreeNode* path[BT_MAX_HEIGHT];
+    int path_index[BT_MAX_HEIGHT];
+    int height = 0;
+    BTreeNode* t = tree->root;
+    while (!t->leaf) {
+        if (height == BT_MAX_HEIGHT) return false;
+        path[height] = t;
+        path_index[height] = bt_child_index(t, name, node);
+        t = t->children[path_index[height]];
+        height++;
+    }
+    int pos = bt_leaf_index(t, name, node);
+    if (t->count < BT_LEAF_CAPACITY) {
+        memmove(&t->entries[pos + 1], &t->entries[pos], sizeof(Node*) * (t->count - pos));
+        t->entries[pos] = node;
+        t->count++;
+        return true;
+    }
+
+    // The leaf is full, and so may be its ancestors. Get all the memory the
+    // splits need first, so that running out of it leaves the tree intact.
+    Node* entries[BT_LEAF_CAPACITY + 1];
+    memcpy(entries, t->entries, sizeof(Node*) * pos);
+    entries[pos] = node;
+    memcpy(&entries[pos + 1], &t->entries[pos], sizeof(Node*) * (t->count - pos));
+    int const left_count = (BT_LEAF_CAPACITY + 1) / 2;
+    char const* sep_name = node_name(entries[left_count]);
+
+    int nsplits = 1;
+    while (nsplits <= height && path[height - nsplits]->count == BT_INNER_CAPACITY) nsplits++;
+    int nspare = nsplits + (nsplits > height); // the root splits too
+    BTreeNode* spare[BT_MAX_HEIGHT + 1];
+    char* sep_copy = (char*) alloc_malloc(allocator, strlen(sep_name) + 1);
+    int nallocated = 0;
+    while (sep_copy && nallocated < nspare
+           && (spare[nallocated] = bt_create_node(allocator, nallocated == 0))) {
+        nallocated++;
+    }
+    if (nallocated < nspare) {
+        if (sep_copy) alloc_free(allocator, sep_copy);
+        while (nallocated > 0) alloc_free(allocator, spare[--nallocated]);
+        return false;
+    }
+
+    // split the leaf
+    BTreeNode* right = spare[0];
+    t->count = left_count;
+    memcpy(t->entries, entries, sizeof(Node*) * left_count);
+    right->count = BT_LEAF_CAPACITY + 1 - left_count;
+    memcpy(right->entries, &entries[left_count], sizeof(Node*) * right->count);
+    right->next = t->next;
+    t->next = right;
+    strcpy(sep_copy, sep_name);
+    BTreeKey sep = { .name = sep_copy, .tie = entries[left_count] };
+
+    // insert the separator into the ancestors, splitting the full ones
+    for (int level = height - 1, used = 1; level >= 0; level--) {
+        BTreeNode* p = path[level];
+        int i = path_index[level];
+        if (p->count < BT_INNER_CAPACITY) {
+            memmove(&p->keys[i + 1], &p->keys[i], sizeof(BTreeKey) * (p->count - i));
+            memmove(&p->children[i + 2], &p->children[i + 1], sizeof(BTreeNode*) * (p->count - i));
+            p->keys[i] = sep;
+            p->children[i + 1] = right;
+            p->count++;
+            return true;
+        }
+        BTreeKey keys[BT_INNER_CAPACITY + 1];
+        BTreeNode* children[BT_INNER_CAPACITY + 2];
+        memcpy(keys, p->keys, sizeof(BTreeKey) * i);
+        keys[i] = sep;
+        memcpy(&keys[i + 1], &p->keys[i], sizeof(BTreeKey) * (p->count - i));
+        memcpy(children, p->children, sizeof(BTreeNode*) * (i + 1));
+        children[i + 1] = right;
+        memcpy(&children[i + 2], &p->children[i + 1], sizeof(BTreeNode*) * (p->count - i));
+
+        int const mid = (BT_INNER_CAPACITY + 1) / 2; // keys[mid] moves up
+        right = spare[used++];
+        p->count = mid;
+        memcpy(p->keys, keys, sizeof(BTreeKey) * mid);
+        memcpy(p->children, children, sizeof(BTreeNode*) * (mid + 1));
+        right->count = BT_INNER_CAPACITY - mid;
+        memcpy(right->keys, &keys[mid + 1], sizeof(BTreeKey) * right->count);
+        memcpy(right->children, &children[mid + 1], sizeof(BTreeNode*) * (right->count + 1));
+        sep = keys[mid];
+    }
+
+    // the root was split, grow the tree by one level
+    BTreeNode* root = spare[nspare - 1];
+    root->count = 1;
+    root->keys[0] = sep;
+    root->children[0] = tree->root;
+    root->children[1] = right;
+    tree->root = root;
+    return true;
+}
+
+void bt_remove(BTree* tree, Node* node) {
+    char const* name = node_name(node);
+    BTreeNode* t = tree->root;
+    while (!t->leaf) t = t->children[bt_child_index(t, name, node)];
+    int pos = bt_leaf_index(t, name, node);
+    if (pos == t->count || t->entries[pos] != node) return; // not in the tree
+    memmove(&t->entries[pos], &t->entries[pos + 1], sizeof(Node*) * (t->count - pos - 1));
+    t->count--;
+}
+
+// Skip to the next leaf with entries if pos is past the end of t
+bool bt_skip_empty(BTreeNode const** t, uint32_t* pos) {
+    while (*t && *pos >= (*t)->count) {
+        *t = (*t)->next;
+        *pos = 0;
+    }
+    return *t != NULL;
+}
+
+bool bt_seek(BTree const* tree, char const* name, BTreeNode const** leaf, uint32_t* pos) {
+    BTreeNode const* t = tree->root;
+    while (!t->leaf) t = t->children[bt_child_index(t, name, NULL)];
+    *leaf = t;
+    *pos = bt_leaf_index(t, name, NULL);
+    return bt_skip_empty(leaf, pos);
+}
+
+bool bt_next(BTreeNode const** leaf, uint32_t* pos) {
+    (*pos)++;
+    return bt_skip_empty(leaf, pos);
+}
+
+void bt_relocate_node(BTreeNode* t, ptrdiff_t delta) { // NOLINT(*-no-recursion)
+    if (t->leaf) {
+        RELOCATE(t->next, delta);
+        for (int i = 0; i < t->count; i++) RELOCATE(t->entries[i], delta);
+        return;
+    }
+    for (int i = 0; i < t->count; i++) {
+        RELOCATE(t->keys[i].name, delta);
+        RELOCATE(t->keys[i].tie, delta);
+    }
+    for (int i = 0; i <= t->count; i++) {
+        RELOCATE(t->children[i], delta);
+        bt_relocate_node(t->children[i], delta);
+    }
+}
+
+void bt_relocate(BTree* tree, ptrdiff_t delta) {
+    RELOCATE(tree->root, delta);
+    if (tree->root) bt_relocate_node(tree->root, delta);
+}
@@ -0,0 +1,208 @@
+#include "internals.h"
+
+#include <string.h>
+
+// Column of the values of a columnar directory, so that aggregates scan a
+// dense array of numbers instead of walking the nodes. The leaves stay the
+// source of truth; the column is a copy kept up to date like the indexes.
+// Values are kept in no particular order: a new one goes at the end and a
+// removed one is replaced by the last. Each value has its leaf next to it,
+// and a hash table keyed by the address of the leaf (see node_table.c)
+// finds the position of a leaf, so that every change takes constant time.
+// The table has twice as many slots as the column has room for.
+//
+// Only writers and aggregates use the column, under the lock of the
+// directory, so nothing here is atomic.
+
+#define COLUMN_MIN_CAPACITY 16
+#define COLUMN_LANES 8 // independent accumulators, so that the scans vectorize
+
+size_t col_value_size(Types type) {
+    return type == BOOL ? sizeof(bool) : sizeof(int32_t);
+}
+
+size_t col_bytes_for(Types type, uint64_t capacity) {
+    size_t values = (col_value_size(type) * capacity + 15) & ~(size_t) 15;
+    return sizeof(Column) + values + sizeof(Node*) * capacity + sizeof(ColumnSlot) * capacity * 2;
+}
+
+size_t col_bytes(Column const* col) {
+    return col_bytes_for(col->type, col->capacity);
+}
+
+Node** col_nodes(Column* col) {
+    return (Node**) (col->values + ((col_value_size(col->type) * col->capacity + 15) & ~(size_t) 15));
+}
+
+ColumnSlot* col_slots(Column* col) {
+    return (ColumnSlot*) (col_nodes(col) + col->capacity);
+}
+
+Column* col_create(Allocator* allocator, Types type, uint64_t capacity) {
+    uint64_t cap = COLUMN_MIN_CAPACITY;
+    while (cap < capacity) cap *= 2;
+    Column* res = (Column*) alloc_malloc(allocator, col_bytes_for(type, cap));
+    if (!res) return NULL;
+    res->type = type;
+    res->size = 0;
+    res->capacity = cap;
+    memset(col_slots(res), 0, sizeof(ColumnSlot) * cap * 2);
+    return res;
+}
+
+// Entry of the table for node, or the empty one it would take
+ColumnSlot* col_slot(Column* col, Node const* node) {
+    return (ColumnSlot*) ntab_entry(col_slots(col), sizeof(ColumnSlot), col->capacity * 2, node);
+}
+
+void col_set(Column* col, uint64_t pos, Node const* node) {
+    switch (col->type) {
+        case INT:
+            ((int32_t*) col->values)[pos] = node->data.int_value;
+            break;
+        case FLOAT:
+            ((float*) col->values)[pos] = node->data.float_value;
+            break;
+        default:
+            ((bool*) col->values)[pos] = node->data.bool_value;
+    }
+}
+
+// Put a leaf into a column that has room for it
+void col_put(Column* col, Node* node) {
+    uint64_t pos = col->size++;
+    col_set(col, pos, node);
+    col_nodes(col)[pos] = node;
+    *col_slot(col, node) = (ColumnSlot) { .node = node, .pos = pos };
+}
+
+bool col_grow(Allocator* allocator, Column** col) {
+    Column* old = *col;
+    Column* bigger = col_create(allocator, old->type, old->capacity * 2);
+    if (!bigger) return false;
+    Node** nodes = col_nodes(old);
+    for (uint64_t i = 0; i < old->size; i++) col_put(bigger, nodes[i]);
+    *col = bigger;
+    alloc_free(allocator, old);
+    return true;
+}
+
+bool col_insert(Allocator* allocator, Column** col, Node* node) {
+    if (node->type != (*col)->type) return false;
+    if ((*col)->size == (*col)->capacity && !col_grow(allocator, col)) return false;
+    col_put(*col, node);
+    return true;
+}
+
+void col_remove(Column* col, Node* node) {
+    ColumnSlot* slot = col_slot(col, node);
+    if (!slot->node) return; // not in the column
+    uint64_t pos = slot->pos;
+
+    // the last value takes the place of the removed one
+    uint64_t last = --col->size;
+    Node** nodes = col_nodes(col);
+    if (pos != last) {
+        size_t size = col_value_size(col->type);
+        memcpy(col->values + pos * size, col->values + last * size, size);
+        nodes[pos] = nodes[last];
+        col_slot(col, nodes[pos])->pos = pos;
+    }
+    ntab_remove(col_slots(col), sizeof(ColumnSlot), col->capacity * 2, slot);
+}
+
+void col_update(Column* col, Node const* node) {
+    ColumnSlot* slot = col_slot(col, node);
+    if (slot->node) col_set(col, slot->pos, node);
+}
+
+void col_clear(Column* col) {
+    col->size = 0;
+    memset(col_slots(col), 0, sizeof(ColumnSlot) * col->capacity * 2);
+}
+
+// The scans keep COLUMN_LANES results apart and combine them at the end,
+// which lets the compiler turn the inner loops into vector instructions
+// without reordering floating point sums it is not allowed to.
+#define COLUMN_SCANS(T, suffix, Sum)                                                  \
+Sum col_sum_##suffix(T const* values, uint64_t n) {                                   \
+    Sum lanes[COLUMN_LANES] = { 0 };                                                  \
+    uint64_t i = 0;                                                                   \
+    for (; i + COLUMN_LANES <= n; i += COLUMN_LANES) {                                \
+        for (size_t j = 0; j < COLUMN_LANES; j++) lanes[j] += values[i + j];          \
+    }                                                                                 \
+    for (; i < n; i++) lanes[0] += values[i];                                         \
+    Sum res = 0;                                                                      \
+    for (size_t j = 0; j < COLUMN_LANES; j++) res += lanes[j];                        \
+    return res;                                                                       \
+}                                                                                     \
+                                                                                      \
+T col_min_##suffix(T const* values, uint64_t n) {                                     \
+    T lanes[COLUMN_LANES];                                                            \
+    for (size_t j = 0; j < COLUMN_LANES; j++) lanes[j] = values[0];                   \
+    uint64_t i = 0;                                                                   \
+    for (; i + COLUMN_LANES <= n; i += COLUMN_LANES) {                                \
+        for (size_t j = 0; j < COLUMN_LANES; j++) {                                   \
+            lanes[j] = values[i + j] < lanes[j] ? values[i + j] : lanes[j];           \
+        }                                                                             \
+    }                                                                                 \
+    for (; i < n; i++) lanes[0] = values[i] < lanes[0] ? values[i] : lanes[0];        \
+    T res = lanes[0];                                                                 \
+    for (size_t j = 1; j < COLUMN_LANES; j++) res = lanes[j] < res ? lanes[j] : res;  \
+    return res;                                                                       \
+}                                                                                     \
+                                                                                      \
+T col_max_##suffix(T const* values, uint64_t n) {                                     \
+    T lanes[COLUMN_LANES];                                                            \
+    for (size_t j = 0; j < COLUMN_LANES; j++) lanes[j] = values[0];                   \
+    uint64_t i = 0;                                                                   \
+    for (; i + COLUMN_LANES <= n; i += COLUMN_LANES) {                                \
+        for (size_t j = 0; j < COLUMN_LANES; j++) {                                   \
+            lanes[j] = values[i + j] > lanes[j] ? values[i + j] : lanes[j];           \
+        }                                                                             \
+    }                                                                                 \
+    for (; i < n; i++) lanes[0] = values[i] > lanes[0] ? values[i] : lanes[0];        \
+    T res = lanes[0];                                                                 \
+    for (size_t j = 1; j < COLUMN_LANES; j++) res = lanes[j] > res ? lanes[j] : res;  \
+    return res;                                                                       \
+}
+
+COLUMN_SCANS(int32_t, int, int64_t)
+COLUMN_SCANS(float, float, double)
+COLUMN_SCANS(uint8_t, bool, uint64_t)
+
+bool col_aggregate(Column const* col, Aggregate op, double* res) {
+    uint64_t n = col->size;
+    if (op == AGG_COUNT) {
+        *res = (double) n;
+        return true;
+    }
+    if (n == 0 && op != AGG_SUM) return false;
+    void const* values = col->values;
+    switch (col->type) {
+        case INT:
+            *res = op == AGG_SUM ? (double) col_sum_int(values, n)
+                 : op == AGG_MIN ? col_min_int(values, n) : col_max_int(values, n);
+            break;
+        case FLOAT:
+            *res = op == AGG_SUM ? col_sum_float(values, n)
+                 : op == AGG_MIN ? col_min_float(values, n) : col_max_float(values, n);
+            break;
+        default:
+            *res = op == AGG_SUM ? (double) col_sum_bool(values, n)
+                 : op == AGG_MIN ? col_min_bool(values, n) : col_max_bool(values, n);
+    }
+    return true;
+}
+
+// The table is keyed by addresses, so it is built again
+void col_relocate(Column* col, ptrdiff_t delta) {
+    Node** nodes = col_nodes(col);
+    uint64_t size = col->size;
+    col_clear(col);
+    for (uint64_t i = 0; i < size; i++) {
+        RELOCATE(nodes[i], delta);
+        col->size++;
+        *col_slot(col, nodes[i]) = (ColumnSlot) { .node = nodes[i], .pos = i };
+    }
+}
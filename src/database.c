@@ -1,192 +1,2294 @@
 #include "allocator.h"
 #include "database.h"
 #include "internals.h"
+#include "log.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// A transaction keeps the changes to nodes that are visible to everyone, to
+// apply them together on commit. New nodes are allocated and filled right
+// away, many nodes at a time, but are linked into visible directories only
+// on commit. Updates and deletions are checked and prepared when they are
+// made, so that applying them cannot fail halfway. Without snapshots, a new
+// string that fits the room of the old one is written over it on commit,
+// unless readers may be looking at the old one then; the copy the update
+// staged replaces it otherwise, and the log tells replay which way it went.
+typedef enum TxnOpType {
+    TXN_CREATE, // link a new node into its directory
+    TXN_UPDATE, // set the value of a leaf
+    TXN_DELETE, // unlink a node and free it with everything below it
+} TxnOpType;
+
+typedef struct TxnOp {
+    TxnOpType type;
+    Node* node;
+    Value value; // a new string is copied into the file
+    bool in_place; // the string fits the room of the old one
+} TxnOp;
+
+#define TXN_RESERVE 64 // nodes allocated at once
+
+typedef struct Transaction {
+    TxnOp* ops;
+    size_t len;
+    size_t cap;
+    Node* reserve[TXN_RESERVE]; // allocated for new nodes
+    size_t nreserved;
+    size_t nused;
+    uint64_t version; // of the history when the transaction began
+    bool burying; // snapshots are open
+} Transaction;
+
+// Locking. Every call that changes anything enters the database through one
+// of the gate locks, shared; a transaction, a snapshot or a checkpoint takes
+// all of them exclusively.
+// Threads use different gate locks, so that entering does not make them
+// fight over one cache line. Inside, the children of a directory, their
+// links and their values are guarded by one of the directory locks, picked
+// by the address of the directory. Calls that need two directory locks take
+// them in the order of the locks. Clearing a directory that has directories
+// in it takes all of the directory locks, since it drops whatever is below,
+// where other threads may be making changes under locks of their own. With
+// a write-ahead log, changes are made under the log lock too, so that they
+// are logged in the order they were made in; replay depends on it. The
+// locks are always taken in the order: gate, log, directories, path cache
+// or history. The thread that holds the gate takes the directory locks too,
+// since readers do not wait for it.
+//
+// Readers take no gate lock and no directory locks: a read section only
+// publishes its epoch (see alloc_read_lock), and values are read under their
+// sequence numbers (see read_value). Links and values are published
+// atomically, and whatever a change takes out of the tree is retired rather
+// than freed, so nodes, names, strings and index tables stay readable until
+// every reader that could have reached them has left (see alloc_retire).
+// Retired blocks are freed after changes, under the log lock, and the log
+// records how many were freed, so that replay frees the same ones. A lookup
+// that finds no index builds one only if the locks of a change are free
+// right away, and scans the directory otherwise. Only checkpoints,
+// compaction and turning the log on or off keep readers out: they close
+// the database, wait for the read sections to end and then take the gate,
+// and readers that come meanwhile wait until it opens again.
+//
+// Snapshots. While a snapshot is open, every change first records what it
+// replaces in the history, tagged with a version that grows with every
+// change, and deleted nodes are buried: they leave the indexes but stay in
+// their directories, flagged dead, so that snapshot iterators still walk
+// past them. A snapshot sees the changes with versions up to the one it was
+// taken at. Its iterators take no gate locks, and the allocator keeps
+// whatever was retired after it was taken until it is released. Releasing
+// purges the records every remaining snapshot sees, freeing the buried
+// nodes, and the log records which ones, so that replay frees the same.
+// Taking and releasing snapshots holds the whole gate, so the set of open
+// snapshots never changes under a call.
+#define DB_GATE_LOCKS 16
+#define DB_DIR_LOCKS 64
+#define DB_RECLAIM_BATCH 64 // retired blocks worth checking the readers for
+#define DB_DROP_BATCH 256 // blocks retired at a time when dropping a subtree
+#define DB_CHUNK_CHILDREN 8 // children a directory has before it gets a chunk of its own
+
+typedef struct PaddedLock {
+    _Alignas(64) pthread_rwlock_t lock;
+} PaddedLock;
+
+// Counters of the calls and nodes of one thread, see database_get_stats.
+// A thread finds its counters through a small table of its own, like the
+// allocator's thread caches. Threads that cannot get counters of their own
+// share the spare ones of the database.
+#define DB_STATS_SLOTS 4 // databases a thread finds its counters of quickly
+
+typedef struct ThreadStats {
+    struct ThreadStats* next; // in the list of the database
+    pthread_t thread;
+    bool shared; // the spare counters
+    uint64_t ops[DB_NOPS];
+    uint64_t nodes[DB_NTYPES]; // created less freed, wrapping around below zero
+} ThreadStats;
+
 struct Database {
     Allocator* allocator;
     Node* root;
+    PathCache paths; // recently resolved paths
+    char* filename;
+    Wal* wal; // NULL if changes are written to the file in place
+    Transaction* txn; // NULL outside of transactions
+    PaddedLock gate[DB_GATE_LOCKS];
+    PaddedLock dir_locks[DB_DIR_LOCKS];
+    pthread_rwlock_t paths_lock;
+    pthread_mutex_t log_lock;
+    _Atomic pthread_t owner; // the thread that holds the gate exclusively, 0 if none
+    atomic_bool checkpoint_due; // the log grew large during a call that could not checkpoint it
+    atomic_bool closed; // readers wait outside, see close_database
+    pthread_mutex_t close_lock; // held while the database is closed
+    bool replaying; // retired blocks are freed only where the log says so
+    bool bury_logged; // the change being replayed buried deleted nodes
+    bool in_place_logged; // the update being replayed wrote its string in place
+    uint64_t refused_logged; // the update of the commit being replayed that did not go in place, from 1; 0 if none
+    List snapshots; // open snapshots, newest first
+    atomic_size_t nsnapshots; // read outside of the gate too
+    History history; // changes the oldest snapshot does not see
+    uint64_t version; // of the last change in the history
+    pthread_rwlock_t history_lock;
+    uint64_t id; // tells the counters of databases apart
+    ThreadStats* stats; // counters of the threads that used the database
+    ThreadStats spare_stats;
+    pthread_mutex_t stats_lock;
+    atomic_bool counted; // the nodes there were before the counters started are known
+    uint64_t nodes_base[DB_NTYPES]; // nodes the walk found, less those counted by then
 };
 
-Node* create_node(Allocator* allocator, Types type, uint64_t name_len, char const* name) {
-    Node* res = (Node*) alloc_malloc(allocator, sizeof(Node));
+struct Snapshot {
+    List link;        // in the snapshots of the database
+    Database* db;
+    uint64_t version; // changes after it are not seen
+    uint64_t epoch;   // pinned in the allocator
+};
+
+// Locks held by a call. The thread that holds the gate exclusively is the
+// only one changing the database and takes no log lock.
+typedef struct Locks {
+    PaddedLock* gate; // NULL if the thread holds the whole gate, or only reads
+    bool log;
+    bool changes;
+    bool reading; // in a read section of the allocator
+    pthread_rwlock_t* dirs[2];
+    PaddedLock* all_dirs; // the directory locks, if all of them are held
+} Locks;
+
+void init_locks(Database* db) {
+    for (size_t i = 0; i < DB_GATE_LOCKS; i++) pthread_rwlock_init(&db->gate[i].lock, NULL);
+    for (size_t i = 0; i < DB_DIR_LOCKS; i++) pthread_rwlock_init(&db->dir_locks[i].lock, NULL);
+    pthread_rwlock_init(&db->paths_lock, NULL);
+    pthread_mutex_init(&db->log_lock, NULL);
+    db->owner = 0;
+    db->checkpoint_due = false;
+    db->closed = false;
+    pthread_mutex_init(&db->close_lock, NULL);
+    db->replaying = false;
+    db->bury_logged = false;
+    db->in_place_logged = false;
+    db->refused_logged = 0;
+    lst_init(&db->snapshots);
+    db->nsnapshots = 0;
+    hst_init(&db->history);
+    db->version = 0;
+    pthread_rwlock_init(&db->history_lock, NULL);
+    static atomic_uint_fast64_t next_id = 1;
+    db->id = atomic_fetch_add(&next_id, 1);
+    db->stats = NULL;
+    memset(&db->spare_stats, 0, sizeof(ThreadStats));
+    db->spare_stats.shared = true;
+    pthread_mutex_init(&db->stats_lock, NULL);
+    db->counted = false;
+}
+
+void destroy_locks(Database* db) {
+    for (size_t i = 0; i < DB_GATE_LOCKS; i++) pthread_rwlock_destroy(&db->gate[i].lock);
+    for (size_t i = 0; i < DB_DIR_LOCKS; i++) pthread_rwlock_destroy(&db->dir_locks[i].lock);
+    pthread_rwlock_destroy(&db->paths_lock);
+    pthread_mutex_destroy(&db->log_lock);
+    pthread_mutex_destroy(&db->close_lock);
+    pthread_rwlock_destroy(&db->history_lock);
+    hst_destroy(&db->history);
+    while (db->stats) {
+        ThreadStats* next = db->stats->next;
+        free(db->stats);
+        db->stats = next;
+    }
+    pthread_mutex_destroy(&db->stats_lock);
+}
+
+bool holds_database(Database const* db) {
+    pthread_t owner = db->owner;
+    return owner != 0 && pthread_equal(owner, pthread_self());
+}
+
+// Are snapshots open? Does not change while a call is inside.
+bool keeping(Database const* db) {
+    return atomic_load_explicit(&db->nsnapshots, memory_order_relaxed) > 0;
+}
+
+// Are deleted nodes buried rather than freed? Replay does what the log says.
+bool burying(Database const* db) {
+    if (db->txn) return db->txn->burying;
+    return db->replaying ? db->bury_logged : keeping(db);
+}
+
+// Gate lock of the calling thread; threads get them in turns
+PaddedLock* gate_of(Database* db) {
+    static atomic_uint next_slot;
+    static _Thread_local unsigned slot = UINT32_MAX;
+    if (slot == UINT32_MAX) slot = atomic_fetch_add(&next_slot, 1);
+    return &db->gate[slot % DB_GATE_LOCKS];
+}
+
+// Take the whole gate, so that no other thread is inside
+void lock_exclusive(Database* db) {
+    for (size_t i = 0; i < DB_GATE_LOCKS; i++) pthread_rwlock_wrlock(&db->gate[i].lock);
+    db->owner = pthread_self();
+}
+
+void unlock_exclusive(Database* db) {
+    db->owner = 0;
+    for (size_t i = DB_GATE_LOCKS; i-- > 0;) pthread_rwlock_unlock(&db->gate[i].lock);
+}
+
+// Enter the database; a call that changes anything takes the log lock too
+Locks lock_database(Database* db, bool changes) {
+    Locks res = { .gate = NULL, .log = false, .changes = changes, .reading = false, .dirs = { NULL, NULL }, .all_dirs = NULL };
+    if (holds_database(db)) return res;
+    res.gate = gate_of(db);
+    pthread_rwlock_rdlock(&res.gate->lock);
+    if (changes && db->wal) {
+        pthread_mutex_lock(&db->log_lock);
+        res.log = true;
+    }
+    return res;
+}
+
+pthread_rwlock_t* dir_lock(Database* db, Node const* dir) {
+    return &db->dir_locks[((uintptr_t) dir / sizeof(Node)) % DB_DIR_LOCKS].lock;
+}
+
+// Lock the children of one or two directories
+void lock_dirs(Database* db, Locks* locks, Node const* a, Node const* b, bool write) {
+    pthread_rwlock_t* first = dir_lock(db, a);
+    pthread_rwlock_t* second = b ? dir_lock(db, b) : first;
+    if (second < first) {
+        pthread_rwlock_t* tmp = first;
+        first = second;
+        second = tmp;
+    }
+    locks->dirs[0] = first;
+    locks->dirs[1] = (second != first ? second : NULL);
+    for (size_t i = 0; i < 2 && locks->dirs[i]; i++) {
+        if (write) {
+            pthread_rwlock_wrlock(locks->dirs[i]);
+        } else {
+            pthread_rwlock_rdlock(locks->dirs[i]);
+        }
+    }
+}
+
+// Lock the children of every directory, in the order of the locks
+void lock_all_dirs(Database* db, Locks* locks) {
+    for (size_t i = 0; i < DB_DIR_LOCKS; i++) pthread_rwlock_wrlock(&db->dir_locks[i].lock);
+    locks->all_dirs = db->dir_locks;
+}
+
+void unlock_dirs(Locks* locks) {
+    for (size_t i = 2; i-- > 0;) {
+        if (locks->dirs[i]) pthread_rwlock_unlock(locks->dirs[i]);
+        locks->dirs[i] = NULL;
+    }
+    for (size_t i = DB_DIR_LOCKS; locks->all_dirs && i-- > 0;) pthread_rwlock_unlock(&locks->all_dirs[i].lock);
+    locks->all_dirs = NULL;
+}
+
+void unlock_database(Database* db, Locks* locks);
+
+// Take the locks a change of the directory needs, if they are free right
+// away; a reader that does not get them does without
+bool try_lock_database(Database* db, Locks* locks, Directory const* dir) {
+    *locks = (Locks) { .gate = NULL, .log = false, .changes = false, .reading = false, .dirs = { NULL, NULL }, .all_dirs = NULL };
+    if (!holds_database(db)) {
+        if (pthread_rwlock_tryrdlock(&gate_of(db)->lock)) return false;
+        locks->gate = gate_of(db);
+        if (db->wal && pthread_mutex_trylock(&db->log_lock)) {
+            unlock_database(db, locks);
+            return false;
+        }
+        locks->log = db->wal != NULL;
+    }
+    if (pthread_rwlock_trywrlock(dir_lock(db, dir))) {
+        unlock_database(db, locks);
+        return false;
+    }
+    locks->dirs[0] = dir_lock(db, dir);
+    return true;
+}
+
+// Enter a read section. It takes no locks: a reader only waits while the
+// database is closed, unless it is inside already or holds the gate, which
+// whoever closed the database waits for.
+bool lock_reader(Database* db, Locks* locks) {
+    *locks = (Locks) { .gate = NULL, .log = false, .changes = false, .reading = false, .dirs = { NULL, NULL }, .all_dirs = NULL };
+    bool inside = alloc_reading(db->allocator) || holds_database(db);
+    for (;;) {
+        if (!alloc_read_lock(db->allocator)) return false;
+        if (inside || !atomic_load(&db->closed)) break;
+        alloc_read_unlock(db->allocator);
+        pthread_mutex_lock(&db->close_lock); // until it opens again
+        pthread_mutex_unlock(&db->close_lock);
+    }
+    locks->reading = true;
+    return true;
+}
+
+// Keep readers out, for what moves nodes or frees them right away: close the
+// database to new readers, wait for the read sections to end and take the
+// gate. Readers inside may still make changes meanwhile, so the gate is taken
+// last. The calling thread must not be in a read section.
+void close_database(Database* db) {
+    pthread_mutex_lock(&db->close_lock);
+    atomic_store(&db->closed, true);
+    while (alloc_readers(db->allocator) > 0) sched_yield();
+    lock_exclusive(db);
+}
+
+void open_database(Database* db) {
+    unlock_exclusive(db);
+    atomic_store(&db->closed, false);
+    pthread_mutex_unlock(&db->close_lock);
+}
+
+// Can no reader be inside until the database opens again?
+bool readers_out(Database* db) {
+    return atomic_load(&db->closed) && alloc_readers(db->allocator) == 0;
+}
+
+bool checkpoint(Database* db);
+void log_change(Database* db, WalRecord rec, void const* data0, void const* data1);
+
+// Free the retired blocks that no reader can see any more, or all of them
+// when no reader is inside and no snapshot is open; readers that come later
+// cannot reach what was retired
+void reclaim(Database* db, bool all) {
+    if (db->replaying || (!all && alloc_retired(db->allocator) < DB_RECLAIM_BATCH)) return;
+    all = all && !keeping(db) && alloc_readers(db->allocator) == 0;
+    size_t n = all ? alloc_retired(db->allocator) : alloc_reclaimable(db->allocator);
+    if (n == 0) return;
+    alloc_reclaim(db->allocator, n);
+    WalRecord rec = { .type = WAL_RECLAIM, .args = { n } };
+    if (db->wal) wal_append(db->wal, &rec, NULL, NULL);
+}
+
+// A thread in a read section cannot wait for the others to leave, and the
+// log cannot be checkpointed while snapshots are open
+void checkpoint_if_due(Database* db) {
+    if (alloc_reading(db->allocator) || (db->wal && keeping(db))) return;
+    if (!atomic_exchange(&db->checkpoint_due, false)) return;
+    close_database(db);
+    checkpoint(db);
+    open_database(db);
+}
+
+// Leave the database, and checkpoint the log if it has grown large
+void unlock_database(Database* db, Locks* locks) {
+    unlock_dirs(locks);
+    if (locks->changes && locks->gate) reclaim(db, false);
+    if (locks->log) pthread_mutex_unlock(&db->log_lock);
+    if (locks->reading) alloc_read_unlock(db->allocator);
+    if (!locks->gate) return;
+    pthread_rwlock_unlock(&locks->gate->lock);
+    checkpoint_if_due(db);
+}
+
+// Statistics
+
+typedef struct ThreadStatsRef {
+    uint64_t id; // of the database, 0 if unused
+    ThreadStats* stats;
+} ThreadStatsRef;
+
+static _Thread_local ThreadStatsRef thread_stats_refs[DB_STATS_SLOTS];
+
+// Counters of the calling thread. They are no part of the database, so
+// calls that do not change it count too.
+ThreadStats* thread_stats(Database const* db) {
+    ThreadStatsRef* ref = &thread_stats_refs[db->id % DB_STATS_SLOTS];
+    if (ref->id == db->id) return ref->stats;
+    Database* mut = (Database*) db;
+    pthread_mutex_lock(&mut->stats_lock);
+    ThreadStats* stats = mut->stats;
+    while (stats && !pthread_equal(stats->thread, pthread_self())) stats = stats->next;
+    if (!stats && (stats = (ThreadStats*) calloc(1, sizeof(ThreadStats)))) {
+        stats->thread = pthread_self();
+        stats->next = mut->stats;
+        mut->stats = stats;
+    }
+    pthread_mutex_unlock(&mut->stats_lock);
+    if (!stats) return &mut->spare_stats;
+    ref->id = db->id;
+    ref->stats = stats;
+    return stats;
+}
+
+// A counter has one writer, its thread, and is read by others, hence the
+// atomic stores; the spare counters have several writers
+void count_stat(ThreadStats* stats, uint64_t* counter, uint64_t n) {
+    if (stats->shared) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+    }
+}
+
+void count_op(Database const* db, DbOp op) {
+    ThreadStats* stats = thread_stats(db);
+    count_stat(stats, &stats->ops[op], 1);
+}
+
+// DIR, INT, STR, FLOAT and BOOL are the bits 0 to 4
+void count_node(Database const* db, Types type, int64_t n) {
+    ThreadStats* stats = thread_stats(db);
+    count_stat(stats, &stats->nodes[__builtin_ctz(type)], (uint64_t) n);
+}
+
+// Sums of the counters of all threads
+void sum_stats(Database* db, uint64_t* ops, uint64_t* nodes) {
+    memset(ops, 0, sizeof(uint64_t) * DB_NOPS);
+    memset(nodes, 0, sizeof(uint64_t) * DB_NTYPES);
+    pthread_mutex_lock(&db->stats_lock);
+    for (ThreadStats* stats = &db->spare_stats; stats; stats = stats == &db->spare_stats ? db->stats : stats->next) {
+        for (size_t i = 0; i < DB_NOPS; i++) ops[i] += __atomic_load_n(&stats->ops[i], __ATOMIC_RELAXED);
+        for (size_t i = 0; i < DB_NTYPES; i++) nodes[i] += __atomic_load_n(&stats->nodes[i], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&db->stats_lock);
+}
+
+// Count the nodes of a subtree by type, walking it like drop_children
+void count_tree(Node const* top, uint64_t* res) {
+    if (!top->type) return;
+    res[__builtin_ctz(top->type)]++;
+    Node const* node = top->type == DIR ? top->child : NULL;
+    while (node) {
+        if (node->type) res[__builtin_ctz(node->type)]++;
+        if (node->type == DIR && node->child) {
+            node = node->child;
+            continue;
+        }
+        while (node != top && !node->next) node = node->parent;
+        node = node == top ? NULL : node->next;
+    }
+}
+
+// Count the nodes there were before the counters started, once. Needs the
+// whole database, which a thread in a read section cannot take.
+bool count_existing(Database* db) {
+    bool held = holds_database(db);
+    if (!held && alloc_reading(db->allocator)) return false;
+    if (!held) lock_exclusive(db);
+    if (!db->counted) {
+        uint64_t found[DB_NTYPES] = { 0 };
+        count_tree(db->root, found);
+        for (size_t i = 0; db->txn && i < db->txn->len; i++) { // not linked yet
+            if (db->txn->ops[i].type == TXN_CREATE) count_tree(db->txn->ops[i].node, found);
+        }
+        uint64_t ops[DB_NOPS], nodes[DB_NTYPES];
+        sum_stats(db, ops, nodes);
+        for (size_t i = 0; i < DB_NTYPES; i++) db->nodes_base[i] = found[i] - nodes[i];
+        db->counted = true;
+    }
+    if (!held) unlock_exclusive(db);
+    return true;
+}
+
+bool database_get_stats(Database* db, DatabaseStats* res) {
+    if (!db || !res) return false;
+    if (!db->counted && !count_existing(db)) return false;
+    sum_stats(db, res->ops, res->nodes);
+    for (size_t i = 0; i < DB_NTYPES; i++) res->nodes[i] += db->nodes_base[i];
+    res->snapshots = atomic_load(&db->nsnapshots);
+    alloc_get_stats(db->allocator, &res->heap);
+    return true;
+}
+
+// Fill in a new node. Its memory is allocated unless the caller has it already.
+Node* create_node(Allocator* allocator, Node* res, Types type, uint64_t name_len, char const* name) {
+    if (!res) res = (Node*) alloc_malloc(allocator, sizeof(Node));
     if (!res) return NULL;
     res->type = type;
+    res->flags = 0;
+    res->inline_used = sizeof(char*);
+    res->value_seq = 0;
     res->next = NULL;
     res->prev = NULL;
+    res->parent = NULL;
     res->child = NULL;
+    res->meta = NULL;
+    res->name = NULL;
     if (name) {
-        res->name = (char*) alloc_malloc(allocator, name_len + 1);
-        if (!res->name) {
-            alloc_free(allocator, res);
-            return NULL;
+        char* dst;
+        if (name_len + 1 <= NODE_INLINE_SIZE) {
+            dst = res->inline_data;
+            res->flags |= NODE_INLINE_NAME;
+            res->inline_used = name_len + 1;
+        } else {
+            dst = res->name = (char*) alloc_malloc(allocator, name_len + 1);
+            if (!dst) {
+                alloc_free(allocator, res);
+                return NULL;
+            }
         }
-        memcpy(res->name, name, name_len);
-        *(res->name + name_len) = '\0';
+        memcpy(dst, name, name_len);
+        *(dst + name_len) = '\0';
     }
     return res;
 }
 
-Node* create_dir_node(Allocator* allocator, uint64_t name_len, char const* name) {
-    return create_node(allocator, DIR, name_len, name);
+// Store a copy of a string value in the node; inline, if it fits after the name
+bool set_str_value(Allocator* allocator, Node* node, String value) {
+    char* cpy;
+    if (value.size + 1 <= (uint64_t) (NODE_INLINE_SIZE - node->inline_used)) {
+        cpy = node->inline_data + node->inline_used;
+        node->flags |= NODE_INLINE_STR;
+    } else {
+        cpy = (char*) alloc_malloc(allocator, value.size + 1);
+        if (!cpy) return false;
+        node->flags &= ~NODE_INLINE_STR;
+    }
+    memmove(cpy, value.data, value.size);
+    *(cpy + value.size) = '\0';
+    node->data.str_value.size = value.size;
+    node->data.str_value.data = cpy;
+    return true;
+}
+
+// Collect the blocks the node owns out of line, at most NODE_DATA_BLOCKS,
+// and destroy its indexes. The b-tree is freed right away, since ordered
+// iteration is not lock-free.
+#define NODE_DATA_BLOCKS 4
+size_t node_data_blocks(Allocator* allocator, Node* node, void** res) {
+    size_t n = 0;
+    if (node->type == STR && !(node->flags & NODE_INLINE_STR)) {
+        res[n++] = node->data.str_value.data;
+    }
+    if (!(node->flags & NODE_INLINE_NAME) && node->name) {
+        res[n++] = node->name;
+    }
+    if (node->type == DIR && node->meta) {
+        idx_destroy(allocator, &node->meta->index);
+        bt_destroy(allocator, &node->meta->order);
+        alloc_release_chunk(allocator, node->meta->chunk);
+        node->meta->chunk = NULL;
+        if (node->meta->column) res[n++] = node->meta->column;
+        node->meta->column = NULL;
+        res[n++] = node->meta;
+    }
+    return n;
+}
+
+// Retire everything the node owns out of line, but not the node itself
+void free_node_data(Allocator* allocator, Node* node) {
+    void* blocks[NODE_DATA_BLOCKS];
+    alloc_retire_bulk(allocator, blocks, node_data_blocks(allocator, node, blocks));
+}
+
+DirMeta* get_dir_meta(Allocator* allocator, Directory* dir) {
+    if (!dir->meta) {
+        DirMeta* meta = (DirMeta*) alloc_malloc(allocator, sizeof(DirMeta));
+        if (!meta) return NULL;
+        memset(meta, 0, sizeof(DirMeta));
+        __atomic_store_n(&dir->meta, meta, __ATOMIC_RELEASE);
+    }
+    return dir->meta;
+}
+
+// The name index of a directory, if it was built; readers may call it
+Index* dir_index(Directory const* dir) {
+    DirMeta* meta = __atomic_load_n(&dir->meta, __ATOMIC_ACQUIRE);
+    return meta && __atomic_load_n(&meta->index.table, __ATOMIC_ACQUIRE) ? &meta->index : NULL;
+}
+
+// Get the name index of the directory, building it if it was never needed before
+Index* get_dir_index(Allocator* allocator, Directory* dir) {
+    DirMeta* meta = get_dir_meta(allocator, dir);
+    if (!meta) return NULL;
+    if (!meta->index.table) { // readers see the index only once it is complete
+        uint64_t n = 0;
+        for (Node* node = dir->child; node; node = node->next) n++;
+        Index built;
+        if (!idx_init(allocator, &built, n)) return NULL;
+        for (Node* node = dir->child; node; node = node->next) {
+            if (!(node->flags & NODE_DEAD)) idx_insert(allocator, &built, node); // does not grow
+        }
+        idx_replace(allocator, &meta->index, &built);
+    }
+    return &meta->index;
+}
+
+// Can a child of the type go into the directory? A columnar directory
+// only takes leaves of the type of its column.
+bool fits_dir(Directory const* dir, Types type) {
+    return !dir->meta || !dir->meta->column || dir->meta->column->type == type;
+}
+
+// Is the name taken in a directory that requires distinct names? A clear
+// that ran out of memory drops the index, which is built again then; a name
+// counts as taken if that fails too.
+bool name_taken(Allocator* allocator, Directory* dir, char const* name) {
+    if (!dir->meta || !dir->meta->unique) return false;
+    Index const* index = get_dir_index(allocator, dir);
+    return !index || idx_find(index, name);
+}
+
+// Put a new node at the head of the children of parent
+bool link_node(Allocator* allocator, Directory* parent, Node* node) {
+    DirMeta* meta = parent->meta;
+    if (meta && meta->index.table && !idx_insert(allocator, &meta->index, node)) {
+        return false;
+    }
+    if (meta && meta->order.root && !bt_insert(allocator, &meta->order, node)) {
+        if (meta->index.table) idx_remove(&meta->index, node);
+        return false;
+    }
+    if (meta && meta->column && !col_insert(allocator, &meta->column, node)) {
+        if (meta->index.table) idx_remove(&meta->index, node);
+        if (meta->order.root) bt_remove(&meta->order, node);
+        return false;
+    }
+    if (parent->child) parent->child->prev = node;
+    node->next = parent->child;
+    node->prev = parent;
+    node->parent = parent;
+    __atomic_store_n(&parent->child, node, __ATOMIC_RELEASE);
+    return true;
+}
+
+Node* create_dir_node(Allocator* allocator, Node* res, uint64_t name_len, char const* name) {
+    return create_node(allocator, res, DIR, name_len, name);
 }
 
-Node* create_leaf_node(Allocator* allocator, Types type, char const* name, Value value) {
-    Node* res = create_node(allocator, type, strlen(name), name);
+Node* create_leaf_node(Allocator* allocator, Node* res, Types type, char const* name, Value value) {
+    res = create_node(allocator, res, type, strlen(name), name);
     if (!res) return NULL;
+    if (type != STR) {
+        res->data = value;
+    } else if (!set_str_value(allocator, res, value.str_value)) {
+        free_node_data(allocator, res);
+        alloc_free(allocator, res);
+        return NULL;
+    }
+    return res;
+}
+
+// Logged changes refer to nodes by their offset in the file
+uint64_t node_offset(Database const* db, Node const* node) {
+    return alloc_offset(db->allocator, node);
+}
+
+Node* node_at(Database const* db, uint64_t offset) {
+    return (Node*) alloc_at(db->allocator, offset);
+}
+
+// Bytes that represent a value in the log
+uint64_t value_bytes(Types type, Value const* value, void const** data) {
     if (type == STR) {
-        char* cpy = (char*) alloc_malloc(allocator, value.str_value.size + 1);
-        if (!cpy) {
-            alloc_free(allocator, res->name);
-            alloc_free(allocator, res);
-            return NULL;
-        }
-        memcpy(cpy, value.str_value.data, value.str_value.size);
-        *(cpy + value.str_value.size) = '\0';
-        value.str_value.data = cpy;
+        *data = value->str_value.data;
+        return value->str_value.size;
+    }
+    *data = value;
+    return sizeof(Value);
+}
+
+Value value_from_bytes(Types type, char const* data, uint64_t len) {
+    Value res;
+    if (type == STR) {
+        res.str_value.size = len;
+        res.str_value.data = (char*) data;
+    } else {
+        memcpy(&res, data, sizeof(Value));
     }
-    res->data = value;
     return res;
 }
 
+// Append a record of a change that was just made to the log, if there is one.
+// Records are synced in groups or by commits, and the log is checkpointed
+// into the file once it gets large. Failures are remembered by the log and reported by
+// database_sync.
+void log_change(Database* db, WalRecord rec, void const* data0, void const* data1) {
+    if (!db->wal) return;
+    LOG(TRACE, "Logging a change of type %d at %lu.", (int) rec.type, rec.args[0]);
+    wal_append(db->wal, &rec, data0, data1);
+    if (db->txn) return; // synced by the commit
+    if (wal_pending(db->wal) >= WAL_GROUP_SIZE) wal_sync(db->wal);
+    if (wal_size(db->wal) < WAL_CHECKPOINT_SIZE) return;
+    if (holds_database(db) && readers_out(db)) {
+        checkpoint(db);
+    } else {
+        db->checkpoint_due = true; // other threads may be reading the mapping
+    }
+}
+
 Database* database_create_database(char const* filename, size_t initial_size) {
     if (initial_size == 0) {
         initial_size = 1ULL << 31; // 2GB
     }
     Database* res = (Database*) malloc(sizeof(Database));
     if (!res) return NULL;
+    wal_remove(filename); // the log of an earlier database would not match
     res->allocator = alloc_create(filename, initial_size);
-    if (!res->allocator) return NULL;
-    res->root = create_dir_node(res->allocator, 0, NULL);
-    if (!res->root) return NULL;
+    if (!res->allocator) {
+        free(res);
+        return NULL;
+    }
+    res->filename = strdup(filename);
+    res->wal = NULL;
+    res->txn = NULL;
+    pc_init(&res->paths);
+    init_locks(res);
+    res->root = create_dir_node(res->allocator, NULL, 0, NULL);
+    if (!res->root) {
+        database_shutdown_database(res);
+        return NULL;
+    }
+    alloc_set_root(res->allocator, res->root);
+    return res;
+}
+
+// Shift all pointers stored in the tree by delta bytes.
+// Walks directories with an explicit stack, so deep trees are fine.
+bool relocate_tree(Node* root, ptrdiff_t delta) {
+    size_t cap = 64, len = 0;
+    Node** stack = (Node**) malloc(sizeof(Node*) * cap);
+    if (!stack) return false;
+    stack[len++] = root;
+    while (len > 0) {
+        Node* dir = stack[--len];
+        RELOCATE(dir->child, delta);
+        RELOCATE(dir->meta, delta);
+        if (dir->meta) {
+            RELOCATE(dir->meta->chunk, delta);
+            RELOCATE(dir->meta->column, delta);
+            idx_relocate(&dir->meta->index, delta);
+            bt_relocate(&dir->meta->order, delta);
+            if (dir->meta->column) col_relocate(dir->meta->column, delta);
+        }
+        for (Node* node = dir->child; node; node = node->next) {
+            RELOCATE(node->next, delta);
+            RELOCATE(node->prev, delta);
+            RELOCATE(node->parent, delta);
+            if (!(node->flags & NODE_INLINE_NAME)) {
+                RELOCATE(node->name, delta);
+            }
+            if (node->type == STR) { // inline values point into the node, so they move too
+                RELOCATE(node->data.str_value.data, delta);
+            } else if (node->type == DIR) {
+                if (len == cap) {
+                    Node** tmp = (Node**) realloc(stack, sizeof(Node*) * (cap *= 2));
+                    if (!tmp) {
+                        free(stack);
+                        return false;
+                    }
+                    stack = tmp;
+                }
+                stack[len++] = node;
+            }
+        }
+    }
+    free(stack);
+    return true;
+}
+
+// Write a relocated file back. The heap was relocated in a private mapping,
+// and goes into the file the way a checkpoint does, through a log of its
+// own, so that a crash leaves the file either as it was or relocated.
+bool write_relocation(Database* db) {
+    Wal* wal = wal_open(db->filename);
+    if (!wal) return false;
+    bool ok = alloc_checkpoint(db->allocator, wal);
+    wal_close(wal);
+    if (!ok) return false;
+    wal_remove(db->filename);
+    return alloc_set_logged(db->allocator, false);
+}
+
+bool replay_change(void* ctx, WalRecord const* rec);
+void purge_history(Database* db);
+void release_snapshots(Database* db);
+
+// Repeat the changes logged after the last checkpoint and checkpoint them
+bool replay_log(Database* db) {
+    Wal* wal = db->wal;
+    LOG(INFO, "Replaying the write-ahead log of %s.", db->filename);
+    db->wal = NULL; // do not log the changes again
+    db->replaying = true;
+    bool ok = wal_replay(wal, replay_change, db);
+    db->replaying = false;
+    purge_history(db); // the snapshots are gone
+    db->wal = wal;
+    if (!ok) {
+        LOG(ERROR, "The write-ahead log of %s does not match the file.", db->filename);
+        return false;
+    }
+    if (wal_size(wal) == 0 && alloc_get_relocation(db->allocator) == 0) return true;
+    return checkpoint(db);
+}
+
+Database* database_open_database(char const* filename) {
+    Database* res = (Database*) malloc(sizeof(Database));
+    if (!res) return NULL;
+    // with a log, the file only holds the state of the last checkpoint
+    res->wal = NULL;
+    if (wal_exists(filename) && !(res->wal = wal_open(filename))) {
+        free(res);
+        return NULL;
+    }
+    res->allocator = alloc_open(filename, res->wal != NULL);
+    if (!res->allocator) {
+        if (res->wal) wal_close(res->wal);
+        free(res);
+        return NULL;
+    }
+    res->filename = strdup(filename);
+    res->txn = NULL;
+    pc_init(&res->paths);
+    init_locks(res);
+    res->root = alloc_get_root(res->allocator);
+    ptrdiff_t relocation = alloc_get_relocation(res->allocator);
+    if (!res->root) {
+        // the database was destroyed, start over with an empty root
+        res->root = create_dir_node(res->allocator, NULL, 0, NULL);
+        if (!res->root) {
+            database_shutdown_database(res);
+            return NULL;
+        }
+        alloc_set_root(res->allocator, res->root);
+    } else if (relocation != 0 && !relocate_tree(res->root, relocation)) {
+        database_shutdown_database(res);
+        return NULL;
+    }
+    if (relocation != 0 && !res->wal && !write_relocation(res)) { // replay checkpoints a logged file
+        database_shutdown_database(res);
+        return NULL;
+    }
+    if (res->wal && !replay_log(res)) {
+        wal_close(res->wal); // keep the log as it is
+        res->wal = NULL;
+        database_shutdown_database(res);
+        return NULL;
+    }
     return res;
 }
 
 // does not erase any data
 void database_shutdown_database(Database* ptr) {
+    database_abort(ptr);
+    release_snapshots(ptr);
+    reclaim(ptr, true);
+    if (ptr->wal) {
+        checkpoint(ptr); // the log keeps everything if this fails
+        wal_close(ptr->wal);
+    }
+    pc_clear(&ptr->paths);
+    destroy_locks(ptr);
     alloc_destroy(ptr->allocator);
+    free(ptr->filename);
     free(ptr);
 }
 
 void database_destroy_database(Database* ptr) {
 //    fprintf(stderr, "\nDestroying database...\n");
+    database_abort(ptr);
+    release_snapshots(ptr);
     database_clear_directory(ptr, ptr->root);
+    free_node_data(ptr->allocator, ptr->root);
     alloc_free(ptr->allocator, ptr->root);
+    alloc_set_root(ptr->allocator, NULL);
     database_shutdown_database(ptr);
 }
 
-Directory* database_create_directory(Database* db, Directory* parent, char const* name) {
-    if (!parent) parent = db->root;
-    if (parent->type != DIR) return NULL;
-    Node* res = create_dir_node(db->allocator, strlen(name), name); // todo check for existing name?
-    if (!res) return NULL;
-    if (parent->child) parent->child->prev = res;
-    res->next = parent->child;
-    parent->child = res;
-    res->prev = parent;
+// Flags of the node and of all of its ancestors combined
+uint8_t path_flags(Node const* node) {
+    uint8_t res = 0;
+    for (; node; node = node->parent) res |= node_flags(node);
     return res;
 }
 
-Leaf* database_create_leaf(Database* db, Directory* parent, char const* name,
-                           Types type, Value value) { // todo remove copy-paste
-    if (!parent) parent = db->root;
-    if (parent->type != DIR || type == DIR) return NULL; // todo check type is correct
-    Node* res = create_leaf_node(db->allocator, type, name, value);
-    if (!res) return NULL;
-    if (parent->child) parent->child->prev = res;
-    res->next = parent->child;
-    parent->child = res;
-    res->prev = parent;
-    return res;
+// Is the node linked into the tree all the way up to the root?
+bool is_published(Node const* node) {
+    return !(path_flags(node) & NODE_PENDING);
 }
 
-bool database_update_leaf(Database* db, Leaf* leaf, Value new_value) {
-    if (!leaf) return false;
-    if (leaf->type == DIR) return false;
-    if (leaf->type == STR) {
-        char* cpy = (char*) alloc_malloc(db->allocator, new_value.str_value.size + 1);
-        if (!cpy) return false;
-        memcpy(cpy, new_value.str_value.data, new_value.str_value.size);
-        *(cpy + new_value.str_value.size) = '\0';
-        new_value.str_value.data = cpy;
+// Record a change that is about to be made, for the snapshots that must not
+// see it; false if out of memory. Replay only needs the buried nodes.
+bool keep_record(Database* db, HistoryType type, Node* node, Value const* old) {
+    if (!burying(db) || (db->replaying && type != HST_DELETE)) return true;
+    pthread_rwlock_wrlock(&db->history_lock);
+    HistoryRecord* rec = hst_add(&db->history, ++db->version, type, node, old);
+    if (rec) node_set_flags(node, NODE_HISTORY); // before the change shows
+    pthread_rwlock_unlock(&db->history_lock);
+    return rec != NULL;
+}
+
+// Take a record out of the history
+void forget_record(Database* db, HistoryRecord* rec) {
+    pthread_rwlock_wrlock(&db->history_lock);
+    hst_remove(&db->history, rec);
+    if (!hst_find(&db->history, rec->node)) node_clear_flags(rec->node, NODE_HISTORY);
+    pthread_rwlock_unlock(&db->history_lock);
+}
+
+// Forget the records of a node that never showed
+void forget_node(Database* db, Node* node) {
+    if (!(node->flags & NODE_HISTORY)) return;
+    pthread_rwlock_wrlock(&db->history_lock);
+    HistoryRecord* rec;
+    while ((rec = hst_find(&db->history, node))) {
+        hst_remove(&db->history, rec);
+        hst_free(rec);
     }
-    leaf->data = new_value;
-    return true;
+    node_clear_flags(node, NODE_HISTORY);
+    pthread_rwlock_unlock(&db->history_lock);
 }
 
-bool delete_node(Allocator* allocator, Node* ptr) {
-    if (!ptr) return false;
-    if (ptr->next) {
-        ptr->next->prev = ptr->prev;
+// Forget the records made after version, by a transaction that failed
+void drop_records(Database* db, uint64_t version) {
+    HistoryRecord* rec;
+    while ((rec = hst_newest(&db->history)) && rec->version > version) {
+        forget_record(db, rec);
+        hst_free(rec);
     }
-    assert(ptr->prev); // not root
-    if (ptr->prev->child == ptr) { // ptr->prev is our parent
-        ptr->prev->child = ptr->next;
-    } else {
-        ptr->prev->next = ptr->next;
+}
+
+// Is the node buried, or below a buried directory?
+bool is_buried(Database const* db, Node const* node) {
+    return keeping(db) && path_flags(node) & NODE_DEAD;
+}
+
+// Does the directory have children that are not buried?
+bool has_live_children(Directory const* dir) {
+    for (Node const* node = dir->child; node; node = node->next) {
+        if (!(node->flags & NODE_DEAD)) return true;
     }
-    if (ptr->type == STR) {
-        alloc_free(allocator, ptr->data.str_value.data);
+    return false;
+}
+
+// Does the directory have directories in it, buried ones included?
+bool has_subdirs(Directory const* dir) {
+    for (Node const* node = dir->child; node; node = node->next) {
+        if (node->type == DIR) return true;
+    }
+    return false;
+}
+
+bool txn_push(Transaction* txn, TxnOp op) {
+    if (txn->len == txn->cap) {
+        size_t cap = txn->cap ? txn->cap * 2 : 64;
+        TxnOp* tmp = (TxnOp*) realloc(txn->ops, sizeof(TxnOp) * cap);
+        if (!tmp) return false;
+        txn->ops = tmp;
+        txn->cap = cap;
     }
-    alloc_free(allocator, ptr->name);
-    alloc_free(allocator, ptr);
+    txn->ops[txn->len++] = op;
     return true;
 }
 
-bool database_delete_directory(Database* db, Directory* ptr) {
-    if (!db || !ptr) return false;
-    if (ptr->type != DIR) return false;
-    if (ptr->child) return false; // not empty
-    if (ptr == db->root) return false; // do not delete root
-    return delete_node(db->allocator, ptr);
+// Memory for a new node from the reserve of the transaction, which is
+// refilled in bulk; NULL outside of transactions
+Node* take_node(Database* db) {
+    Transaction* txn = db->txn;
+    if (!txn) return NULL;
+    if (txn->nused == txn->nreserved) {
+        txn->nreserved = alloc_malloc_bulk(db->allocator, sizeof(Node), TXN_RESERVE, (void**) txn->reserve);
+        txn->nused = 0;
+        if (txn->nreserved == 0) return NULL;
+    }
+    return txn->reserve[txn->nused++];
 }
 
-bool database_delete_leaf(Database* db, Leaf* ptr) {
-    if (!db || !ptr) return false;
-    if (ptr->type == DIR) return false;
-    return delete_node(db->allocator, ptr);
+// Does the directory have enough children to get a chunk?
+bool crowded(Directory const* dir) {
+    if (dir->meta && dir->meta->chunk) return true;
+    size_t n = 0;
+    for (Node const* node = dir->child; node && n < DB_CHUNK_CHILDREN; node = node->next) n++;
+    return n == DB_CHUNK_CHILDREN;
 }
 
-void clear_dir_dfs(Database* db, Directory* dir) { // NOLINT(*-no-recursion)
-    Iterator it = database_get_directory_content_iterator(db, dir);
-    if (!iterator_is_valid(&it)) { // todo implement method "has_children" or "is_empty"
-        // empty dir
-        return;
+// Memory for a new child of parent, NULL to leave it to create_node.
+// A directory with more than a few children has them allocated from its
+// own chunk, so that iterating it reads memory in order. A transaction
+// takes slots from its reserve, which are next to each other as well.
+Node* new_node(Database* db, Directory* parent) {
+    if (db->txn) return take_node(db);
+    if (!crowded(parent)) return NULL;
+    DirMeta* meta = get_dir_meta(db->allocator, parent);
+    return meta ? (Node*) alloc_malloc_in(db->allocator, sizeof(Node), &meta->chunk) : NULL;
+}
+
+// Link a new node into its directory, unless a transaction has to publish it
+bool attach_node(Database* db, Directory* parent, Node* node) {
+    if (!db->txn || !is_published(parent)) return link_node(db->allocator, parent, node);
+    if (!txn_push(db->txn, (TxnOp) { .type = TXN_CREATE, .node = node })) return false;
+    node->parent = parent;
+    node->flags |= NODE_PENDING;
+    return true;
+}
+
+Directory* create_directory(Database* db, Directory* parent, char const* name) {
+    if (parent->type != DIR || !fits_dir(parent, DIR) || name_taken(db->allocator, parent, name)) return NULL;
+    if ((db->txn && path_flags(parent) & NODE_DELETING) || is_buried(db, parent)) return NULL;
+    Node* res = create_dir_node(db->allocator, new_node(db, parent), strlen(name), name);
+    if (!res) return NULL;
+    if ((!db->txn && !keep_record(db, HST_CREATE, res, NULL)) || !attach_node(db, parent, res)) {
+        forget_node(db, res);
+        free_node_data(db->allocator, res);
+        alloc_free(db->allocator, res);
+        return NULL;
     }
-    do {
-        Types type = iterator_get_type(&it);
-        if (type == DIR) {
-            clear_dir_dfs(db, it._ptr);
-        }
-        Node* next = it._ptr->next;
-        delete_node(db->allocator, it._ptr);
-        it._ptr = next;
-    } while (iterator_is_valid(&it));
+    count_node(db, DIR, 1);
+    log_change(db, (WalRecord) {
+        .type = WAL_CREATE_DIR, .len = { strlen(name) + 1 }, .args = { node_offset(db, parent), node_offset(db, res) }
+    }, name, NULL);
+    return res;
 }
 
-void database_clear_directory(Database* db, Directory* dir) {
-    if (!db) return;
-    if (!dir) dir = db->root;
-    clear_dir_dfs(db, dir);
+Directory* database_create_directory(Database* db, Directory* parent, char const* name) {
+    if (!parent) parent = db->root;
+    count_op(db, DB_OP_CREATE);
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, parent, NULL, true);
+    Directory* res = create_directory(db, parent, name);
+    unlock_database(db, &locks);
+    return res;
 }
 
-Directory* database_get_root_directory(Database* db) {
-    return db->root;
+Leaf* create_leaf(Database* db, Directory* parent, char const* name, Types type, Value value) {
+    if (parent->type != DIR || type == DIR) return NULL; // todo check type is correct
+    if (!fits_dir(parent, type) || name_taken(db->allocator, parent, name)) return NULL;
+    if ((db->txn && path_flags(parent) & NODE_DELETING) || is_buried(db, parent)) return NULL;
+    Node* res = create_leaf_node(db->allocator, new_node(db, parent), type, name, value);
+    if (!res) return NULL;
+    if ((!db->txn && !keep_record(db, HST_CREATE, res, NULL)) || !attach_node(db, parent, res)) {
+        forget_node(db, res);
+        free_node_data(db->allocator, res);
+        alloc_free(db->allocator, res);
+        return NULL;
+    }
+    count_node(db, type, 1);
+    void const* data;
+    uint64_t len = value_bytes(type, &value, &data);
+    log_change(db, (WalRecord) {
+        .type = WAL_CREATE_LEAF, .len = { strlen(name) + 1, len },
+        .args = { node_offset(db, parent), node_offset(db, res), type }
+    }, name, data);
+    return res;
 }
 
-Value const* database_get_leaf_value(Database const* db, Leaf const* leaf) {
-    if (!leaf || leaf->type == DIR) return NULL;
-    return &leaf->data;
+Leaf* database_create_leaf(Database* db, Directory* parent, char const* name,
+                           Types type, Value value) {
+    if (!parent) parent = db->root;
+    count_op(db, DB_OP_CREATE);
+    TRACE_BEGIN(start);
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, parent, NULL, true);
+    Leaf* res = create_leaf(db, parent, name, type, value);
+    TRACE_END(start, .op = TRACE_CREATE_LEAF, .size = type == STR ? value.str_value.size : sizeof(Value), .failed = !res);
+    unlock_database(db, &locks);
+    return res;
+}
+
+Node* scan_children(Directory const* dir, char const* name) {
+    for (Node* node = node_link(&dir->child); node; node = node_link(&node->next)) {
+        if (!(node_flags(node) & NODE_DEAD) && strcmp(node_name(node), name) == 0) return node;
+    }
+    return NULL;
+}
+
+Node* find_child(Database* db, Directory* dir, char const* name) {
+    if (node_type(dir) != DIR) return NULL;
+    bool indexed = dir_index(dir) != NULL;
+    Index* index = get_dir_index(db->allocator, dir);
+    if (index) {
+        if (!indexed) log_change(db, (WalRecord) { .type = WAL_INDEX, .args = { node_offset(db, dir) } }, NULL, NULL);
+        return idx_find(index, name);
+    }
+    return scan_children(dir, name); // out of memory for the index
+}
+
+// Look a child up as a reader. A directory without an index gets one from
+// the first lookup that finds the locks of a change free; lookups that come
+// while they are taken scan the directory instead of waiting.
+Node* lookup_child(Database* db, Directory* dir, char const* name) {
+    if (node_type(dir) != DIR) return NULL;
+    Index* index = dir_index(dir);
+    if (index) return idx_find(index, name);
+    Locks locks;
+    if (!try_lock_database(db, &locks, dir)) return scan_children(dir, name);
+    Node* res = find_child(db, dir, name);
+    unlock_database(db, &locks);
+    return res;
+}
+
+Node* database_find_child(Database* db, Directory* dir, char const* name) {
+    if (!db || !name) return NULL;
+    count_op(db, DB_OP_LOOKUP);
+    if (!dir) dir = db->root;
+    Locks locks;
+    if (!lock_reader(db, &locks)) return NULL;
+    Node* res = lookup_child(db, dir, name);
+    unlock_database(db, &locks);
+    return res;
+}
+
+// Remember a resolved path, unless someone else is using the cache. A node
+// is flagged before it goes into the cache and unlink_node flags it as
+// unlinked before it looks at the cache flag; whichever comes second sees
+// the other, so a deleted node never stays in the cache. Burying a directory
+// clears the cache under the lock, after the directory is flagged dead.
+void cache_path(Database* db, char const* path, uint64_t hash, Node* node) {
+    if (pthread_rwlock_trywrlock(&db->paths_lock)) return;
+    if (!(node_set_flags(node, NODE_CACHED) & NODE_UNLINKED) && !(keeping(db) && path_flags(node) & NODE_DEAD)) {
+        pc_insert(&db->paths, path, hash, node);
+    }
+    pthread_rwlock_unlock(&db->paths_lock);
+}
+
+Node* resolve_path(Database* db, char const* path, uint64_t hash) {
+    char* components = strdup(path);
+    if (!components) return NULL;
+    Node* res = db->root;
+    for (char* name = components; res && *name;) {
+        char* end = strchr(name, '/');
+        if (end) *end = '\0';
+        if (*name) { // skip empty components of "/a//b/"
+            res = lookup_child(db, res, name);
+        }
+        name = (end ? end + 1 : name + strlen(name));
+    }
+    free(components);
+    if (res) cache_path(db, path, hash, res);
+    return res;
+}
+
+Node* database_resolve_path(Database* db, char const* path) {
+    if (!db || !path) return NULL;
+    count_op(db, DB_OP_LOOKUP);
+    uint64_t hash = idx_hash(path);
+    Locks locks;
+    if (!lock_reader(db, &locks)) return NULL;
+    Node* res = NULL;
+    if (pthread_rwlock_tryrdlock(&db->paths_lock) == 0) { // readers do not wait
+        res = pc_find(&db->paths, path, hash);
+        pthread_rwlock_unlock(&db->paths_lock);
+    }
+    if (!res) res = resolve_path(db, path, hash);
+    unlock_database(db, &locks);
+    return res;
+}
+
+bool set_ordered(Database* db, Directory* dir, bool ordered) {
+    if (dir->type != DIR) return false;
+    bool was_ordered = dir->meta && dir->meta->order.root;
+    if (ordered == was_ordered) return true;
+    if (!ordered) {
+        bt_destroy(db->allocator, &dir->meta->order);
+    } else {
+        DirMeta* meta = get_dir_meta(db->allocator, dir);
+        if (!meta || !bt_init(db->allocator, &meta->order)) return false;
+        for (Node* node = dir->child; node; node = node->next) {
+            if (!(node->flags & NODE_DEAD) && !bt_insert(db->allocator, &meta->order, node)) {
+                bt_destroy(db->allocator, &meta->order);
+                return false;
+            }
+        }
+    }
+    log_change(db, (WalRecord) { .type = WAL_ORDERED, .args = { node_offset(db, dir), ordered } }, NULL, NULL);
+    return true;
+}
+
+bool database_set_ordered(Database* db, Directory* dir, bool ordered) {
+    if (!db) return false;
+    if (!dir) dir = db->root;
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, dir, NULL, true);
+    bool res = set_ordered(db, dir, ordered);
+    unlock_database(db, &locks);
+    return res;
+}
+
+bool set_unique_names(Database* db, Directory* dir, bool unique) {
+    if (dir->type != DIR) return false;
+    if (!unique) {
+        if (dir->meta) dir->meta->unique = false;
+    } else {
+        Index* index = get_dir_index(db->allocator, dir);
+        if (!index) return false;
+        for (Node* node = dir->child; node; node = node->next) {
+            if (!(node->flags & NODE_DEAD) && idx_find(index, node_name(node)) != node) return false; // duplicate name
+        }
+        dir->meta->unique = true;
+    }
+    log_change(db, (WalRecord) { .type = WAL_UNIQUE, .args = { node_offset(db, dir), unique } }, NULL, NULL);
+    return true;
+}
+
+bool database_set_unique_names(Database* db, Directory* dir, bool unique) {
+    if (!db) return false;
+    if (!dir) dir = db->root;
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, dir, NULL, true);
+    bool res = set_unique_names(db, dir, unique);
+    unlock_database(db, &locks);
+    return res;
+}
+
+bool set_columnar(Database* db, Directory* dir, Types type) {
+    if (dir->type != DIR || (type && type != INT && type != FLOAT && type != BOOL)) return false;
+    Column* old = dir->meta ? dir->meta->column : NULL;
+    if ((old ? old->type : 0) == type) return true;
+    Column* column = NULL;
+    if (type) {
+        uint64_t n = 0;
+        for (Node* node = dir->child; node; node = node->next) {
+            if (node->flags & NODE_DEAD) continue;
+            if (node->type != type) return false; // the children do not fit
+            n++;
+        }
+        DirMeta* meta = get_dir_meta(db->allocator, dir);
+        if (!meta || !(column = col_create(db->allocator, type, n))) return false;
+        for (Node* node = dir->child; node; node = node->next) {
+            if (!(node->flags & NODE_DEAD)) col_insert(db->allocator, &column, node); // does not grow
+        }
+    }
+    if (dir->meta) dir->meta->column = column;
+    if (old) alloc_free(db->allocator, old); // aggregates lock the directory
+    log_change(db, (WalRecord) { .type = WAL_COLUMNAR, .args = { node_offset(db, dir), type } }, NULL, NULL);
+    return true;
+}
+
+bool database_set_columnar(Database* db, Directory* dir, Types type) {
+    if (!db) return false;
+    if (!dir) dir = db->root;
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, dir, NULL, true);
+    bool res = set_columnar(db, dir, type);
+    unlock_database(db, &locks);
+    return res;
+}
+
+// Aggregate the numeric leaves of a directory without a column, one node
+// at a time
+bool aggregate_children(Directory const* dir, Aggregate op, double* res) {
+    uint64_t n = 0;
+    double acc = 0;
+    for (Node const* node = dir->child; node; node = node->next) {
+        Types type = node->type;
+        if (node->flags & NODE_DEAD || !(type == INT || type == FLOAT || type == BOOL)) continue;
+        double value = type == INT ? node->data.int_value
+                     : type == FLOAT ? node->data.float_value : node->data.bool_value;
+        if (op == AGG_SUM) {
+            acc += value;
+        } else if (op == AGG_MIN && (n == 0 || value < acc)) {
+            acc = value;
+        } else if (op == AGG_MAX && (n == 0 || value > acc)) {
+            acc = value;
+        }
+        n++;
+    }
+    if (n == 0 && (op == AGG_MIN || op == AGG_MAX)) return false;
+    *res = op == AGG_COUNT ? (double) n : acc;
+    return true;
+}
+
+bool database_aggregate(Database* db, Directory* dir, Aggregate op, double* res) {
+    if (!db || !res) return false;
+    count_op(db, DB_OP_AGGREGATE);
+    if (!dir) dir = db->root;
+    Locks locks;
+    if (!lock_reader(db, &locks)) return false;
+    bool ok = false;
+    if (node_type(dir) == DIR) {
+        lock_dirs(db, &locks, dir, NULL, false); // the column changes under the lock
+        Column const* column = dir->meta ? dir->meta->column : NULL;
+        ok = column ? col_aggregate(column, op, res) : aggregate_children(dir, op, res);
+    }
+    unlock_database(db, &locks);
+    return ok;
+}
+
+typedef uint64_t __attribute__((may_alias)) ValueWord;
+
+// Store a value where readers may be reading it, see read_value
+void store_value(Leaf* leaf, Value value) {
+    ValueWord const* src = (ValueWord const*) &value;
+    ValueWord* dst = (ValueWord*) &leaf->data;
+    __atomic_store_n(&leaf->value_seq, leaf->value_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t i = 0; i < sizeof(Value) / sizeof(ValueWord); i++) __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&leaf->value_seq, leaf->value_seq + 1, __ATOMIC_RELEASE);
+    DirMeta* meta = leaf->parent ? leaf->parent->meta : NULL;
+    if (meta && meta->column) col_update(meta->column, leaf);
+}
+
+// Copy the value of a leaf, retrying while it changes
+Value read_value(Leaf const* leaf) {
+    Value res;
+    ValueWord* dst = (ValueWord*) &res;
+    ValueWord const* src = (ValueWord const*) &leaf->data;
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&leaf->value_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        for (size_t i = 0; i < sizeof(Value) / sizeof(ValueWord); i++) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&leaf->value_seq, __ATOMIC_RELAXED) == seq) return res;
+    }
+}
+
+// Can a string of size bytes be written over the one of the leaf? An inline
+// one has the room after the name, one out of the node its whole block.
+bool fits_in_place(Database* db, Leaf const* leaf, uint64_t size) {
+    if (leaf->type != STR) return false;
+    if (leaf->flags & NODE_INLINE_STR) return size + 1 <= (uint64_t) (NODE_INLINE_SIZE - leaf->inline_used);
+    return size + 1 <= alloc_block_size(db->allocator, leaf->data.str_value.data);
+}
+
+// Prepare an update for the transaction, so that applying it cannot fail.
+// Like publish_value, a new string goes out of the node, unless it fits the
+// room of the old one and no snapshot can see that; it is copied into the
+// file either way, in case readers keep it from going in place.
+bool stage_update(Database* db, Leaf* leaf, Value value) {
+    TxnOp op = { .type = TXN_UPDATE, .node = leaf, .value = value };
+    if (leaf->type == STR) {
+        String str = value.str_value;
+        op.in_place = !db->txn->burying && fits_in_place(db, leaf, str.size);
+        char* cpy = (char*) alloc_malloc(db->allocator, str.size + 1);
+        if (!cpy) return false;
+        memcpy(cpy, str.data, str.size);
+        *(cpy + str.size) = '\0';
+        op.value.str_value.data = cpy;
+    }
+    if (!txn_push(db->txn, op)) {
+        if (leaf->type == STR) alloc_free(db->allocator, op.value.str_value.data);
+        return false;
+    }
+    return true;
+}
+
+bool write_in_place(Database* db, Leaf* leaf, String str);
+
+// Readers may be looking at the leaf. A string that goes in place fits the
+// room the leaf has now, which is the one it was checked against or a larger
+// block from an earlier update of the transaction; once readers have kept
+// one from going in place, the staged copies of the later ones are used too,
+// so that the rooms stay as large. False if readers kept this one out.
+bool apply_update(Database* db, TxnOp const* op, bool in_place) {
+    Leaf* leaf = op->node;
+    if (op->in_place && in_place && write_in_place(db, leaf, op->value.str_value)) {
+        alloc_free(db->allocator, op->value.str_value.data);
+        return true;
+    }
+    char* old = leaf->type == STR && !(leaf->flags & NODE_INLINE_STR) ? leaf->data.str_value.data : NULL;
+    store_value(leaf, op->value);
+    if (leaf->type == STR) node_clear_flags(leaf, NODE_INLINE_STR);
+    if (old) alloc_retire(db->allocator, old);
+    return !op->in_place || !in_place;
+}
+
+// Write a string over the one of the leaf, which it fits in the node or in
+// its block, unless a reader may be looking at it. The leaf is marked as
+// changing before the readers are looked for, so that those that come later
+// wait in read_value until the string is written. Replay does what the log
+// says.
+bool write_in_place(Database* db, Leaf* leaf, String str) {
+    uint32_t seq = leaf->value_seq;
+    __atomic_store_n(&leaf->value_seq, seq + 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool res = db->replaying ? db->in_place_logged : !alloc_read_anywhere(db->allocator);
+    if (res) {
+        memmove(leaf->data.str_value.data, str.data, str.size);
+        leaf->data.str_value.data[str.size] = '\0';
+        __atomic_store_n(&leaf->data.str_value.size, str.size, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&leaf->value_seq, seq + 2, __ATOMIC_RELEASE);
+    return res;
+}
+
+// Set the value of a leaf others can see. A new string goes out of the node
+// and the old one is retired, so readers can finish the old one, unless
+// nobody can be reading it: then a string that fits the room of the old one,
+// inline or out of the node, is written over it. Only a transaction sees the leaves it has not
+// published yet, so their strings are written over when the new one fits.
+// in_place tells which way the string went.
+bool publish_value(Database* db, Leaf* leaf, Value value, bool* in_place) {
+    char* old = NULL;
+    *in_place = false;
+    if (leaf->type == STR && db->txn && fits_in_place(db, leaf, value.str_value.size)) {
+        String str = value.str_value;
+        memmove(leaf->data.str_value.data, str.data, str.size);
+        leaf->data.str_value.data[str.size] = '\0';
+        leaf->data.str_value.size = str.size;
+        return true;
+    }
+    if (leaf->type == STR && !db->txn && !keeping(db) && fits_in_place(db, leaf, value.str_value.size)
+        && write_in_place(db, leaf, value.str_value)) {
+        *in_place = true;
+        return true;
+    }
+    if (leaf->type == STR) {
+        String str = value.str_value;
+        char* cpy = (char*) alloc_malloc(db->allocator, str.size + 1);
+        if (!cpy) return false;
+        memcpy(cpy, str.data, str.size);
+        *(cpy + str.size) = '\0';
+        if (!(leaf->flags & NODE_INLINE_STR)) old = leaf->data.str_value.data;
+        value.str_value.data = cpy;
+    }
+    store_value(leaf, value);
+    if (leaf->type == STR) node_clear_flags(leaf, NODE_INLINE_STR);
+    if (old) alloc_retire(db->allocator, old);
+    return true;
+}
+
+bool update_leaf(Database* db, Leaf* leaf, Value new_value) {
+    if (!leaf->type || leaf->type == DIR) return false; // deleted meanwhile, or a directory
+    if ((db->txn && path_flags(leaf) & NODE_DELETING) || is_buried(db, leaf)) return false;
+    bool in_place = false;
+    if (db->txn && is_published(leaf)) {
+        if (!stage_update(db, leaf, new_value)) return false;
+    } else if ((!db->txn && !keep_record(db, HST_UPDATE, leaf, &leaf->data))
+               || !publish_value(db, leaf, new_value, &in_place)) {
+        return false;
+    }
+    void const* data;
+    uint64_t len = value_bytes(leaf->type, &new_value, &data);
+    log_change(db, (WalRecord) {
+        .type = WAL_UPDATE, .len = { 0, len }, .args = { node_offset(db, leaf), in_place }
+    }, NULL, data);
+    return true;
+}
+
+bool database_update_leaf(Database* db, Leaf* leaf, Value new_value) {
+    if (!db || !leaf || !leaf->parent) return false;
+    count_op(db, DB_OP_UPDATE);
+    TRACE_BEGIN(start);
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, leaf->parent, NULL, true);
+    bool res = update_leaf(db, leaf, new_value);
+    TRACE_END(start, .op = TRACE_UPDATE_LEAF, .size = leaf->type == STR ? new_value.str_value.size : sizeof(Value), .failed = !res);
+    unlock_database(db, &locks);
+    return res;
+}
+
+// Flag a node unlinked, and take it out of the path cache; see cache_path
+void uncache_node(Database* db, Node* ptr) {
+    if (node_set_flags(ptr, NODE_UNLINKED) & NODE_CACHED) {
+        pthread_rwlock_wrlock(&db->paths_lock);
+        pc_invalidate(&db->paths, ptr);
+        pthread_rwlock_unlock(&db->paths_lock);
+    }
+}
+
+// Take a node out of the lookups of its directory, but not out of its list
+void hide_node(Database* db, Node* ptr) {
+    uncache_node(db, ptr);
+    DirMeta* meta = ptr->parent->meta;
+    if (meta && meta->index.table) {
+        idx_remove(&meta->index, ptr);
+    }
+    if (meta && meta->order.root) {
+        bt_remove(&meta->order, ptr);
+    }
+    if (meta && meta->column) {
+        col_remove(meta->column, ptr);
+    }
+}
+
+// Undo the last hide_node in the directory. The indexes have room for
+// the node again, since they did not change after it was removed.
+void unhide_node(Database* db, Node* ptr) {
+    node_clear_flags(ptr, NODE_UNLINKED);
+    DirMeta* meta = ptr->parent->meta;
+    if (meta && meta->index.table) {
+        idx_insert(db->allocator, &meta->index, ptr);
+    }
+    if (meta && meta->order.root) {
+        bt_insert(db->allocator, &meta->order, ptr);
+    }
+    if (meta && meta->column) {
+        col_insert(db->allocator, &meta->column, ptr);
+    }
+}
+
+// Take a hidden node out of the list of its directory. Its own links are
+// kept, so that readers standing on it can go on.
+void unlist_node(Node* ptr) {
+    if (ptr->next) {
+        ptr->next->prev = ptr->prev;
+    }
+    assert(ptr->prev); // not root
+    if (ptr->prev->child == ptr) { // ptr->prev is our parent
+        __atomic_store_n(&ptr->prev->child, ptr->next, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&ptr->prev->next, ptr->next, __ATOMIC_RELEASE);
+    }
+}
+
+// Take a node out of its directory, so that relink_node can put it back
+void unlink_node(Database* db, Node* ptr) {
+    hide_node(db, ptr);
+    unlist_node(ptr);
+}
+
+// Undo the last unlink_node in the directory
+void relink_node(Database* db, Node* ptr) {
+    unhide_node(db, ptr);
+    if (ptr->next) {
+        ptr->next->prev = ptr;
+    }
+    if (ptr->prev == ptr->parent) {
+        ptr->prev->child = ptr;
+    } else {
+        ptr->prev->next = ptr;
+    }
+}
+
+// Count a node that is going away as gone and clear its type. Slab slots
+// keep their contents, so this is what makes stale handles invalid.
+void clear_type(Database* db, Node* ptr) {
+    if (!ptr->type) return;
+    count_node(db, ptr->type, -1);
+    __atomic_store_n(&ptr->type, 0, __ATOMIC_RELAXED);
+}
+
+// Retire a node that is out of its directory
+void discard_node(Database* db, Node* ptr) {
+    free_node_data(db->allocator, ptr);
+    clear_type(db, ptr);
+    alloc_retire(db->allocator, ptr);
+}
+
+bool delete_node(Database* db, Node* ptr) {
+    if (!ptr) return false;
+    TRACE_BEGIN(start);
+    unlink_node(db, ptr);
+    discard_node(db, ptr);
+    TRACE_END(start, .op = TRACE_DELETE_NODE);
+    return true;
+}
+
+// Flag a hidden node dead, leaving it to the snapshots that still see it.
+// Paths below a directory may be cached, and the cache does not know them.
+void bury_hidden(Database* db, Node* ptr) {
+    node_set_flags(ptr, NODE_DEAD);
+    if (ptr->type != DIR) return;
+    pthread_rwlock_wrlock(&db->paths_lock);
+    pc_clear(&db->paths);
+    pthread_rwlock_unlock(&db->paths_lock);
+}
+
+bool bury_node(Database* db, Node* ptr) {
+    if (!keep_record(db, HST_DELETE, ptr, NULL)) return false;
+    hide_node(db, ptr);
+    bury_hidden(db, ptr);
+    return true;
+}
+
+void drop_children(Database* db, Directory* dir);
+
+// Free a node that is not linked anymore, with everything below it
+void release_node(Database* db, Node* ptr) {
+    if (ptr->type == DIR) drop_children(db, ptr);
+    free_node_data(db->allocator, ptr);
+    clear_type(db, ptr);
+    alloc_free(db->allocator, ptr);
+}
+
+// Delete a node, unless a transaction has to do it
+bool remove_node(Database* db, Node* ptr) {
+    if (!db->txn) return delete_node(db, ptr);
+    uint8_t flags = path_flags(ptr);
+    if (flags & NODE_DELETING) return false; // deleted with an ancestor already
+    if (flags & NODE_PENDING && !(ptr->flags & NODE_PENDING)) return delete_node(db, ptr);
+    if (ptr->flags & NODE_PENDING) { // never linked; the commit skips it
+        if (ptr->type == DIR) drop_children(db, ptr);
+        free_node_data(db->allocator, ptr);
+        clear_type(db, ptr);
+        return true;
+    }
+    if (!txn_push(db->txn, (TxnOp) { .type = TXN_DELETE, .node = ptr })) return false;
+    ptr->flags |= NODE_DELETING;
+    return true;
+}
+
+// Delete a node, or bury it for the snapshots that still see it
+bool bury_or_remove(Database* db, Node* ptr, bool* buried) {
+    *buried = !db->txn && burying(db);
+    return *buried ? bury_node(db, ptr) : remove_node(db, ptr);
+}
+
+bool delete_directory(Database* db, Directory* ptr) {
+    if (ptr->type != DIR || is_buried(db, ptr)) return false;
+    if (has_live_children(ptr)) return false; // not empty
+    if (ptr == db->root) return false; // do not delete root
+    uint64_t offset = node_offset(db, ptr);
+    bool buried;
+    if (!bury_or_remove(db, ptr, &buried)) return false;
+    log_change(db, (WalRecord) { .type = WAL_DELETE, .args = { offset, buried } }, NULL, NULL);
+    return true;
+}
+
+bool database_delete_directory(Database* db, Directory* ptr) {
+    if (!db || !ptr || ptr == db->root) return false;
+    count_op(db, DB_OP_DELETE);
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, ptr->parent, ptr, true); // to see that it is empty
+    bool res = delete_directory(db, ptr);
+    unlock_database(db, &locks);
+    return res;
+}
+
+bool delete_leaf(Database* db, Leaf* ptr) {
+    if (!ptr->type || ptr->type == DIR || is_buried(db, ptr)) return false;
+    uint64_t offset = node_offset(db, ptr);
+    bool buried;
+    if (!bury_or_remove(db, ptr, &buried)) return false;
+    log_change(db, (WalRecord) { .type = WAL_DELETE, .args = { offset, buried } }, NULL, NULL);
+    return true;
+}
+
+bool database_delete_leaf(Database* db, Leaf* ptr) {
+    if (!db || !ptr || !ptr->parent) return false;
+    count_op(db, DB_OP_DELETE);
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, ptr->parent, NULL, true);
+    bool res = delete_leaf(db, ptr);
+    unlock_database(db, &locks);
+    return res;
+}
+
+// Retire everything below a directory at once. The directory is emptied
+// first, so that nobody finds the nodes below, and then they are retired in
+// batches without being unlinked one by one; readers that stand on them
+// walk on through retired nodes, which stay intact until reclaimed. Nodes
+// that fill the chunks they came from are retired a chunk at a time. The
+// walk goes down the first children and back up the parents, needing no
+// stack however deep the tree is.
+void drop_children(Database* db, Directory* dir) {
+    // cheaper than removing the children from the indexes one by one
+    Index empty;
+    if (dir->meta && dir->meta->index.table) {
+        if (idx_init(db->allocator, &empty, 0)) {
+            idx_replace(db->allocator, &dir->meta->index, &empty);
+        } else {
+            idx_destroy(db->allocator, &dir->meta->index); // built again when needed
+        }
+    }
+    if (dir->meta && dir->meta->order.root) {
+        bt_destroy(db->allocator, &dir->meta->order);
+        bt_init(db->allocator, &dir->meta->order);
+    }
+    if (dir->meta && dir->meta->column) col_clear(dir->meta->column);
+    if (dir->meta) { // so that the chunk can go with the children in it
+        alloc_release_chunk(db->allocator, dir->meta->chunk);
+        dir->meta->chunk = NULL;
+    }
+    Node* node = dir->child; // buried children too
+    __atomic_store_n(&dir->child, NULL, __ATOMIC_RELEASE);
+    void* blocks[DB_DROP_BATCH];
+    void* nodes[DB_DROP_BATCH]; // apart, so the ones of a chunk come in a run
+    size_t len = 0, nnodes = 0;
+    while (node) {
+        if (node->type == DIR && node->child) {
+            node = node->child;
+            continue;
+        }
+        for (;;) { // nothing is left below node
+            Node* next = node->next;
+            Node* parent = node->parent;
+            if (len + NODE_DATA_BLOCKS > DB_DROP_BATCH) {
+                alloc_retire_bulk(db->allocator, blocks, len);
+                len = 0;
+            }
+            if (nnodes == DB_DROP_BATCH) nnodes = alloc_retire_most(db->allocator, nodes, nnodes);
+            uncache_node(db, node);
+            len += node_data_blocks(db->allocator, node, blocks + len);
+            clear_type(db, node);
+            nodes[nnodes++] = node;
+            if (next || parent == dir) {
+                node = next;
+                break;
+            }
+            node = parent;
+        }
+    }
+    alloc_retire_bulk(db->allocator, blocks, len);
+    alloc_retire_bulk(db->allocator, nodes, nnodes);
+}
+
+// Bury the children one by one, and log each, since burying may run out of memory
+void bury_children(Database* db, Directory* dir) {
+    for (Node* node = dir->child; node; node = node->next) {
+        if (node->flags & NODE_DEAD) continue;
+        if (!bury_node(db, node)) return;
+        log_change(db, (WalRecord) { .type = WAL_DELETE, .args = { node_offset(db, node), true } }, NULL, NULL);
+    }
+}
+
+void clear_directory(Database* db, Directory* dir) {
+    if (dir->type != DIR || is_buried(db, dir)) return; // deleted meanwhile
+    if (!db->txn && burying(db)) {
+        bury_children(db, dir);
+        return;
+    }
+    if (!db->txn || !is_published(dir)) {
+        drop_children(db, dir);
+    } else {
+        for (Node* node = dir->child; node; node = node->next) {
+            if (!(node->flags & NODE_DEAD)) remove_node(db, node);
+        }
+        for (size_t i = 0; i < db->txn->len; i++) { // and the children that are not linked yet
+            TxnOp* op = &db->txn->ops[i];
+            if (op->type == TXN_CREATE && op->node->parent == dir && op->node->type) remove_node(db, op->node);
+        }
+    }
+    log_change(db, (WalRecord) { .type = WAL_CLEAR, .args = { node_offset(db, dir) } }, NULL, NULL);
+}
+
+void database_clear_directory(Database* db, Directory* dir) {
+    if (!db) return;
+    if (!dir) dir = db->root;
+    count_op(db, DB_OP_CLEAR);
+    Locks locks = lock_database(db, true);
+    lock_dirs(db, &locks, dir, NULL, true);
+    if (has_subdirs(dir)) { // see Locking
+        unlock_dirs(&locks);
+        lock_all_dirs(db, &locks);
+    }
+    clear_directory(db, dir);
+    unlock_database(db, &locks);
+}
+
+// Free a buried node with everything below it
+void purge_node(Database* db, Node* ptr) {
+    uint64_t offset = node_offset(db, ptr);
+    if (ptr->type == DIR) drop_children(db, ptr);
+    unlist_node(ptr);
+    discard_node(db, ptr);
+    log_change(db, (WalRecord) { .type = WAL_PURGE, .args = { offset } }, NULL, NULL);
+}
+
+void purge_record(Database* db, HistoryRecord* rec) {
+    forget_record(db, rec);
+    if (rec->type == HST_DELETE) purge_node(db, rec->node);
+    hst_free(rec);
+}
+
+// Forget the changes that every open snapshot sees, freeing the nodes they
+// buried. Changes below a buried directory were made before it was buried,
+// so they go first. Needs the whole database.
+void purge_history(Database* db) {
+    uint64_t seen = keeping(db) ? ((Snapshot*) db->snapshots.prev)->version : UINT64_MAX;
+    HistoryRecord* rec;
+    while ((rec = hst_oldest(&db->history)) && rec->version <= seen) purge_record(db, rec);
+}
+
+// Snapshots are taken and released with the whole database held, so that no
+// change is halfway made, and the set of snapshots stays put during calls
+Snapshot* database_snapshot(Database* db) {
+    if (!db || holds_database(db) || alloc_reading(db->allocator)) return NULL;
+    Snapshot* res = (Snapshot*) malloc(sizeof(Snapshot));
+    if (!res) return NULL;
+    lock_exclusive(db);
+    res->db = db;
+    res->version = db->version;
+    res->epoch = alloc_pin(db->allocator);
+    if (res->epoch) {
+        lst_push(&db->snapshots, &res->link);
+        db->nsnapshots++;
+    }
+    unlock_exclusive(db);
+    if (!res->epoch) {
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+void release_snapshot(Database* db, Snapshot* snapshot) {
+    lst_remove(&snapshot->link);
+    db->nsnapshots--;
+    alloc_unpin(db->allocator, snapshot->epoch);
+    free(snapshot);
+}
+
+// Release the snapshots the user did not
+void release_snapshots(Database* db) {
+    while (keeping(db)) release_snapshot(db, (Snapshot*) db->snapshots.next);
+    purge_history(db);
+}
+
+bool database_release_snapshot(Database* db, Snapshot* snapshot) {
+    if (!db || !snapshot || holds_database(db) || alloc_reading(db->allocator)) return false;
+    lock_exclusive(db);
+    release_snapshot(db, snapshot);
+    Locks locks = lock_database(db, true);
+    lock_all_dirs(db, &locks); // for the readers that lock directories
+    purge_history(db);
+    unlock_dirs(&locks);
+    reclaim(db, true);
+    unlock_exclusive(db);
+    checkpoint_if_due(db); // deferred while the snapshot was open
+    return true;
+}
+
+// The oldest record of a change to the node that the snapshot does not see
+HistoryRecord const* unseen_change(Snapshot const* snapshot, Node const* node) {
+    HistoryRecord const* res = NULL;
+    HistoryRecord const* rec = hst_find(&snapshot->db->history, node);
+    for (; rec && rec->version > snapshot->version; rec = rec->older) res = rec;
+    return res;
+}
+
+// Was the node in the tree when the snapshot was taken? The history flag
+// is set before a change shows, and dead nodes without it were purged.
+bool snapshot_sees(Snapshot const* snapshot, Node const* node) {
+    uint8_t flags = node_flags(node);
+    if (!(flags & NODE_HISTORY)) return !(flags & NODE_DEAD);
+    pthread_rwlock_rdlock(&snapshot->db->history_lock);
+    HistoryRecord const* rec = unseen_change(snapshot, node);
+    bool res = rec ? rec->type != HST_CREATE : !(node_flags(node) & NODE_DEAD);
+    pthread_rwlock_unlock(&snapshot->db->history_lock);
+    return res;
+}
+
+// The value of a leaf when the snapshot was taken; the oldest update that
+// the snapshot does not see replaced it
+Value snapshot_value(Snapshot const* snapshot, Leaf const* leaf) {
+    Value res = read_value(leaf);
+    if (!(node_flags(leaf) & NODE_HISTORY)) return res;
+    pthread_rwlock_rdlock(&snapshot->db->history_lock);
+    HistoryRecord const* rec = hst_find(&snapshot->db->history, leaf);
+    for (; rec && rec->version > snapshot->version; rec = rec->older) {
+        if (rec->type == HST_UPDATE) res = rec->old;
+    }
+    pthread_rwlock_unlock(&snapshot->db->history_lock);
+    return res;
+}
+
+Iterator database_get_snapshot_iterator(Snapshot const* snapshot, Directory const* dir) {
+    Iterator res = { ._ptr = NULL, ._leaf = NULL, ._pos = 0, ._snapshot = snapshot };
+    if (!snapshot) return res;
+    count_op(snapshot->db, DB_OP_SCAN);
+    if (!dir) dir = snapshot->db->root;
+    if (node_type(dir) == DIR && snapshot_sees(snapshot, dir)) iterator_settle(&res, node_link(&dir->child));
+    return res;
+}
+
+// A transaction keeps the whole database to itself until it ends
+bool database_begin(Database* db) {
+    if (!db || holds_database(db) || alloc_reading(db->allocator)) return false;
+    lock_exclusive(db);
+    Transaction* txn = (Transaction*) calloc(1, sizeof(Transaction));
+    if (!txn) {
+        unlock_exclusive(db);
+        return false;
+    }
+    txn->version = db->version;
+    txn->burying = burying(db);
+    db->txn = txn;
+    log_change(db, (WalRecord) { .type = WAL_BEGIN, .args = { txn->burying } }, NULL, NULL);
+    return true;
+}
+
+// Publish a node created in the transaction
+bool publish_node(Database* db, Node* node) {
+    if (name_taken(db->allocator, node->parent, node_name(node))) return false;
+    node->flags &= ~NODE_PENDING;
+    if (!link_node(db->allocator, node->parent, node)) {
+        node->flags |= NODE_PENDING;
+        return false;
+    }
+    return true;
+}
+
+// Link and unlink the nodes of a transaction, and record the changes for
+// the snapshots; only this part may fail. Nodes deleted while snapshots are
+// open stay in their directories.
+bool apply_links(Database* db, TxnOp const* op) {
+    if (op->type == TXN_CREATE && op->node->type) {
+        return keep_record(db, HST_CREATE, op->node, NULL) && publish_node(db, op->node);
+    }
+    if (op->type == TXN_UPDATE) return keep_record(db, HST_UPDATE, op->node, &op->node->data);
+    if (op->type == TXN_DELETE && !burying(db)) {
+        unlink_node(db, op->node);
+    } else if (op->type == TXN_DELETE) {
+        if (!keep_record(db, HST_DELETE, op->node, NULL)) return false;
+        hide_node(db, op->node);
+    }
+    return true;
+}
+
+void undo_links(Database* db, TxnOp const* op) {
+    if (op->type == TXN_CREATE && op->node->type) {
+        unlink_node(db, op->node);
+        op->node->flags |= NODE_PENDING;
+    } else if (op->type == TXN_DELETE && !burying(db)) {
+        relink_node(db, op->node);
+    } else if (op->type == TXN_DELETE) {
+        unhide_node(db, op->node);
+    }
+}
+
+// Free whatever the transaction holds and end it. Returns which update,
+// counted from 1, readers kept from going in place, 0 if none did.
+uint64_t end_transaction(Database* db, bool committed) {
+    uint64_t refused = 0;
+    Transaction* txn = db->txn;
+    db->txn = NULL;
+    if (!committed) drop_records(db, txn->version); // before their nodes go
+    for (size_t i = 0; i < txn->len; i++) {
+        TxnOp const* op = &txn->ops[i];
+        if (op->type == TXN_CREATE && !committed && op->node->type) {
+            release_node(db, op->node);
+        } else if (op->type == TXN_CREATE && !op->node->type) {
+            alloc_free(db->allocator, op->node); // deleted before it was published
+        } else if (op->type == TXN_UPDATE && committed) {
+            if (db->replaying) db->in_place_logged = !db->refused_logged || i + 1 < db->refused_logged;
+            if (!apply_update(db, op, !refused)) refused = i + 1;
+        } else if (op->type == TXN_UPDATE && op->node->type == STR && op->value.str_value.data) {
+            alloc_free(db->allocator, op->value.str_value.data);
+        } else if (op->type == TXN_DELETE && committed && txn->burying) {
+            bury_hidden(db, op->node);
+        } else if (op->type == TXN_DELETE && committed) {
+            release_node(db, op->node);
+        } else if (op->type == TXN_DELETE) {
+            op->node->flags &= ~NODE_DELETING;
+        }
+    }
+    while (txn->nused < txn->nreserved) alloc_free(db->allocator, txn->reserve[txn->nused++]);
+    free(txn->ops);
+    free(txn);
+    return refused;
+}
+
+bool database_commit(Database* db) {
+    if (!db || !db->txn || !holds_database(db)) return false;
+    count_op(db, DB_OP_COMMIT);
+    Transaction* txn = db->txn;
+    size_t done = 0;
+    bool ok = true;
+    Locks locks = lock_database(db, true);
+    lock_all_dirs(db, &locks); // for the readers that lock directories
+    while (ok && done < txn->len) {
+        ok = apply_links(db, &txn->ops[done++]);
+    }
+    if (!ok) { // undo the links of the operations before the one that failed
+        for (size_t i = done - 1; i-- > 0;) undo_links(db, &txn->ops[i]);
+    }
+    uint64_t refused = end_transaction(db, ok);
+    unlock_dirs(&locks);
+    log_change(db, (WalRecord) { .type = WAL_COMMIT, .args = { ok, refused } }, NULL, NULL);
+    reclaim(db, true); // all of it, unless readers are inside
+    bool synced = !db->wal || wal_sync(db->wal);
+    unlock_exclusive(db);
+    return ok && synced;
+}
+
+void database_abort(Database* db) {
+    if (!db || !db->txn || !holds_database(db)) return;
+    count_op(db, DB_OP_ABORT);
+    end_transaction(db, false);
+    log_change(db, (WalRecord) { .type = WAL_ABORT }, NULL, NULL);
+    unlock_exclusive(db);
+}
+
+void compact(Database* db);
+
+// Repeat a logged change; it has to create nodes where it did the first time
+bool replay_change(void* ctx, WalRecord const* rec) {
+    Database* db = (Database*) ctx;
+    char const* name = (char const*) (rec + 1);
+    char const* data = name + rec->len[0];
+    Node* node = node_at(db, rec->args[0]);
+    Value value;
+    HistoryRecord* buried;
+    db->bury_logged = (rec->type == WAL_DELETE && rec->args[1]) || (rec->type == WAL_BEGIN && rec->args[0]);
+    db->in_place_logged = rec->type == WAL_UPDATE && rec->args[1];
+    db->refused_logged = rec->type == WAL_COMMIT ? rec->args[1] : 0;
+    switch (rec->type) {
+        case WAL_CREATE_DIR:
+            return database_create_directory(db, node, name) == node_at(db, rec->args[1]);
+        case WAL_CREATE_LEAF:
+            value = value_from_bytes(rec->args[2], data, rec->len[1]);
+            return database_create_leaf(db, node, name, rec->args[2], value) == node_at(db, rec->args[1]);
+        case WAL_UPDATE:
+            return database_update_leaf(db, node, value_from_bytes(node->type, data, rec->len[1]));
+        case WAL_DELETE:
+            if (db->bury_logged) return bury_node(db, node); // maybe by a clear
+            return node->type == DIR ? database_delete_directory(db, node) : database_delete_leaf(db, node);
+        case WAL_CLEAR:
+            database_clear_directory(db, node);
+            return true;
+        case WAL_INDEX:
+            return get_dir_index(db->allocator, node) != NULL;
+        case WAL_ORDERED:
+            return database_set_ordered(db, node, rec->args[1]);
+        case WAL_UNIQUE:
+            return database_set_unique_names(db, node, rec->args[1]);
+        case WAL_COLUMNAR:
+            return database_set_columnar(db, node, rec->args[1]);
+        case WAL_BEGIN:
+            return database_begin(db);
+        case WAL_COMMIT:
+            return database_commit(db) == (bool) rec->args[0];
+        case WAL_ABORT:
+            database_abort(db);
+            return true;
+        case WAL_RECLAIM:
+            return alloc_reclaim(db->allocator, rec->args[0]) == rec->args[0];
+        case WAL_COMPACT:
+            compact(db);
+            return true;
+        case WAL_PURGE: // replay keeps only the records of buried nodes
+            buried = hst_find(&db->history, node);
+            if (!buried) return false;
+            purge_record(db, buried);
+            return true;
+        default:
+            return false; // page images are never followed by changes
+    }
+}
+
+bool set_wal(Database* db, bool enabled) {
+    if (enabled == (db->wal != NULL)) return true;
+    if (keeping(db)) return false; // retired blocks would outlive the log, buried nodes go into the file
+    if (enabled) {
+        // the file has to be complete before the log starts, and replay
+        // cannot free blocks retired before it
+        reclaim(db, true);
+        if (!alloc_sync(db->allocator) || !(db->wal = wal_open(db->filename))) return false;
+        if (!alloc_set_logged(db->allocator, true)) {
+            wal_close(db->wal);
+            wal_remove(db->filename);
+            db->wal = NULL;
+            return false;
+        }
+        return true;
+    }
+    if (!checkpoint(db) || !alloc_set_logged(db->allocator, false)) return false;
+    wal_close(db->wal);
+    wal_remove(db->filename);
+    db->wal = NULL;
+    return true;
+}
+
+bool database_set_wal(Database* db, bool enabled) {
+    if (!db || holds_database(db) || alloc_reading(db->allocator)) return false; // not in a transaction
+    close_database(db);
+    bool res = set_wal(db, enabled);
+    open_database(db);
+    return res;
+}
+
+bool database_sync(Database* db) {
+    if (!db) return false;
+    Locks locks = lock_database(db, true);
+    bool res = db->wal ? wal_sync(db->wal) : alloc_sync(db->allocator);
+    unlock_database(db, &locks);
+    return res;
+}
+
+// Only called with the database closed, or with nobody else inside, so every
+// retired block can go. With a log, the file must not get buried nodes, so
+// snapshots defer it.
+bool checkpoint(Database* db) {
+    if (db->wal && (keeping(db) || hst_oldest(&db->history))) {
+        db->checkpoint_due = true;
+        return false;
+    }
+    reclaim(db, true);
+    LOG(DEBUG, "Checkpointing %s.", db->filename);
+    return db->wal ? alloc_checkpoint(db->allocator, db->wal) : alloc_sync(db->allocator);
+}
+
+bool database_checkpoint(Database* db) {
+    if (!db || holds_database(db) || alloc_reading(db->allocator)) return false; // the file must not get half of a transaction
+    close_database(db);
+    bool res = checkpoint(db);
+    open_database(db);
+    return res;
+}
+
+// Compaction. Whatever lies in the arenas the allocator empties is copied
+// lower down, one directory at a time: the children that move take the
+// places of their old copies in the list and the indexes of the directory,
+// and b-trees are built again, since their nodes move too. Nobody is inside
+// and no snapshot is open, so the old copies are freed right away. Given the
+// same heap, compaction moves the same blocks, so replay repeats it.
+
+// Copy a block that has to move, NULL if it does not or there is no room
+void* move_block(Database* db, void* ptr, size_t size) {
+    if (!ptr || !alloc_moving(db->allocator, ptr)) return NULL;
+    void* res = alloc_malloc(db->allocator, size);
+    if (!res) return NULL;
+    memcpy(res, ptr, size);
+    alloc_free(db->allocator, ptr);
+    return res;
+}
+
+void move_dir_meta(Database* db, Directory* dir) {
+    DirMeta* meta = move_block(db, dir->meta, sizeof(DirMeta));
+    if (meta) dir->meta = meta;
+    if (!dir->meta) return;
+    Index* index = &dir->meta->index;
+    IndexEntry* table = move_block(db, index->table, sizeof(IndexEntry) * index->capacity);
+    if (table) index->table = table;
+    Column* column = dir->meta->column ? move_block(db, dir->meta->column, col_bytes(dir->meta->column)) : NULL;
+    if (column) dir->meta->column = column;
+    if (dir->meta->chunk && alloc_moving(db->allocator, dir->meta->chunk)) {
+        alloc_release_chunk(db->allocator, dir->meta->chunk);
+        dir->meta->chunk = NULL;
+    }
+}
+
+// Build the b-tree of a directory again; the old one is kept if that fails
+void rebuild_order(Database* db, Directory* dir) {
+    if (!dir->meta || !dir->meta->order.root) return;
+    BTree built;
+    if (!bt_init(db->allocator, &built)) return;
+    for (Node* node = dir->child; node; node = node->next) {
+        if (!(node->flags & NODE_DEAD) && !bt_insert(db->allocator, &built, node)) {
+            bt_destroy(db->allocator, &built);
+            return;
+        }
+    }
+    bt_destroy(db->allocator, &dir->meta->order);
+    dir->meta->order = built;
+}
+
+// Move a child of dir, or the root if dir is NULL, with what it owns, and
+// return where it is now
+Node* move_node(Database* db, Directory* dir, Node* node) {
+    if (!(node->flags & NODE_INLINE_NAME) && node->name) {
+        char* name = move_block(db, node->name, strlen(node->name) + 1);
+        if (name) node->name = name;
+    }
+    if (node->type == STR && !(node->flags & NODE_INLINE_STR)) {
+        char* str = move_block(db, node->data.str_value.data, node->data.str_value.size + 1);
+        if (str) node->data.str_value.data = str;
+    }
+    if (!alloc_moving(db->allocator, node)) return node;
+    Node* res = (Node*) alloc_malloc(db->allocator, sizeof(Node));
+    if (!res) return node;
+    memcpy(res, node, sizeof(Node));
+    DirMeta* meta = dir ? dir->meta : NULL;
+    if (meta && !(node->flags & NODE_DEAD)) { // the indexes have room for res once node is out
+        if (meta->index.table) {
+            idx_remove(&meta->index, node);
+            idx_insert(db->allocator, &meta->index, res);
+        }
+        if (meta->order.root) {
+            bt_remove(&meta->order, node);
+            bt_insert(db->allocator, &meta->order, res);
+        }
+        if (meta->column) {
+            col_remove(meta->column, node);
+            col_insert(db->allocator, &meta->column, res);
+        }
+    }
+    alloc_free(db->allocator, node);
+    if (res->type == STR && res->flags & NODE_INLINE_STR) {
+        res->data.str_value.data += (char*) res - (char*) node;
+    }
+    if (res->next) res->next->prev = res;
+    if (!dir) {
+        db->root = res;
+        alloc_set_root(db->allocator, res);
+    } else if (res->prev == dir) {
+        dir->child = res;
+    } else {
+        res->prev->next = res;
+    }
+    if (res->type == DIR && res->child) {
+        res->child->prev = res;
+        for (Node* child = res->child; child; child = child->next) child->parent = res;
+    }
+    return res;
+}
+
+// Move everything out of the arenas the allocator picks, and tell whether
+// they could be dropped. Walks directories with an explicit stack, like
+// relocate_tree.
+bool compact_pass(Database* db) {
+    alloc_reclaim(db->allocator, alloc_retired(db->allocator)); // nobody is inside
+    if (!alloc_compact_begin(db->allocator)) return false;
+    pc_clear(&db->paths);
+    size_t cap = 64, len = 0;
+    Node** stack = (Node**) malloc(sizeof(Node*) * cap);
+    if (stack) stack[len++] = move_node(db, NULL, db->root);
+    while (len > 0) {
+        Directory* dir = stack[--len];
+        move_dir_meta(db, dir);
+        for (Node* node = dir->child; node; node = node->next) {
+            node = move_node(db, dir, node);
+            if (node->type != DIR) continue;
+            if (len == cap) {
+                Node** tmp = (Node**) realloc(stack, sizeof(Node*) * (cap *= 2));
+                if (!tmp) break; // what is left stays where it is
+                stack = tmp;
+            }
+            stack[len++] = node;
+        }
+        rebuild_order(db, dir);
+    }
+    free(stack);
+    alloc_reclaim(db->allocator, alloc_retired(db->allocator));
+    return alloc_compact_end(db->allocator);
+}
+
+// Each pass makes room lower down for the next one
+void compact(Database* db) {
+    while (compact_pass(db)) {}
+}
+
+bool database_compact(Database* db) {
+    if (!db || holds_database(db) || alloc_reading(db->allocator)) return false;
+    close_database(db);
+    bool res = !keeping(db) && !hst_oldest(&db->history);
+    if (res) {
+        compact(db);
+        LOG(INFO, "Compacted %s.", db->filename);
+        log_change(db, (WalRecord) { .type = WAL_COMPACT }, NULL, NULL);
+        checkpoint(db); // only a checkpoint shrinks a logged file
+    }
+    open_database(db);
+    return res;
+}
+
+Directory* database_get_root_directory(Database* db) {
+    return db->root;
+}
+
+Value const* database_get_leaf_value(Database const* db, Leaf const* leaf) {
+    if (db) count_op(db, DB_OP_READ);
+    if (!leaf || leaf->type == DIR) return NULL;
+    return &leaf->data;
+}
+
+bool database_read_leaf_value(Database* db, Leaf const* leaf, Value* res) {
+    if (!db || !leaf || !res) return false;
+    count_op(db, DB_OP_READ);
+    Types type = node_type(leaf);
+    if (!type || type == DIR) return false;
+    *res = read_value(leaf);
+    return true;
+}
+
+bool database_read_begin(Database* db) {
+    if (!db) return false;
+    Locks locks;
+    return lock_reader(db, &locks);
+}
+
+void database_read_end(Database* db) {
+    if (!db || !alloc_reading(db->allocator)) return;
+    alloc_read_unlock(db->allocator);
+    if (!holds_database(db)) checkpoint_if_due(db);
 }
 
 Iterator database_get_directory_content_iterator(Database const* db, Directory const* dir) {
     if (!dir) dir = db->root;
-    Iterator res;
-    res._ptr = (dir->type == DIR ? dir->child : NULL);
+    count_op(db, DB_OP_SCAN);
+    Iterator res = { ._ptr = NULL, ._leaf = NULL, ._pos = 0, ._snapshot = NULL };
+    if (node_type(dir) == DIR) iterator_settle(&res, node_link(&dir->child));
     return res;
 }
 
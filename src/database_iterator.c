@@ -3,6 +3,25 @@
 
 #include <stddef.h>
 
+// Buried nodes stay in their directories for snapshots, so iterators walk
+// past the nodes they do not show
+bool iterator_shows(Iterator const* it, Node const* node) {
+    if (it->_snapshot) return snapshot_sees(it->_snapshot, node);
+    return !(node_flags(node) & NODE_DEAD);
+}
+
+Node* iterator_next_shown(Iterator const* it, Node* ptr) {
+    while (ptr && !iterator_shows(it, ptr)) ptr = node_link(&ptr->next);
+    return ptr;
+}
+
+void iterator_settle(Iterator* it, Node* ptr) {
+    it->_ptr = iterator_next_shown(it, ptr);
+    if (it->_ptr && it->_snapshot && node_type(it->_ptr) != DIR) {
+        it->_value = snapshot_value(it->_snapshot, it->_ptr);
+    }
+}
+
 Node const* iterator_get(Iterator const* it) {
     return it ? it->_ptr : NULL;
 }
@@ -13,26 +32,48 @@ bool iterator_is_valid(Iterator const* it) {
 
 Types iterator_get_type(Iterator const* it) {
     if (!iterator_is_valid(it)) return 0;
-    return it->_ptr->type;
+    return node_type(it->_ptr);
 }
 
 Value const* iterator_get_value(Iterator const* it) {
-    if (!iterator_is_valid(it) || it->_ptr->type == DIR) return NULL;
-    return &it->_ptr->data;
+    if (!iterator_is_valid(it) || node_type(it->_ptr) == DIR) return NULL;
+    return it->_snapshot ? &it->_value : &it->_ptr->data;
 }
 
 char const* iterator_get_name(Iterator const* it) {
     if (!iterator_is_valid(it)) return NULL;
-    return it->_ptr->name;
+    return node_name(it->_ptr);
 }
 
 bool iterator_has_next(Iterator const* it) {
-    return iterator_is_valid(it) && it->_ptr->next != NULL;
+    if (!iterator_is_valid(it)) return false;
+    if (!it->_leaf) return iterator_next_shown(it, node_link(&it->_ptr->next)) != NULL;
+    BTreeNode const* leaf = it->_leaf;
+    uint32_t pos = it->_pos;
+    return bt_next(&leaf, &pos);
 }
 
 bool iterator_next(Iterator* it) {
-    if (!iterator_has_next(it)) return false;
-    it->_ptr = it->_ptr->next;
+    if (!iterator_is_valid(it)) return false;
+    if (!it->_leaf) {
+        Node* next = iterator_next_shown(it, node_link(&it->_ptr->next));
+        if (!next) return false;
+        iterator_settle(it, next);
+    } else {
+        if (!iterator_has_next(it)) return false;
+        bt_next(&it->_leaf, &it->_pos);
+        it->_ptr = it->_leaf->entries[it->_pos];
+    }
     return true;
 }
 
+Iterator iterator_seek(Node const* dir, char const* key) {
+    Iterator res = { ._ptr = NULL, ._leaf = NULL, ._pos = 0, ._snapshot = NULL };
+    if (!dir || dir->type != DIR || !dir->meta || !dir->meta->order.root) return res;
+    if (bt_seek(&dir->meta->order, key ? key : "", &res._leaf, &res._pos)) {
+        res._ptr = res._leaf->entries[res._pos];
+    } else {
+        res._leaf = NULL;
+    }
+    return res;
+}
@@ -0,0 +1,115 @@
+#include "internals.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// History of the changes that open snapshots must not see, kept in memory.
+// Records are kept in the order of their versions, and every node with
+// records has a chain of them, newest first, found through a hash table
+// keyed by the address of the node (see node_table.c).
+// Records go away oldest first, or newest first when a transaction that
+// made them fails, so chains are walked rather than doubly linked.
+
+#define HISTORY_MIN_CAPACITY 64
+
+void hst_init(History* history) {
+    lst_init(&history->records);
+    history->table = NULL;
+    history->capacity = 0;
+    history->size = 0;
+}
+
+// Entry of the table for node, or the empty one it would take
+HistoryEntry* hst_entry(History const* history, Node const* node) {
+    return (HistoryEntry*) ntab_entry(history->table, sizeof(HistoryEntry), history->capacity, node);
+}
+
+bool hst_grow(History* history) {
+    uint64_t capacity = history->capacity ? history->capacity * 2 : HISTORY_MIN_CAPACITY;
+    HistoryEntry* table = (HistoryEntry*) calloc(capacity, sizeof(HistoryEntry));
+    if (!table) return false;
+    HistoryEntry* old = history->table;
+    uint64_t old_capacity = history->capacity;
+    history->table = table;
+    history->capacity = capacity;
+    for (uint64_t i = 0; i < old_capacity; i++) {
+        if (old[i].node) *hst_entry(history, old[i].node) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+HistoryRecord* hst_add(History* history, uint64_t version, HistoryType type, Node* node, Value const* old) {
+    if ((history->size + 1) * 4 > history->capacity * 3 && !hst_grow(history)) return NULL;
+    HistoryRecord* rec = (HistoryRecord*) malloc(sizeof(HistoryRecord));
+    if (!rec) return NULL;
+    rec->version = version;
+    rec->type = type;
+    rec->node = node;
+    rec->owns_str = false;
+    if (type == HST_UPDATE) {
+        rec->old = *old;
+        if (node->type == STR) { // the string may be overwritten or freed
+            char* cpy = (char*) malloc(old->str_value.size + 1);
+            if (!cpy) {
+                free(rec);
+                return NULL;
+            }
+            memcpy(cpy, old->str_value.data, old->str_value.size + 1);
+            rec->old.str_value.data = cpy;
+            rec->owns_str = true;
+        }
+    }
+    HistoryEntry* entry = hst_entry(history, node);
+    if (!entry->node) {
+        entry->node = node;
+        history->size++;
+    }
+    rec->older = entry->newest;
+    entry->newest = rec;
+    lst_push(&history->records, &rec->link);
+    return rec;
+}
+
+HistoryRecord* hst_find(History const* history, Node const* node) {
+    if (!history->size) return NULL;
+    return hst_entry(history, node)->newest;
+}
+
+HistoryRecord* hst_newest(History const* history) {
+    List* first = history->records.next;
+    return first == &history->records ? NULL : (HistoryRecord*) first;
+}
+
+HistoryRecord* hst_oldest(History const* history) {
+    List* last = history->records.prev;
+    return last == &history->records ? NULL : (HistoryRecord*) last;
+}
+
+void hst_remove(History* history, HistoryRecord* rec) {
+    HistoryEntry* entry = hst_entry(history, rec->node);
+    HistoryRecord** link = &entry->newest;
+    while (*link != rec) link = &(*link)->older;
+    *link = rec->older;
+    lst_remove(&rec->link);
+    if (entry->newest) return;
+
+    // the node has no records left
+    history->size--;
+    ntab_remove(history->table, sizeof(HistoryEntry), history->capacity, entry);
+}
+
+void hst_free(HistoryRecord* rec) {
+    if (rec->owns_str) free(rec->old.str_value.data);
+    free(rec);
+}
+
+void hst_destroy(History* history) {
+    HistoryRecord* rec;
+    while ((rec = hst_oldest(history))) {
+        lst_remove(&rec->link);
+        hst_free(rec);
+    }
+    free(history->table);
+    hst_init(history);
+}
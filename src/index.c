@@ -0,0 +1,172 @@
+#include "internals.h"
+
+#include <string.h>
+
+// Hash index of the children of a directory by name.
+// Open addressing with linear probing; an entry with hash 0 is empty.
+// The table doubles when it gets more than 3/4 full. Removal shifts the
+// following entries back instead of leaving tombstones, so lookups never
+// slow down because of deletions.
+// Several children may have the same name, each has its own entry.
+//
+// Lookups do not lock the directory. Every change to the table is bracketed
+// by two increments of seq, and a lookup that saw seq odd or changed retries,
+// like a seqlock. While it runs, a lookup may see a table in the middle of a
+// change, so it reads it with atomic loads, stays within the capacity it
+// read, and only follows pointers to nodes, which the callers keep from
+// being freed under it; replaced tables are retired for the same reason.
+
+#define INDEX_MIN_CAPACITY 16
+#define INDEX_FULL(size, capacity) ((size) * 4 > (capacity) * 3)
+
+// FNV-1a, with 0 reserved for empty entries
+uint64_t idx_hash(char const* name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char const* p = (unsigned char const*) name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+bool idx_init(Allocator* allocator, Index* idx, uint64_t capacity) {
+    uint64_t cap = INDEX_MIN_CAPACITY;
+    while (INDEX_FULL(capacity, cap)) cap *= 2;
+    idx->table = (IndexEntry*) alloc_malloc(allocator, sizeof(IndexEntry) * cap);
+    if (!idx->table) return false;
+    memset(idx->table, 0, sizeof(IndexEntry) * cap);
+    idx->capacity = cap;
+    idx->size = 0;
+    idx->seq = 0;
+    return true;
+}
+
+// A lookup reads the capacity before the table, so a table is published
+// before its capacity grows, and the capacity shrinks before the table goes
+void idx_publish(Index* idx, IndexEntry* table, uint64_t capacity) {
+    if (capacity < idx->capacity) __atomic_store_n(&idx->capacity, capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&idx->table, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&idx->capacity, capacity, __ATOMIC_RELEASE);
+}
+
+void idx_begin_change(Index* idx) {
+    __atomic_store_n(&idx->seq, idx->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void idx_end_change(Index* idx) {
+    __atomic_store_n(&idx->seq, idx->seq + 1, __ATOMIC_RELEASE);
+}
+
+void idx_retire(Allocator* allocator, IndexEntry* table) {
+    if (table) alloc_retire(allocator, table); // leaked if there is no memory to retire it
+}
+
+void idx_replace(Allocator* allocator, Index* idx, Index const* built) {
+    IndexEntry* old = idx->table;
+    idx_begin_change(idx);
+    idx_publish(idx, built->table, built->capacity);
+    idx->size = built->size;
+    idx_end_change(idx);
+    idx_retire(allocator, old);
+}
+
+void idx_destroy(Allocator* allocator, Index* idx) {
+    Index const none = { NULL, 0, 0, 0 };
+    idx_replace(allocator, idx, &none);
+}
+
+// Put an entry into a table that has room for it
+void idx_put(IndexEntry* table, uint64_t capacity, uint64_t hash, Node* node) {
+    uint64_t mask = capacity - 1;
+    uint64_t i = hash & mask;
+    while (table[i].hash) i = (i + 1) & mask;
+    __atomic_store_n(&table[i].node, node, __ATOMIC_RELAXED);
+    __atomic_store_n(&table[i].hash, hash, __ATOMIC_RELAXED);
+}
+
+bool idx_grow(Allocator* allocator, Index* idx) {
+    Index bigger;
+    if (!idx_init(allocator, &bigger, idx->capacity)) return false;
+    for (uint64_t i = 0; i < idx->capacity; i++) {
+        if (idx->table[i].hash) idx_put(bigger.table, bigger.capacity, idx->table[i].hash, idx->table[i].node);
+    }
+    IndexEntry* old = idx->table;
+    idx_publish(idx, bigger.table, bigger.capacity);
+    idx_retire(allocator, old);
+    return true;
+}
+
+bool idx_insert(Allocator* allocator, Index* idx, Node* node) {
+    idx_begin_change(idx);
+    bool ok = !INDEX_FULL(idx->size + 1, idx->capacity) || idx_grow(allocator, idx);
+    if (ok) {
+        idx_put(idx->table, idx->capacity, idx_hash(node_name(node)), node);
+        idx->size++;
+    }
+    idx_end_change(idx);
+    return ok;
+}
+
+// One probe of a table that may be changing under it
+Node* idx_probe(Index const* idx, uint64_t hash, char const* name) {
+    uint64_t capacity = __atomic_load_n(&idx->capacity, __ATOMIC_ACQUIRE);
+    IndexEntry const* table = __atomic_load_n(&idx->table, __ATOMIC_ACQUIRE);
+    if (!table || capacity == 0) return NULL;
+    uint64_t mask = capacity - 1;
+    uint64_t i = hash & mask;
+    for (uint64_t n = 0; n < capacity; n++, i = (i + 1) & mask) {
+        uint64_t h = __atomic_load_n(&table[i].hash, __ATOMIC_RELAXED);
+        if (!h) return NULL;
+        Node* node = __atomic_load_n(&table[i].node, __ATOMIC_RELAXED);
+        if (h == hash && node && strcmp(node_name(node), name) == 0) return node;
+    }
+    return NULL;
+}
+
+Node* idx_find(Index const* idx, char const* name) {
+    uint64_t hash = idx_hash(name);
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue; // a change is under way
+        Node* res = idx_probe(idx, hash, name);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&idx->seq, __ATOMIC_RELAXED) == seq) return res;
+    }
+}
+
+void idx_remove(Index* idx, Node* node) {
+    uint64_t mask = idx->capacity - 1;
+    uint64_t i = idx_hash(node_name(node)) & mask;
+    while (idx->table[i].node != node) {
+        if (!idx->table[i].hash) return; // not indexed
+        i = (i + 1) & mask;
+    }
+    idx_begin_change(idx);
+    idx->size--;
+
+    // shift back the entries of the cluster that would not be found otherwise
+    for (uint64_t j = i;;) {
+        __atomic_store_n(&idx->table[i].hash, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&idx->table[i].node, NULL, __ATOMIC_RELAXED);
+        uint64_t home;
+        do {
+            j = (j + 1) & mask;
+            if (!idx->table[j].hash) {
+                idx_end_change(idx);
+                return;
+            }
+            home = idx->table[j].hash & mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        __atomic_store_n(&idx->table[i].node, idx->table[j].node, __ATOMIC_RELAXED);
+        __atomic_store_n(&idx->table[i].hash, idx->table[j].hash, __ATOMIC_RELAXED);
+        i = j;
+    }
+}
+
+void idx_relocate(Index* idx, ptrdiff_t delta) {
+    RELOCATE(idx->table, delta);
+    for (uint64_t i = 0; i < idx->capacity; i++) {
+        RELOCATE(idx->table[i].node, delta);
+    }
+}
@@ -35,6 +35,17 @@ void lst_push(List* lst, void* p) {
     lst->next = e;
 }
 
+// Shift all links of the list by delta bytes. The list must have been moved
+// as a whole, including its head.
+void lst_relocate(List* lst, ptrdiff_t delta) {
+    List* p = lst;
+    do {
+        p->next = (List*) ((char*) p->next + delta);
+        p->prev = (List*) ((char*) p->prev + delta);
+        p = p->next;
+    } while (p != lst);
+}
+
 void lst_print(List* lst) {
     for (List* p = lst->next; p != lst; p = p->next) {
         fprintf(stderr, " %p", p);
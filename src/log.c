@@ -0,0 +1,44 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#define LOG_MESSAGE_SIZE 512 // longer messages are cut short
+
+int log_level = LOG_LEVEL_WARN;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogSink log_sink = NULL;
+static void* log_ctx = NULL;
+
+void log_set_level(LogLevel level) {
+    __atomic_store_n(&log_level, (int) level, __ATOMIC_RELAXED);
+}
+
+void log_set_sink(LogSink sink, void* ctx) {
+    pthread_mutex_lock(&log_lock);
+    log_sink = sink;
+    log_ctx = ctx;
+    pthread_mutex_unlock(&log_lock);
+}
+
+char const* log_level_name(LogLevel level) {
+    static char const* const names[] = { "trace", "debug", "info", "warn", "error", "off" };
+    return level <= LOG_LEVEL_OFF ? names[level] : "?";
+}
+
+void log_write(LogLevel level, char const* format, ...) {
+    char message[LOG_MESSAGE_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    pthread_mutex_lock(&log_lock);
+    if (log_sink) {
+        log_sink(log_ctx, level, message);
+    } else {
+        fprintf(stderr, "[%s] %s\n", log_level_name(level), message);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
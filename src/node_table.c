@@ -0,0 +1,44 @@
+#include "internals.h"
+
+#include <string.h>
+
+// Hash tables keyed by the addresses of nodes, for the columns and the
+// history: open addressing with linear probing over a power of 2 of
+// entries. Removal shifts entries back instead of leaving tombstones, so
+// removing never makes room that a later insert would have to allocate.
+
+uint64_t ntab_hash(Node const* node, uint64_t nslots) {
+    return (((uintptr_t) node / sizeof(Node)) * 11400714819323198485ULL >> 17) & (nslots - 1);
+}
+
+Node* ntab_node(char const* entries, size_t entry_size, uint64_t i) {
+    return *(Node* const*) (entries + i * entry_size);
+}
+
+void* ntab_entry(void* table, size_t entry_size, uint64_t nslots, Node const* node) {
+    char* entries = (char*) table;
+    uint64_t mask = nslots - 1;
+    uint64_t i = ntab_hash(node, nslots);
+    Node const* key;
+    while ((key = ntab_node(entries, entry_size, i)) && key != node) i = (i + 1) & mask;
+    return entries + i * entry_size;
+}
+
+void ntab_remove(void* table, size_t entry_size, uint64_t nslots, void* entry) {
+    char* entries = (char*) table;
+    uint64_t mask = nslots - 1;
+    uint64_t i = ((char*) entry - entries) / entry_size;
+    for (uint64_t j = i;;) {
+        memset(entries + i * entry_size, 0, entry_size);
+        // the entries of the cluster after it that would not be found otherwise
+        uint64_t home;
+        do {
+            j = (j + 1) & mask;
+            Node const* key = ntab_node(entries, entry_size, j);
+            if (!key) return;
+            home = ntab_hash(key, nslots);
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        memcpy(entries + i * entry_size, entries + j * entry_size, entry_size);
+        i = j;
+    }
+}
@@ -0,0 +1,53 @@
+#include "internals.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Cache of resolved paths. Direct mapped: a path can only live in the entry
+// its hash points to and replaces whatever was there, so the cache never
+// grows beyond PATH_CACHE_SIZE entries and needs no eviction policy.
+// Nodes that are in the cache are flagged with NODE_CACHED, so deleting any
+// other node does not have to look at the cache at all. The caller sets the
+// flag before inserting, see database.c.
+
+void pc_init(PathCache* cache) {
+    memset(cache, 0, sizeof(PathCache));
+}
+
+void pc_clear(PathCache* cache) {
+    for (size_t i = 0; i < PATH_CACHE_SIZE; i++) {
+        free(cache->entries[i].path);
+    }
+    pc_init(cache);
+}
+
+Node* pc_find(PathCache const* cache, char const* path, uint64_t hash) {
+    PathCacheEntry const* entry = &cache->entries[hash % PATH_CACHE_SIZE];
+    if (entry->hash == hash && entry->path && strcmp(entry->path, path) == 0) {
+        return entry->node;
+    }
+    return NULL;
+}
+
+void pc_insert(PathCache* cache, char const* path, uint64_t hash, Node* node) {
+    PathCacheEntry* entry = &cache->entries[hash % PATH_CACHE_SIZE];
+    char* cpy = strdup(path);
+    if (!cpy) return;
+    free(entry->path);
+    entry->hash = hash;
+    entry->path = cpy;
+    entry->node = node;
+}
+
+// Drop all paths that lead to node
+void pc_invalidate(PathCache* cache, Node* node) {
+    for (size_t i = 0; i < PATH_CACHE_SIZE; i++) {
+        PathCacheEntry* entry = &cache->entries[i];
+        if (entry->path && entry->node == node) {
+            free(entry->path);
+            entry->path = NULL;
+            entry->node = NULL;
+        }
+    }
+    node_clear_flags(node, NODE_CACHED);
+}
@@ -0,0 +1,94 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <time.h>
+
+// The ring buffer. Writers take indexes from a counter and mark their slot
+// with a sequence number: odd while writing the event at index i, 2 * i + 2
+// once it is written. The reader copies an event and checks that the mark
+// has not changed meanwhile, skipping events that were overwritten. A writer
+// that laps a slower one leaves the slot marked odd, so the mixed up event
+// is skipped as well.
+#define TRACE_RING_SIZE 16384
+
+typedef struct TraceSlot {
+    uint64_t seq;
+    TraceEvent event;
+} TraceSlot;
+
+bool trace_on = false;
+
+static TraceSlot trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_head = 0; // events emitted into the ring
+static uint64_t trace_tail = 0; // events drained or lost, under the drain lock
+static uint64_t trace_lost_events = 0;
+static pthread_mutex_t trace_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceHook trace_hook = NULL;
+static void* trace_ctx = NULL;
+
+void trace_set_enabled(bool enabled) {
+    __atomic_store_n(&trace_on, enabled, __ATOMIC_RELAXED);
+}
+
+void trace_set_hook(TraceHook hook, void* ctx) {
+    // the context goes first, so that a writer that sees the hook sees it too
+    __atomic_store_n(&trace_ctx, ctx, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_hook, hook, __ATOMIC_RELEASE);
+}
+
+char const* trace_op_name(TraceOp op) {
+    static char const* const names[] = { "create_leaf", "update_leaf", "delete_node", "bd_alloc", "bd_free" };
+    return op < NTRACE_OPS ? names[op] : "?";
+}
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void trace_emit(TraceEvent const* event) {
+    TraceHook hook = __atomic_load_n(&trace_hook, __ATOMIC_ACQUIRE);
+    if (hook) {
+        hook(__atomic_load_n(&trace_ctx, __ATOMIC_RELAXED), event);
+        return;
+    }
+    uint64_t i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    TraceSlot* slot = &trace_ring[i % TRACE_RING_SIZE];
+    __atomic_store_n(&slot->seq, 2 * i + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->event = *event;
+    uint64_t writing = 2 * i + 1;
+    __atomic_compare_exchange_n(&slot->seq, &writing, 2 * i + 2, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+size_t trace_drain(TraceEvent* res, size_t n) {
+    pthread_mutex_lock(&trace_drain_lock);
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    if (head - trace_tail > TRACE_RING_SIZE) { // overwritten already
+        trace_lost_events += head - TRACE_RING_SIZE - trace_tail;
+        trace_tail = head - TRACE_RING_SIZE;
+    }
+    size_t got = 0;
+    for (; trace_tail < head && got < n; trace_tail++) {
+        TraceSlot const* slot = &trace_ring[trace_tail % TRACE_RING_SIZE];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq < 2 * trace_tail + 2) break; // still being written
+        TraceEvent event = slot->event;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != 2 * trace_tail + 2 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            trace_lost_events++;
+            continue;
+        }
+        res[got++] = event;
+    }
+    pthread_mutex_unlock(&trace_drain_lock);
+    return got;
+}
+
+uint64_t trace_lost(void) {
+    pthread_mutex_lock(&trace_drain_lock);
+    uint64_t res = trace_lost_events;
+    pthread_mutex_unlock(&trace_drain_lock);
+    return res;
+}
@@ -0,0 +1,267 @@
+#include "internals.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Write-ahead log. While a database uses it, its file is mapped privately,
+// so changes stay in memory and the file always holds the state of the last
+// checkpoint. Every change is appended to the log as a redo record; records
+// are buffered, written in batches and synced once per WAL_GROUP_SIZE bytes,
+// so one fsync commits thousands of changes.
+// Replaying the records on top of the file repeats the changes exactly,
+// allocations included, because the allocator is deterministic.
+//
+// A checkpoint appends images of all pages changed since the previous one,
+// followed by a checkpoint record, and syncs the log. Only then are the pages
+// written into the file, after which the log is emptied. A crash in between
+// leaves a complete checkpoint in the log, which wal_open writes into the
+// file again; pages without a checkpoint record after them are ignored.
+// Likewise, a transaction counts only once its commit or abort is logged,
+// and checkpoints never happen inside of one.
+// Every record carries a checksum, so a record torn by a crash ends the log.
+
+#define WAL_ALIGN 8
+#define WAL_RECORD_SIZE(rec) ((sizeof(WalRecord) + (rec)->len[0] + (rec)->len[1] + WAL_ALIGN - 1) & ~(WAL_ALIGN - 1ULL))
+
+struct Wal {
+    int fd;
+    char* buf;       // records not written to the log yet
+    size_t len;      // bytes in buf
+    uint64_t start;  // offset of the first record that was not checkpointed
+    uint64_t size;   // bytes written to the log
+    uint64_t synced; // bytes of the log known to be durable
+    bool failed;     // a write failed, so the log has a gap
+};
+
+char* wal_path(char const* filename) {
+    char* res = (char*) malloc(strlen(filename) + sizeof("-wal"));
+    if (res) sprintf(res, "%s-wal", filename);
+    return res;
+}
+
+bool wal_exists(char const* filename) {
+    char* path = wal_path(filename);
+    bool res = path && access(path, F_OK) == 0;
+    free(path);
+    return res;
+}
+
+void wal_remove(char const* filename) {
+    char* path = wal_path(filename);
+    if (path) unlink(path);
+    free(path);
+}
+
+// FNV-1a style hash of a byte string, taken a word at a time
+uint64_t wal_hash(uint64_t h, unsigned char const* data, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+// Checksum of everything after the checksum field
+uint64_t wal_checksum(WalRecord const* rec, void const* data0, void const* data1) {
+    uint64_t h = 14695981039346656037ULL;
+    h = wal_hash(h, (unsigned char const*) rec + sizeof(rec->checksum), sizeof(WalRecord) - sizeof(rec->checksum));
+    h = wal_hash(h, data0, rec->len[0]);
+    return wal_hash(h, data1, rec->len[1]);
+}
+
+// The record at pos of a log of the given size, or NULL if it is torn
+WalRecord const* wal_record_at(char const* log, uint64_t size, uint64_t pos) {
+    if (size - pos < sizeof(WalRecord)) return NULL;
+    WalRecord const* rec = (WalRecord const*) (log + pos);
+    if (rec->type < WAL_CREATE_DIR || rec->type > WAL_CHECKPOINT
+        || rec->len[0] > size || rec->len[1] > size
+        || WAL_RECORD_SIZE(rec) > size - pos) {
+        return NULL;
+    }
+    char const* data0 = (char const*) (rec + 1);
+    if (rec->checksum != wal_checksum(rec, data0, data0 + rec->len[0])) return NULL;
+    return rec;
+}
+
+// Write the pages of the last complete checkpoint into the database file
+bool wal_redo_checkpoint(char const* filename, char const* log, uint64_t end) {
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return false;
+    bool ok = true;
+    uint64_t file_len = 0;
+    for (uint64_t pos = 0; ok && pos < end;) {
+        WalRecord const* rec = (WalRecord const*) (log + pos);
+        if (rec->type == WAL_PAGE) {
+            ok = pwrite(fd, rec + 1, rec->len[0], (off_t) rec->args[0]) == (ssize_t) rec->len[0];
+        } else if (rec->type == WAL_CHECKPOINT) {
+            file_len = rec->args[0];
+        }
+        pos += WAL_RECORD_SIZE(rec);
+    }
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0
+         && ((uint64_t) st.st_size >= file_len || ftruncate(fd, (off_t) file_len) == 0)
+         && fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Find the valid records of the log, finish the last checkpoint in it and
+// drop whatever follows the records that are still needed
+bool wal_recover(Wal* wal, char const* filename) {
+    struct stat st;
+    if (fstat(wal->fd, &st)) return false;
+    uint64_t size = st.st_size;
+    uint64_t end = 0;             // end of the valid records
+    uint64_t checkpoint = 0;      // end of the last checkpoint record
+    uint64_t pages = UINT64_MAX;  // start of page images without a checkpoint record
+    uint64_t txn = UINT64_MAX;    // start of a transaction without a commit or an abort
+    if (size > 0) {
+        char* log = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, wal->fd, 0);
+        if (log == MAP_FAILED) return false;
+        WalRecord const* rec;
+        while ((rec = wal_record_at(log, size, end))) {
+            if (rec->type == WAL_PAGE && pages == UINT64_MAX) pages = end;
+            if (rec->type == WAL_BEGIN) txn = end;
+            if (rec->type == WAL_COMMIT || rec->type == WAL_ABORT) txn = UINT64_MAX;
+            end += WAL_RECORD_SIZE(rec);
+            if (rec->type == WAL_CHECKPOINT) {
+                checkpoint = end;
+                pages = UINT64_MAX;
+            }
+        }
+        bool ok = checkpoint == 0 || wal_redo_checkpoint(filename, log, checkpoint);
+        munmap(log, size);
+        if (!ok) return false;
+    }
+    if (pages != UINT64_MAX) end = pages; // the checkpoint did not finish
+    if (txn < end) end = txn; // neither did the transaction
+    if (end == checkpoint) checkpoint = end = 0; // the file has everything
+    if (end < size && (ftruncate(wal->fd, (off_t) end) || fdatasync(wal->fd))) return false;
+
+    wal->len = 0;
+    wal->start = checkpoint;
+    wal->size = wal->synced = end;
+    wal->failed = false;
+    return true;
+}
+
+Wal* wal_open(char const* filename) {
+    Wal* wal = (Wal*) malloc(sizeof(Wal));
+    char* path = wal_path(filename);
+    if (wal) {
+        wal->buf = (char*) malloc(WAL_BUFFER_SIZE);
+        wal->fd = path ? open(path, O_RDWR | O_CREAT, 0666) : -1;
+    }
+    free(path);
+    if (!wal || !wal->buf || wal->fd < 0 || !wal_recover(wal, filename)) {
+        LOG(ERROR, "Unable to open the write-ahead log of %s.", filename);
+        if (wal && wal->fd >= 0) close(wal->fd);
+        if (wal) free(wal->buf);
+        free(wal);
+        return NULL;
+    }
+    return wal;
+}
+
+bool wal_replay(Wal* wal, bool (*apply)(void* ctx, WalRecord const*), void* ctx) {
+    if (wal->size == wal->start) return true;
+    char* log = (char*) mmap(NULL, wal->size, PROT_READ, MAP_PRIVATE, wal->fd, 0);
+    if (log == MAP_FAILED) return false;
+    bool ok = true;
+    for (uint64_t pos = wal->start; ok && pos < wal->size;) {
+        WalRecord const* rec = (WalRecord const*) (log + pos);
+        ok = apply(ctx, rec);
+        pos += WAL_RECORD_SIZE(rec);
+    }
+    munmap(log, wal->size);
+    return ok;
+}
+
+// Write out the buffered records
+bool wal_write(Wal* wal) {
+    for (size_t done = 0; done < wal->len;) {
+        ssize_t res = pwrite(wal->fd, wal->buf + done, wal->len - done, (off_t) (wal->size + done));
+        if (res <= 0) {
+            wal->failed = true;
+            return false;
+        }
+        done += res;
+    }
+    wal->size += wal->len;
+    wal->len = 0;
+    return true;
+}
+
+bool wal_append(Wal* wal, WalRecord* rec, void const* data0, void const* data1) {
+    static char const padding[WAL_ALIGN];
+    size_t size = WAL_RECORD_SIZE(rec);
+    size_t pad = size - sizeof(WalRecord) - rec->len[0] - rec->len[1];
+    rec->reserved = 0;
+    rec->checksum = wal_checksum(rec, data0, data1);
+    if (wal->len + size > WAL_BUFFER_SIZE && !wal_write(wal)) return false;
+
+    struct iovec parts[4] = {
+        {rec, sizeof(WalRecord)}, {(void*) data0, rec->len[0]}, {(void*) data1, rec->len[1]}, {(void*) padding, pad}
+    };
+    if (size > WAL_BUFFER_SIZE) { // too large to buffer, the buffer is empty now
+        if (pwritev(wal->fd, parts, 4, (off_t) wal->size) != (ssize_t) size) {
+            wal->failed = true;
+            return false;
+        }
+        wal->size += size;
+        return true;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (parts[i].iov_len) memcpy(wal->buf + wal->len, parts[i].iov_base, parts[i].iov_len);
+        wal->len += parts[i].iov_len;
+    }
+    return true;
+}
+
+bool wal_sync(Wal* wal) {
+    if (!wal_write(wal)) return false;
+    if (wal->synced != wal->size) {
+        if (fdatasync(wal->fd)) {
+            wal->failed = true;
+            return false;
+        }
+        wal->synced = wal->size;
+    }
+    return !wal->failed;
+}
+
+uint64_t wal_pending(Wal const* wal) {
+    return wal->size + wal->len - wal->synced;
+}
+
+uint64_t wal_size(Wal const* wal) {
+    return wal->size + wal->len;
+}
+
+// Empty the log once the file has everything it holds
+bool wal_reset(Wal* wal) {
+    wal->len = 0;
+    if (ftruncate(wal->fd, 0) || fdatasync(wal->fd)) return false;
+    wal->start = wal->size = wal->synced = 0;
+    wal->failed = false;
+    return true;
+}
+
+void wal_close(Wal* wal) {
+    close(wal->fd);
+    free(wal->buf);
+    free(wal);
+}
@@ -1,210 +1,404 @@
 #include "database.h"
+#include "harness.h"
 #include "utils.h"
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcompound-token-split-by-macro"
+// Every benchmark builds a dataset of config->size elements, runs its
+// operations config->warmup times untimed and config->reps times timed,
+// and reports the latencies of single operations over all timed runs.
 
-#define BENCHMARK_EXEC_TIME(x)                                     \
-({                                                                 \
-    clock_t _benchmark_begin_clock = clock();                      \
-    (x);                                                           \
-    ((double)(clock() - _benchmark_begin_clock) / CLOCKS_PER_SEC); \
-})
+#define NDIRS 3
 
+// Create the directories the leaves of a benchmark are spread over
+bool create_dirs(Database* db, Directory** dirs, size_t n) {
+    char name[32];
+    for (size_t i = 0; i < n; ++i) {
+        sprintf(name, "dir%lu", i);
+        dirs[i] = database_create_directory(db, NULL, name);
+        if (!dirs[i]) return false;
+    }
+    return true;
+}
+
+void clear_dirs(Database* db, Directory** dirs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        database_clear_directory(db, dirs[i]);
+    }
+}
 
-void benchmark_insertions() {
-    fprintf(stderr, "Benchmarking many insertions...\n");
+// Leaves with the values 0, 1, ... spread over dirs
+Node** create_leaves(Database* db, Directory** dirs, size_t n) {
+    assert(n <= INT_MAX);
+    Node** res = malloc(sizeof(Node*) * n);
+    if (!res) return NULL;
+    for (size_t j = 0; j < n; ++j) {
+        res[j] = database_create_leaf(db, dirs[j % NDIRS], "", INT, (Value){ .int_value = (int)j });
+        if (!res[j]) {
+            free(res);
+            return NULL;
+        }
+    }
+    return res;
+}
 
+void benchmark_insertions(BenchConfig* config) {
     Database* db = database_create_database("benchmark_insertions", 0);
     ASSERT_TRUE(db);
-    size_t const NDIRS = 3;
     Directory* dirs[NDIRS];
-    dirs[0] = database_create_directory(db, NULL, "dir0");
-    ASSERT_TRUE(dirs[0]);
-    dirs[1] = database_create_directory(db, NULL, "dir1");
-    ASSERT_TRUE(dirs[1]);
-    dirs[2] = database_create_directory(db, NULL, "dir2");
-    ASSERT_TRUE(dirs[2]);
-
-    for (size_t i = 0, stop = 1; i < 7; ++i, stop *= 10) {
-        size_t n_insertions = stop * NDIRS;
-        assert(n_insertions <= INT_MAX);
-        double total = BENCHMARK_EXEC_TIME({
-            for (size_t j = 0; j < n_insertions; ++j) {
-                ASSERT_TRUE(database_create_leaf(db, dirs[j % NDIRS], "",
-                                                 INT, (Value){ .int_value = (int)j }));
-            }
-        });
-        fprintf(stderr, "%7lu insertions total time: %10f ms, average time: %8f ms\n",
-                n_insertions, total * 1000., total / (double)n_insertions * 1000.);
-//        database_traverse_and_print_database(db);
-        for (int j = 0; j < NDIRS; ++j) {
-            database_clear_directory(db, dirs[j]);
+    ASSERT_TRUE(create_dirs(db, dirs, NDIRS));
+
+    Samples samples;
+    samples_init(&samples);
+    uint64_t wall = 0;
+    for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+        if (rep == config->warmup) {
+            samples_clear(&samples); // the warmup is not counted
+            wall = 0;
         }
-//        database_traverse_and_print_database(db);
+        uint64_t begin = bench_now();
+        for (size_t j = 0; j < config->size; ++j) {
+            Leaf* res;
+            BENCH_TIME(&samples, res = database_create_leaf(db, dirs[j % NDIRS], "", INT,
+                                                            (Value){ .int_value = (int)j }));
+            ASSERT_TRUE(res);
+        }
+        wall += bench_now() - begin;
+        clear_dirs(db, dirs, NDIRS);
     }
-
+    bench_report(config, "insertions", 1, &samples, wall);
+    samples_free(&samples);
     database_destroy_database(db);
 }
 
-void benchmark_deletions() {
-    fprintf(stderr, "Benchmarking many deletions...\n");
+#define BATCH 1000
+
+// Insert the j-th of n leaves, beginning or committing a transaction of
+// BATCH insertions where one begins or ends
+bool insert_batched(Database* db, Directory** dirs, size_t j, size_t n) {
+    bool ok = j % BATCH != 0 || database_begin(db);
+    ok = ok && database_create_leaf(db, dirs[j % NDIRS], "", INT, (Value){ .int_value = (int)j });
+    if (j % BATCH == BATCH - 1 || j == n - 1) ok = database_commit(db) && ok;
+    return ok;
+}
+
+// Insertions in transactions, with a write-ahead log; the commits fall
+// into the samples of the insertions that end the transactions
+void benchmark_batched_insertions(BenchConfig* config) {
+    Database* db = database_create_database("benchmark_batched_insertions", 0);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    Directory* dirs[NDIRS];
+    ASSERT_TRUE(create_dirs(db, dirs, NDIRS));
+
+    Samples samples;
+    samples_init(&samples);
+    uint64_t wall = 0;
+    for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+        if (rep == config->warmup) {
+            samples_clear(&samples);
+            wall = 0;
+        }
+        uint64_t begin = bench_now();
+        for (size_t j = 0; j < config->size; ++j) {
+            bool ok;
+            BENCH_TIME(&samples, ok = insert_batched(db, dirs, j, config->size));
+            ASSERT_TRUE(ok);
+        }
+        wall += bench_now() - begin;
+        clear_dirs(db, dirs, NDIRS);
+    }
+    bench_report(config, "batched_insertions", 1, &samples, wall);
+    samples_free(&samples);
+    database_destroy_database(db);
+}
 
+// Deletes every tenth leaf of the dataset
+void benchmark_deletions(BenchConfig* config) {
     Database* db = database_create_database("benchmark_deletions", 1UL << 32);
-    size_t const NDIRS = 3;
+    ASSERT_TRUE(db);
     Directory* dirs[NDIRS];
-    dirs[0] = database_create_directory(db, NULL, "dir0");
-    dirs[1] = database_create_directory(db, NULL, "dir1");
-    dirs[2] = database_create_directory(db, NULL, "dir2");
-
-    for (size_t i = 1, stop = 10; i < 7; ++i, stop *= 10) {
-        size_t n_insertions = stop * NDIRS;
-        assert(n_insertions <= INT_MAX);
-        size_t n_deletions = n_insertions / 10;
-
-        Node** leafs = malloc(sizeof(Node*) * n_deletions);
-
-        for (size_t j = 0; j < n_insertions; ++j) {
-            Node* res = database_create_leaf(db, dirs[j % NDIRS], "",
-                                             INT, (Value){ .int_value = (int)j });
-            if (j % 10 == 0) {
-                leafs[j / 10] = res;
-            }
+    ASSERT_TRUE(create_dirs(db, dirs, NDIRS));
+
+    Samples samples;
+    samples_init(&samples);
+    uint64_t wall = 0;
+    for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+        if (rep == config->warmup) {
+            samples_clear(&samples);
+            wall = 0;
         }
-        double total = BENCHMARK_EXEC_TIME({
-            for (size_t j = 0; j < n_deletions; ++j) {
-                ASSERT_TRUE(database_delete_leaf(db, leafs[j]));
-            }
-        });
-        fprintf(stderr, "%7lu deletions from %8lu elements total time: %10f ms, average time: %8f ms\n",
-                n_deletions, n_insertions, total * 1000., total / (double)n_deletions * 1000.);
-//        database_traverse_and_print_database(db);
-        for (int j = 0; j < NDIRS; ++j) {
-            database_clear_directory(db, dirs[j]);
+        Node** leafs = create_leaves(db, dirs, config->size);
+        ASSERT_TRUE(leafs);
+        uint64_t begin = bench_now();
+        for (size_t j = 0; j < config->size; j += 10) {
+            bool ok;
+            BENCH_TIME(&samples, ok = database_delete_leaf(db, leafs[j]));
+            ASSERT_TRUE(ok);
         }
-//        database_traverse_and_print_database(db);
+        wall += bench_now() - begin;
+        clear_dirs(db, dirs, NDIRS);
         free(leafs);
     }
+    bench_report(config, "deletions", 1, &samples, wall);
+    samples_free(&samples);
+    database_destroy_database(db);
+}
 
-    size_t n_insertions = 10000000 * NDIRS;
-    assert(n_insertions <= INT_MAX);
-    Node** leafs = malloc(sizeof(Node*) * (n_insertions / 10));
+// Updates random leaves, as many times as there are leaves
+void benchmark_updates(BenchConfig* config) {
+    Database* db = database_create_database("benchmark_updates", 1UL << 32);
+    ASSERT_TRUE(db);
+    Directory* dirs[NDIRS];
+    ASSERT_TRUE(create_dirs(db, dirs, NDIRS));
+    Node** leafs = create_leaves(db, dirs, config->size);
+    ASSERT_TRUE(leafs);
 
-    for (size_t j = 0; j < n_insertions; ++j) {
-        Node* res = database_create_leaf(db, dirs[j % NDIRS], "",
-                                         INT, (Value){ .int_value = (int)j });
-        if (j % 10 == 0) {
-            leafs[j / 10] = res;
+    Samples samples;
+    samples_init(&samples);
+    uint64_t wall = 0;
+    for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+        if (rep == config->warmup) {
+            samples_clear(&samples);
+            wall = 0;
         }
+        srand(rep);
+        uint64_t begin = bench_now();
+        for (size_t j = 0; j < config->size; ++j) {
+            size_t id = rand() % config->size; // NOLINT(*-msc50-cpp)
+            bool ok;
+            BENCH_TIME(&samples, ok = database_update_leaf(db, leafs[id], (Value){ .int_value = -(int)id }));
+            ASSERT_TRUE(ok);
+        }
+        wall += bench_now() - begin;
     }
+    bench_report(config, "updates", 1, &samples, wall);
+    samples_free(&samples);
+    free(leafs);
+    database_destroy_database(db);
+}
 
-    for (size_t i = 0, stop = 1; i < 7; ++i, stop *= 10) {
-        size_t n_deletions = stop * NDIRS;
+// Reads random leaves, as many times as there are leaves
+void benchmark_accesses(BenchConfig* config) {
+    Database* db = database_create_database("benchmark_accesses", 1UL << 32);
+    ASSERT_TRUE(db);
+    Directory* dirs[NDIRS];
+    ASSERT_TRUE(create_dirs(db, dirs, NDIRS));
+    Node** leafs = create_leaves(db, dirs, config->size);
+    ASSERT_TRUE(leafs);
 
-        double total = BENCHMARK_EXEC_TIME({
-            for (size_t j = 0; j < n_deletions; ++j) {
-                ASSERT_TRUE(database_delete_leaf(db, leafs[j]));
-            }
-        });
-        fprintf(stderr, "%7lu deletions from %8lu elements total time: %10f ms, average time: %8f ms\n",
-                n_deletions, n_insertions, total * 1000., total / (double)n_deletions * 1000.);
-//        database_traverse_and_print_database(db);
-        for (size_t j = 0; j < n_deletions; ++j) {
-            leafs[j] = database_create_leaf(db, dirs[(j * 10) % NDIRS], "",
-                                            INT, (Value){ .int_value = (int)(j * 10) });
+    Samples samples;
+    samples_init(&samples);
+    uint64_t wall = 0;
+    for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+        if (rep == config->warmup) {
+            samples_clear(&samples);
+            wall = 0;
+        }
+        srand(rep);
+        uint64_t begin = bench_now();
+        for (size_t j = 0; j < config->size; ++j) {
+            size_t id = rand() % config->size; // NOLINT(*-msc50-cpp)
+            Value const* value;
+            BENCH_TIME(&samples, value = database_get_leaf_value(db, leafs[id]));
+            EXPECT_TRUE((size_t) value->int_value == id);
         }
-//        database_traverse_and_print_database(db);
+        wall += bench_now() - begin;
     }
+    bench_report(config, "accesses", 1, &samples, wall);
+    samples_free(&samples);
     free(leafs);
     database_destroy_database(db);
 }
 
-void benchmark_updates() {
-    fprintf(stderr, "Benchmarking many updates...\n");
+// Aggregates over a directory of all the leaves, walking the nodes and
+// scanning a column
+void benchmark_aggregates(BenchConfig* config) {
+    size_t const N_SCANS = 20;
+    Database* db = database_create_database("benchmark_aggregates", 1UL << 32);
+    ASSERT_TRUE(db);
+    Directory* plain = database_create_directory(db, NULL, "plain");
+    Directory* columnar = database_create_directory(db, NULL, "columnar");
+    ASSERT_TRUE(plain && columnar && database_set_columnar(db, columnar, INT));
+    for (size_t j = 0; j < config->size; ++j) {
+        ASSERT_TRUE(database_create_leaf(db, plain, "", INT, (Value){ .int_value = (int)j }));
+        ASSERT_TRUE(database_create_leaf(db, columnar, "", INT, (Value){ .int_value = (int)j }));
+    }
 
-    Database* db = database_create_database("benchmark_updates", 1UL << 32);
-    size_t const NDIRS = 3;
-    Directory* dirs[NDIRS];
-    dirs[0] = database_create_directory(db, NULL, "dir0");
-    dirs[1] = database_create_directory(db, NULL, "dir1");
-    dirs[2] = database_create_directory(db, NULL, "dir2");
-
-    size_t n_elements = 1000000 * NDIRS;
-    assert(n_elements <= INT_MAX);
-    Node** leafs = malloc(sizeof(Node*) * n_elements);
-
-    for (size_t j = 0; j < n_elements; ++j) {
-        leafs[j] = database_create_leaf(db, dirs[j % NDIRS], "",
-                                        INT, (Value){ .int_value = (int)j });
-    }
-
-    for (size_t i = 0, n_updates = 1; i < 7; ++i, n_updates *= 10) {
-        srand(i);
-        double total = BENCHMARK_EXEC_TIME({
-            for (size_t j = 0; j < n_updates; ++j) {
-                size_t id = rand() % n_elements; // NOLINT(*-msc50-cpp)
-//                fprintf(stderr, "Updating leaf %lu\n", id);
-                ASSERT_TRUE(database_update_leaf(db, leafs[id], (Value){.int_value = -(int)id }));
+    Aggregate const ops[] = { AGG_SUM, AGG_MIN, AGG_MAX };
+    char const* const names[] = { "aggregate_sum", "aggregate_min", "aggregate_max" };
+    Directory* const dirs[] = { plain, columnar };
+    char const* const layouts[] = { "walk", "column" };
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t d = 0; d < 2; ++d) {
+            Samples samples;
+            samples_init(&samples);
+            uint64_t wall = 0;
+            for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+                if (rep == config->warmup) {
+                    samples_clear(&samples);
+                    wall = 0;
+                }
+                uint64_t begin = bench_now();
+                for (size_t j = 0; j < N_SCANS; ++j) {
+                    double res;
+                    bool ok;
+                    BENCH_TIME(&samples, ok = database_aggregate(db, dirs[d], ops[i], &res));
+                    ASSERT_TRUE(ok);
+                }
+                wall += bench_now() - begin;
             }
-        });
-//        database_traverse_and_print_database(db);
-        fprintf(stderr, "%7lu updates from %7lu elements total time: %10f ms, average time: %8f ms\n",
-                n_updates, n_elements, total * 1000., total / (double)n_updates * 1000.);
+            char name[64];
+            sprintf(name, "%s_%s", names[i], layouts[d]);
+            bench_report(config, name, 1, &samples, wall);
+            samples_free(&samples);
+        }
     }
-    free(leafs);
     database_destroy_database(db);
 }
 
-void benchmark_accesses() {
-    fprintf(stderr, "Benchmarking many accesses...\n");
+#define MAX_THREADS 16
+#define HOT_LEAVES 1000 // leaves that concurrent readers look up by path
 
-    Database* db = database_create_database("benchmark_accesses", 1UL << 32);
-    size_t const NDIRS = 3;
-    Directory* dirs[NDIRS];
-    dirs[0] = database_create_directory(db, NULL, "dir0");
-    dirs[1] = database_create_directory(db, NULL, "dir1");
-    dirs[2] = database_create_directory(db, NULL, "dir2");
+typedef struct Worker {
+    Database* db;
+    Directory* dir;
+    size_t n_ops;
+    unsigned seed;
+    Samples samples;
+} Worker;
+
+void* read_concurrently(void* arg) {
+    Worker* reader = arg;
+    char name[32];
+    for (size_t j = 0; j < reader->n_ops; ++j) {
+        int id = rand_r(&reader->seed) % HOT_LEAVES;
+        sprintf(name, "/dir%d/leaf%d", id % NDIRS, id);
+        Node* leaf;
+        BENCH_TIME(&reader->samples, leaf = database_resolve_path(reader->db, name));
+        EXPECT_TRUE(database_get_leaf_value(reader->db, leaf)->int_value == id);
+    }
+    return NULL;
+}
+
+void* insert_concurrently(void* arg) {
+    Worker* writer = arg;
+    for (size_t j = 0; j < writer->n_ops; ++j) {
+        Leaf* res;
+        BENCH_TIME(&writer->samples, res = database_create_leaf(writer->db, writer->dir, "", INT,
+                                                                (Value){ .int_value = (int)j }));
+        EXPECT_TRUE(res);
+    }
+    return NULL;
+}
+
+// Run config->size operations split over n_threads workers, and add up
+// their samples and the wall time
+void run_workers(BenchConfig* config, void* (*work)(void*), Database* db, Directory** dirs, size_t n_threads,
+                 Samples* samples, uint64_t* wall) {
+    pthread_t threads[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers[i] = (Worker){ .db = db, .dir = dirs[i], .n_ops = config->size / n_threads, .seed = (unsigned) i };
+        samples_init(&workers[i].samples);
+    }
+    uint64_t begin = bench_now();
+    for (size_t i = 0; i < n_threads; ++i) {
+        ASSERT_TRUE(pthread_create(&threads[i], NULL, work, &workers[i]) == 0);
+    }
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    *wall += bench_now() - begin;
+    for (size_t i = 0; i < n_threads; ++i) {
+        samples_merge(samples, &workers[i].samples);
+        samples_free(&workers[i].samples);
+    }
+}
 
-    size_t n_elements = 10000000 * NDIRS;
-    assert(n_elements <= INT_MAX);
-    Node** leafs = malloc(sizeof(Node*) * n_elements);
+void benchmark_concurrent_accesses(BenchConfig* config) {
+    Database* db = database_create_database("benchmark_concurrent_accesses", 0);
+    ASSERT_TRUE(db);
+    Directory* dirs[NDIRS];
+    ASSERT_TRUE(create_dirs(db, dirs, NDIRS));
+    for (int j = 0; j < HOT_LEAVES; ++j) {
+        char name[32];
+        sprintf(name, "leaf%d", j);
+        ASSERT_TRUE(database_create_leaf(db, dirs[j % NDIRS], name, INT, (Value){ .int_value = j }));
+    }
 
-    for (size_t j = 0; j < n_elements; ++j) {
-        leafs[j] = database_create_leaf(db, dirs[j % NDIRS], "",
-                                        INT, (Value){ .int_value = (int)j });
+    Directory* unused[MAX_THREADS] = { NULL };
+    for (size_t n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+        Samples samples;
+        samples_init(&samples);
+        uint64_t wall = 0;
+        for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+            if (rep == config->warmup) {
+                samples_clear(&samples);
+                wall = 0;
+            }
+            run_workers(config, read_concurrently, db, unused, n_threads, &samples, &wall);
+        }
+        bench_report(config, "concurrent_accesses", n_threads, &samples, wall);
+        samples_free(&samples);
     }
+    database_destroy_database(db);
+}
+
+void benchmark_concurrent_insertions(BenchConfig* config) {
+    Database* db = database_create_database("benchmark_concurrent_insertions", 0);
+    ASSERT_TRUE(db);
+    Directory* dirs[MAX_THREADS];
+    ASSERT_TRUE(create_dirs(db, dirs, MAX_THREADS));
 
-    for (size_t i = 0, n_accesses = 1; i < 8; ++i, n_accesses *= 10) {
-        srand(i);
-        double total = BENCHMARK_EXEC_TIME({
-            for (size_t j = 0; j < n_accesses; ++j) {
-                size_t id = rand() % n_elements; // NOLINT(*-msc50-cpp)
-                EXPECT_TRUE(database_get_leaf_value(db, leafs[id])->int_value == id);
+    for (size_t n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2) {
+        Samples samples;
+        samples_init(&samples);
+        uint64_t wall = 0;
+        for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+            if (rep == config->warmup) {
+                samples_clear(&samples);
+                wall = 0;
             }
-        });
-        fprintf(stderr, "%8lu accesses from %8lu elements total time: %11f ms, average time: %8f ms\n",
-                n_accesses, n_elements, total * 1000., total / (double)n_accesses * 1000.);
+            run_workers(config, insert_concurrently, db, dirs, n_threads, &samples, &wall);
+            clear_dirs(db, dirs, n_threads);
+        }
+        bench_report(config, "concurrent_insertions", n_threads, &samples, wall);
+        samples_free(&samples);
     }
-    free(leafs);
     database_destroy_database(db);
 }
 
-int main() {
-    benchmark_insertions();
-    fprintf(stderr, "\n");
-    benchmark_deletions();
-    fprintf(stderr, "\n");
-    benchmark_updates();
-    fprintf(stderr, "\n");
-    benchmark_accesses();
+typedef struct Benchmark {
+    char const* name;
+    void (*run)(BenchConfig*);
+} Benchmark;
+
+Benchmark const benchmarks[] = {
+    { "insertions", benchmark_insertions },
+    { "batched_insertions", benchmark_batched_insertions },
+    { "deletions", benchmark_deletions },
+    { "updates", benchmark_updates },
+    { "accesses", benchmark_accesses },
+    { "aggregates", benchmark_aggregates },
+    { "concurrent_accesses", benchmark_concurrent_accesses },
+    { "concurrent_insertions", benchmark_concurrent_insertions },
+};
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL, NULL, NULL)) return 1;
+    bench_begin(&config);
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+        if (!bench_selected(&config, benchmarks[i].name)) continue;
+        fprintf(stderr, "Benchmarking %s...\n", benchmarks[i].name);
+        benchmarks[i].run(&config);
+    }
+    bench_end(&config);
     return 0;
 }
-
-#pragma clang diagnostic pop
@@ -0,0 +1,176 @@
+#include "harness.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_SIZE 1000000
+#define BENCH_DEFAULT_REPS 3
+#define BENCH_DEFAULT_WARMUP 1
+
+uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void samples_init(Samples* samples) {
+    samples->ns = NULL;
+    samples->len = 0;
+    samples->cap = 0;
+}
+
+void samples_add(Samples* samples, uint64_t ns) {
+    if (samples->len == samples->cap) {
+        size_t cap = samples->cap ? samples->cap * 2 : 1024;
+        uint64_t* tmp = (uint64_t*) realloc(samples->ns, sizeof(uint64_t) * cap);
+        if (!tmp) {
+            fprintf(stderr, "Out of memory for samples.\n");
+            abort();
+        }
+        samples->ns = tmp;
+        samples->cap = cap;
+    }
+    samples->ns[samples->len++] = ns;
+}
+
+void samples_merge(Samples* samples, Samples const* other) {
+    for (size_t i = 0; i < other->len; i++) samples_add(samples, other->ns[i]);
+}
+
+void samples_clear(Samples* samples) {
+    samples->len = 0;
+}
+
+void samples_free(Samples* samples) {
+    free(samples->ns);
+    samples_init(samples);
+}
+
+void bench_usage(char const* program, char const* extra_usage) {
+    fprintf(stderr, "Usage: %s [--size N] [--reps N] [--warmup N] [--format text|json|csv] [--output FILE]%s%s [BENCHMARK...]\n",
+            program, extra_usage ? " " : "", extra_usage ? extra_usage : "");
+}
+
+// Parse a count, false unless the whole argument is a number
+bool bench_parse_count(char const* arg, size_t* res) {
+    char* end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (!*arg || *end) return false;
+    *res = value;
+    return true;
+}
+
+bool bench_parse_args(BenchConfig* config, int argc, char** argv, BenchOption extra, void* ctx, char const* extra_usage) {
+    config->size = BENCH_DEFAULT_SIZE;
+    config->reps = BENCH_DEFAULT_REPS;
+    config->warmup = BENCH_DEFAULT_WARMUP;
+    config->format = BENCH_TEXT;
+    config->out = stdout;
+    config->only = NULL;
+    config->nonly = 0;
+    config->nreported = 0;
+    for (int i = 1; i < argc; i++) {
+        char const* arg = argv[i];
+        char const* value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = true;
+        if (strncmp(arg, "--", 2) != 0) {
+            config->only = argv + i; // the rest are names
+            config->nonly = argc - i;
+            break;
+        } else if (!value) {
+            ok = false;
+        } else if (strcmp(arg, "--size") == 0) {
+            ok = bench_parse_count(value, &config->size) && config->size > 0;
+        } else if (strcmp(arg, "--reps") == 0) {
+            ok = bench_parse_count(value, &config->reps) && config->reps > 0;
+        } else if (strcmp(arg, "--warmup") == 0) {
+            ok = bench_parse_count(value, &config->warmup);
+        } else if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "text") == 0) {
+                config->format = BENCH_TEXT;
+            } else if (strcmp(value, "json") == 0) {
+                config->format = BENCH_JSON;
+            } else if (strcmp(value, "csv") == 0) {
+                config->format = BENCH_CSV;
+            } else {
+                ok = false;
+            }
+        } else if (strcmp(arg, "--output") == 0) {
+            config->out = fopen(value, "w");
+            ok = config->out != NULL;
+        } else {
+            ok = extra && extra(ctx, arg, value);
+        }
+        if (!ok) {
+            bench_usage(argv[0], extra_usage);
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+bool bench_selected(BenchConfig const* config, char const* name) {
+    if (config->nonly == 0) return true;
+    for (size_t i = 0; i < config->nonly; i++) {
+        if (strcmp(config->only[i], name) == 0) return true;
+    }
+    return false;
+}
+
+void bench_begin(BenchConfig* config) {
+    if (config->format == BENCH_JSON) {
+        fprintf(config->out, "[");
+    } else if (config->format == BENCH_CSV) {
+        fprintf(config->out, "benchmark,size,threads,reps,ops,ops_per_sec,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    }
+}
+
+int bench_compare(void const* a, void const* b) {
+    uint64_t x = *(uint64_t const*) a, y = *(uint64_t const*) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+uint64_t bench_percentile(Samples const* sorted, double p) {
+    if (sorted->len == 0) return 0;
+    size_t rank = (size_t) (p * (double) sorted->len + 0.999999);
+    return sorted->ns[rank > 0 ? rank - 1 : 0];
+}
+
+void bench_report(BenchConfig* config, char const* name, size_t threads, Samples* samples, uint64_t wall_ns) {
+    qsort(samples->ns, samples->len, sizeof(uint64_t), bench_compare);
+    double sum = 0;
+    for (size_t i = 0; i < samples->len; i++) sum += (double) samples->ns[i];
+    double mean = samples->len ? sum / (double) samples->len : 0;
+    double throughput = wall_ns ? (double) samples->len * 1e9 / (double) wall_ns : 0;
+    uint64_t p50 = bench_percentile(samples, 0.5), p90 = bench_percentile(samples, 0.9);
+    uint64_t p99 = bench_percentile(samples, 0.99), p999 = bench_percentile(samples, 0.999);
+    uint64_t max = samples->len ? samples->ns[samples->len - 1] : 0;
+    switch (config->format) {
+        case BENCH_TEXT:
+            fprintf(config->out, "%-24s %2zu threads %9zu ops %12.0f ops/s  mean %9.0f ns  p50 %8lu  p90 %8lu"
+                                 "  p99 %8lu  p999 %9lu  max %10lu ns\n",
+                    name, threads, samples->len, throughput, mean, p50, p90, p99, p999, max);
+            break;
+        case BENCH_JSON:
+            fprintf(config->out, "%s\n  {\"benchmark\": \"%s\", \"size\": %zu, \"threads\": %zu, \"reps\": %zu, "
+                                 "\"ops\": %zu, \"ops_per_sec\": %.1f, \"mean_ns\": %.1f, \"p50_ns\": %lu, "
+                                 "\"p90_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+                    config->nreported ? "," : "", name, config->size, threads, config->reps,
+                    samples->len, throughput, mean, p50, p90, p99, p999, max);
+            break;
+        case BENCH_CSV:
+            fprintf(config->out, "%s,%zu,%zu,%zu,%zu,%.1f,%.1f,%lu,%lu,%lu,%lu,%lu\n",
+                    name, config->size, threads, config->reps, samples->len, throughput, mean, p50, p90, p99, p999, max);
+            break;
+    }
+    fflush(config->out);
+    config->nreported++;
+}
+
+void bench_end(BenchConfig* config) {
+    if (config->format == BENCH_JSON) fprintf(config->out, "%s]\n", config->nreported ? "\n" : "");
+    if (config->out != stdout) fclose(config->out);
+}
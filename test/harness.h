@@ -0,0 +1,65 @@
+#ifndef LLP_LAB1_HARNESS_H
+#define LLP_LAB1_HARNESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Benchmark harness: times every operation by the monotonic clock, keeps
+// the samples, and reports their percentiles as text, JSON or CSV.
+typedef enum BenchFormat {
+    BENCH_TEXT,
+    BENCH_JSON,
+    BENCH_CSV,
+} BenchFormat;
+
+typedef struct BenchConfig {
+    size_t size;        // elements in the dataset of each benchmark
+    size_t reps;        // timed repetitions, whose samples are put together
+    size_t warmup;      // untimed repetitions before them
+    BenchFormat format;
+    FILE* out;          // results; progress goes to stderr
+    char** only;        // names of the benchmarks to run, all if there are none
+    size_t nonly;
+    size_t nreported;   // results written so far
+} BenchConfig;
+
+// Latencies of single operations, in nanoseconds
+typedef struct Samples {
+    uint64_t* ns;
+    size_t len;
+    size_t cap;
+} Samples;
+
+uint64_t bench_now(void); // nanoseconds of the monotonic clock
+
+void samples_init(Samples*);
+void samples_add(Samples*, uint64_t ns); // aborts if out of memory, which would skew the results
+void samples_merge(Samples*, Samples const*);
+void samples_clear(Samples*); // keeps the memory
+void samples_free(Samples*);
+
+// Time one operation into samples
+#define BENCH_TIME(samples, x) do {                     \
+    uint64_t _bench_begin = bench_now();                \
+    (x);                                                \
+    samples_add((samples), bench_now() - _bench_begin); \
+} while (0)
+
+// Parses an option the harness does not know, with its value; false if
+// it is not known there either or the value is invalid
+typedef bool (*BenchOption)(void* ctx, char const* arg, char const* value);
+
+// Reads "--size N --reps N --warmup N --format text|json|csv --output FILE",
+// the options that extra knows, described by extra_usage, and the names of
+// the benchmarks to run; false after printing the usage
+bool bench_parse_args(BenchConfig*, int argc, char** argv, BenchOption extra, void* ctx, char const* extra_usage);
+bool bench_selected(BenchConfig const*, char const* name);
+void bench_begin(BenchConfig*);
+// Writes the percentiles of the samples of a benchmark; wall_ns is the time
+// its timed repetitions took, from which the throughput is computed
+void bench_report(BenchConfig*, char const* name, size_t threads, Samples*, uint64_t wall_ns);
+void bench_end(BenchConfig*);
+
+#endif //LLP_LAB1_HARNESS_H
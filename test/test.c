@@ -1,9 +1,18 @@
 #include "database.h"
+#include "log.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 void test_insertions() {
     fprintf(stderr, "Testing insertions... ");
@@ -76,6 +85,1619 @@ void test_deletions() {
 }
 #pragma clang diagnostic pop
 
+void test_long_names_and_values() {
+    fprintf(stderr, "Testing long names and values... ");
+
+    Database* db = database_create_database("test_long_names_and_values", 1024);
+    ASSERT_TRUE(db);
+    char const* short_name = "short";
+    char const* long_name = "a name that is too long to be stored inline";
+    String short_str = { .size = 5, .data = "value" };
+    String long_str = { .size = 40, .data = "a value that is too long to fit in place" };
+
+    Leaf* l1 = database_create_leaf(db, NULL, short_name, STR, (Value){ .str_value = short_str });
+    ASSERT_TRUE(l1);
+    Leaf* l2 = database_create_leaf(db, NULL, long_name, STR, (Value){ .str_value = short_str });
+    ASSERT_TRUE(l2);
+    Leaf* l3 = database_create_leaf(db, NULL, short_name, STR, (Value){ .str_value = long_str });
+    ASSERT_TRUE(l3);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, l1)->str_value.data, "value") == 0);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, l2)->str_value.data, "value") == 0);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, l3)->str_value.data, long_str.data) == 0);
+
+    EXPECT_TRUE(database_update_leaf(db, l1, (Value){ .str_value = long_str }));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, l1)->str_value.data, long_str.data) == 0);
+    EXPECT_TRUE(database_update_leaf(db, l3, (Value){ .str_value = short_str }));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, l3)->str_value.data, "value") == 0);
+
+    Iterator it = database_get_directory_content_iterator(db, NULL);
+    EXPECT_TRUE(strcmp(iterator_get_name(&it), short_name) == 0);
+    iterator_next(&it);
+    EXPECT_TRUE(strcmp(iterator_get_name(&it), long_name) == 0);
+    EXPECT_TRUE(database_delete_leaf(db, l2));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+void test_find_child() {
+    fprintf(stderr, "Testing lookups by name... ");
+
+    Database* db = database_create_database("test_find_child", 1024);
+    ASSERT_TRUE(db);
+    Directory* dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    int const N = 1000;
+    Leaf* leafs[N];
+    char name[32];
+    for (int i = 0; i < N; ++i) {
+        sprintf(name, "leaf%d", i);
+        leafs[i] = database_create_leaf(db, dir, name, INT, (Value){ .int_value = i });
+        ASSERT_TRUE(leafs[i]);
+    }
+    EXPECT_TRUE(database_find_child(db, NULL, "dir") == dir);
+    EXPECT_TRUE(database_find_child(db, dir, "leaf0") == leafs[0]);
+    for (int i = 0; i < N; i += 2) {
+        EXPECT_TRUE(database_delete_leaf(db, leafs[i]));
+    }
+    for (int i = 0; i < N; ++i) { // the index is built by now and follows the changes
+        sprintf(name, "leaf%d", i);
+        EXPECT_TRUE(database_find_child(db, dir, name) == (i % 2 ? leafs[i] : NULL));
+    }
+    EXPECT_FALSE(database_find_child(db, dir, "missing"));
+
+    EXPECT_TRUE(database_set_unique_names(db, dir, true));
+    EXPECT_FALSE(database_create_leaf(db, dir, "leaf1", INT, (Value){ .int_value = 0 }));
+    EXPECT_FALSE(database_create_directory(db, dir, "leaf1"));
+    EXPECT_TRUE(database_create_leaf(db, dir, "leaf0", INT, (Value){ .int_value = 0 }));
+    EXPECT_TRUE(database_create_leaf(db, NULL, "dir", INT, (Value){ .int_value = 0 }));
+    EXPECT_FALSE(database_set_unique_names(db, NULL, true));
+
+    database_clear_directory(db, dir);
+    EXPECT_FALSE(database_find_child(db, dir, "leaf1"));
+    EXPECT_TRUE(database_create_leaf(db, dir, "leaf1", INT, (Value){ .int_value = 1 }));
+    EXPECT_FALSE(database_create_leaf(db, dir, "leaf1", INT, (Value){ .int_value = 1 }));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+void test_resolve_path() {
+    fprintf(stderr, "Testing path resolution... ");
+
+    Database* db = database_create_database("test_resolve_path", 1024);
+    ASSERT_TRUE(db);
+    Directory* svc = database_create_directory(db, NULL, "svc");
+    ASSERT_TRUE(svc);
+    Directory* config = database_create_directory(db, svc, "config");
+    ASSERT_TRUE(config);
+    Leaf* timeout = database_create_leaf(db, config, "timeout", INT, (Value){ .int_value = 30 });
+    ASSERT_TRUE(timeout);
+
+    EXPECT_TRUE(database_resolve_path(db, "/") == database_get_root_directory(db));
+    EXPECT_TRUE(database_resolve_path(db, "/svc/config") == config);
+    EXPECT_TRUE(database_resolve_path(db, "/svc/config/timeout") == timeout);
+    EXPECT_TRUE(database_resolve_path(db, "/svc/config/timeout") == timeout); // cached
+    EXPECT_TRUE(database_resolve_path(db, "svc//config/timeout/") == timeout);
+    EXPECT_FALSE(database_resolve_path(db, "/svc/config/timeout/x"));
+    EXPECT_FALSE(database_resolve_path(db, "/svc/missing"));
+
+    EXPECT_TRUE(database_delete_leaf(db, timeout));
+    EXPECT_FALSE(database_resolve_path(db, "/svc/config/timeout"));
+    timeout = database_create_leaf(db, config, "timeout", INT, (Value){ .int_value = 60 });
+    EXPECT_TRUE(database_resolve_path(db, "/svc/config/timeout") == timeout);
+    database_clear_directory(db, svc);
+    EXPECT_FALSE(database_resolve_path(db, "/svc/config/timeout"));
+    EXPECT_FALSE(database_resolve_path(db, "/svc/config"));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+void test_ordered_directory() {
+    fprintf(stderr, "Testing ordered directories... ");
+
+    Database* db = database_create_database("test_ordered_directory", 1024);
+    ASSERT_TRUE(db);
+    Directory* dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    int const N = 2000;
+    Leaf* leafs[N];
+    char name[32];
+    for (int i = 0; i < N; ++i) {
+        if (i == N / 2) {
+            ASSERT_TRUE(database_set_ordered(db, dir, true)); // half before, half after
+        }
+        sprintf(name, "key%04d", (i * 7919) % N);
+        leafs[i] = database_create_leaf(db, dir, name, INT, (Value){ .int_value = (i * 7919) % N });
+        ASSERT_TRUE(leafs[i]);
+    }
+    EXPECT_TRUE(database_create_leaf(db, dir, "key0100", INT, (Value){ .int_value = 100 })); // duplicate
+
+    int count = 0, last = -1;
+    Iterator it = iterator_seek(dir, NULL);
+    do {
+        EXPECT_TRUE(iterator_get_value(&it)->int_value >= last);
+        last = iterator_get_value(&it)->int_value;
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == N + 1);
+
+    for (int i = 0; i < N; ++i) {
+        if (database_get_leaf_value(db, leafs[i])->int_value % 2) {
+            EXPECT_TRUE(database_delete_leaf(db, leafs[i]));
+        }
+    }
+    count = 0;
+    it = iterator_seek(dir, "key0500");
+    while (strcmp(iterator_get_name(&it), "key0600") < 0) {
+        EXPECT_TRUE(iterator_get_value(&it)->int_value == 500 + 2 * count);
+        ++count;
+        ASSERT_TRUE(iterator_next(&it));
+    }
+    EXPECT_TRUE(count == 50);
+    it = iterator_seek(dir, "key0499");
+    EXPECT_TRUE(strcmp(iterator_get_name(&it), "key0500") == 0);
+    it = iterator_seek(dir, "z");
+    EXPECT_FALSE(iterator_is_valid(&it));
+    it = iterator_seek(NULL, "");
+    EXPECT_FALSE(iterator_is_valid(&it));
+
+    database_clear_directory(db, dir);
+    it = iterator_seek(dir, NULL);
+    EXPECT_FALSE(iterator_is_valid(&it));
+    EXPECT_TRUE(database_create_leaf(db, dir, "b", INT, (Value){ .int_value = 2 }));
+    EXPECT_TRUE(database_create_leaf(db, dir, "a", INT, (Value){ .int_value = 1 }));
+    it = iterator_seek(dir, NULL);
+    EXPECT_TRUE(strcmp(iterator_get_name(&it), "a") == 0);
+    EXPECT_TRUE(iterator_next(&it) && strcmp(iterator_get_name(&it), "b") == 0);
+    EXPECT_FALSE(iterator_has_next(&it));
+    EXPECT_TRUE(database_set_ordered(db, dir, false));
+    it = iterator_seek(dir, NULL);
+    EXPECT_FALSE(iterator_is_valid(&it));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NRELOCATED 2000
+#define RELOCATED_DEPTH 100
+#define RELOCATED_STR "a string that does not fit into the node"
+
+// Fill the database with everything that keeps pointers: indexes, b-trees,
+// columns, strings out of the nodes and nested directories
+void fill_relocated(Database* db) {
+    Directory* ordered = database_create_directory(db, NULL, "ordered");
+    Directory* columnar = database_create_directory(db, NULL, "columnar");
+    ASSERT_TRUE(ordered && columnar);
+    ASSERT_TRUE(database_set_ordered(db, ordered, true) && database_set_columnar(db, columnar, INT));
+    char name[32];
+    for (int i = 0; i < NRELOCATED; ++i) {
+        sprintf(name, "leaf %05d", i);
+        Value str = { .str_value = { .size = strlen(RELOCATED_STR), .data = RELOCATED_STR } };
+        ASSERT_TRUE(database_create_leaf(db, ordered, name, STR, str));
+        ASSERT_TRUE(database_create_leaf(db, columnar, name, INT, (Value){ .int_value = i }));
+    }
+    EXPECT_TRUE(database_find_child(db, columnar, "leaf 00000")); // builds the index
+    Directory* dir = NULL;
+    for (int i = 0; i < RELOCATED_DEPTH; ++i) {
+        dir = database_create_directory(db, dir, "level");
+        ASSERT_TRUE(dir);
+    }
+}
+
+// Does the database hold what fill_relocated put in?
+bool check_relocated(Database* db) {
+    Directory* ordered = database_find_child(db, NULL, "ordered");
+    Directory* columnar = database_find_child(db, NULL, "columnar");
+    if (!ordered || !columnar) return false;
+    Iterator it = iterator_seek(ordered, "leaf 01000");
+    if (!iterator_is_valid(&it) || strcmp(iterator_get_name(&it), "leaf 01000") != 0) return false;
+    int count = 0;
+    do {
+        if (strcmp(iterator_get_value(&it)->str_value.data, RELOCATED_STR) != 0) return false;
+        ++count;
+    } while (iterator_next(&it));
+    double sum;
+    Leaf* leaf = database_find_child(db, columnar, "leaf 00007");
+    if (count != NRELOCATED - 1000 || !leaf || database_get_leaf_value(db, leaf)->int_value != 7
+        || !database_aggregate(db, columnar, AGG_SUM, &sum) || sum != (double) NRELOCATED * (NRELOCATED - 1) / 2) {
+        return false;
+    }
+    char path[RELOCATED_DEPTH * 6 + 1] = "";
+    for (int i = 0; i < RELOCATED_DEPTH; ++i) strcat(path, "/level");
+    return database_resolve_path(db, path) != NULL;
+}
+
+void test_reopen() {
+    fprintf(stderr, "Testing reopening... ");
+
+    Database* db = database_create_database("test_reopen", 1024);
+    ASSERT_TRUE(db);
+    Directory* dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    ASSERT_TRUE(database_create_leaf(db, dir, "int", INT, (Value){ .int_value = 42 }));
+    ASSERT_TRUE(database_create_leaf(db, dir, "str", STR,
+                                     (Value){ .str_value = { .size = 3, .data = "abc" } }));
+    EXPECT_TRUE(database_find_child(db, dir, "int")); // builds the index of dir
+    EXPECT_TRUE(database_set_ordered(db, dir, true));
+    fill_relocated(db);
+    database_shutdown_database(db);
+
+    // a process that cannot map the file where it was mapped before has to
+    // relocate all stored pointers, and the file gets them shifted right away,
+    // so that it need not be shut down
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_reopen");
+        if (!db) _exit(1);
+        void* root = database_get_root_directory(db);
+        database_shutdown_database(db);
+        size_t psz = (size_t) sysconf(_SC_PAGESIZE);
+        void* taken = (void*) ((uintptr_t) root & ~(psz - 1));
+        if (mmap(taken, psz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != taken) _exit(1);
+        db = database_open_database("test_reopen");
+        _exit(db && (void*) database_get_root_directory(db) != root && check_relocated(db) ? 0 : 1);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_reopen");
+    ASSERT_TRUE(db);
+    EXPECT_TRUE(check_relocated(db));
+
+    Iterator it = database_get_directory_content_iterator(db, NULL);
+    int children = iterator_is_valid(&it);
+    while (iterator_next(&it)) ++children;
+    EXPECT_TRUE(children == 4); // dir, ordered, columnar and level
+    dir = database_find_child(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    it = database_get_directory_content_iterator(db, dir);
+    ASSERT_TRUE(iterator_is_valid(&it));
+    EXPECT_TRUE(strcmp(iterator_get_name(&it), "str") == 0);
+    EXPECT_TRUE(strcmp(iterator_get_value(&it)->str_value.data, "abc") == 0);
+    ASSERT_TRUE(iterator_next(&it));
+    EXPECT_TRUE(strcmp(iterator_get_name(&it), "int") == 0);
+    EXPECT_TRUE(iterator_get_value(&it)->int_value == 42);
+    EXPECT_TRUE(database_get_leaf_value(db, database_find_child(db, dir, "int"))->int_value == 42);
+    it = iterator_seek(dir, "j");
+    EXPECT_TRUE(iterator_is_valid(&it) && strcmp(iterator_get_name(&it), "str") == 0);
+    EXPECT_TRUE(database_create_leaf(db, NULL, "new", BOOL, (Value){ .bool_value = true }));
+    database_destroy_database(db);
+
+    EXPECT_FALSE(database_open_database("test_reopen_missing"));
+
+    fprintf(stderr, "OK\n");
+}
+
+void test_growth() {
+    fprintf(stderr, "Testing file growth... ");
+
+    Database* db = database_create_database("test_growth", 1024);
+    ASSERT_TRUE(db);
+    int const N = 10000;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(database_create_leaf(db, NULL, "leaf", INT, (Value){ .int_value = i }));
+    }
+    database_shutdown_database(db);
+
+    db = database_open_database("test_growth");
+    ASSERT_TRUE(db);
+    Iterator it = database_get_directory_content_iterator(db, NULL);
+    for (int i = N - 1; i >= 0; --i) {
+        ASSERT_TRUE(iterator_is_valid(&it));
+        EXPECT_TRUE(iterator_get_value(&it)->int_value == i);
+        iterator_next(&it);
+    }
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+void test_wal() {
+    fprintf(stderr, "Testing write-ahead log... ");
+
+    Database* db = database_create_database("test_wal", 1024);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    ASSERT_TRUE(database_create_directory(db, NULL, "dir"));
+    database_shutdown_database(db);
+
+    // a crash: the process dies without shutting the database down
+    int const N = 1000;
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_wal");
+        Directory* dir = database_find_child(db, NULL, "dir");
+        if (!db || !dir) _exit(1);
+        for (int i = 0; i < N; ++i) {
+            char name[32];
+            sprintf(name, "a rather long name number %d", i);
+            database_create_leaf(db, dir, name, INT, (Value){ .int_value = i });
+            if (i == N / 2) database_checkpoint(db); // changes on both sides of a checkpoint
+        }
+        database_create_leaf(db, dir, "str", STR, (Value){ .str_value = { .size = 3, .data = "abc" } });
+        database_update_leaf(db, database_find_child(db, dir, "a rather long name number 7"),
+                             (Value){ .int_value = -7 });
+        database_delete_leaf(db, database_find_child(db, dir, "a rather long name number 8"));
+        database_sync(db);
+        database_create_leaf(db, dir, "lost", INT, (Value){ .int_value = 0 }); // never synced
+        _exit(0);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // a record torn by the crash
+    FILE* log = fopen("test_wal-wal", "a");
+    ASSERT_TRUE(log);
+    fprintf(log, "torn record");
+    fclose(log);
+
+    db = database_open_database("test_wal");
+    ASSERT_TRUE(db);
+    Directory* dir = database_find_child(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    int count = 0;
+    Iterator it = database_get_directory_content_iterator(db, dir);
+    do {
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == N);
+    EXPECT_TRUE(database_get_leaf_value(db, database_find_child(db, dir, "a rather long name number 7"))->int_value == -7);
+    EXPECT_FALSE(database_find_child(db, dir, "a rather long name number 8"));
+    EXPECT_TRUE(database_get_leaf_value(db, database_find_child(db, dir, "a rather long name number 999"))->int_value == 999);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, database_find_child(db, dir, "str"))->str_value.data, "abc") == 0);
+    EXPECT_FALSE(database_find_child(db, dir, "lost"));
+
+    // without the log, changes go straight to the file again
+    ASSERT_TRUE(database_set_wal(db, false));
+    EXPECT_TRUE(access("test_wal-wal", F_OK) != 0);
+    EXPECT_TRUE(database_create_leaf(db, dir, "after", INT, (Value){ .int_value = 1 }));
+    database_shutdown_database(db);
+    db = database_open_database("test_wal");
+    ASSERT_TRUE(db);
+    EXPECT_TRUE(database_find_child(db, database_find_child(db, NULL, "dir"), "after"));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+void test_transactions() {
+    fprintf(stderr, "Testing transactions... ");
+
+    Database* db = database_create_database("test_transactions", 1024);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    Directory* dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    ASSERT_TRUE(database_set_unique_names(db, dir, true));
+    Leaf* old = database_create_leaf(db, dir, "old", INT, (Value){ .int_value = 1 });
+    Leaf* gone = database_create_leaf(db, dir, "gone", INT, (Value){ .int_value = 2 });
+    ASSERT_TRUE(old && gone);
+
+    // nothing shows before the commit
+    int const N = 200;
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_FALSE(database_begin(db));
+    Directory* sub = database_create_directory(db, dir, "sub");
+    ASSERT_TRUE(sub);
+    for (int i = 0; i < N; ++i) {
+        char name[32];
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, sub, name, INT, (Value){ .int_value = i }));
+    }
+    EXPECT_TRUE(database_update_leaf(db, old, (Value){ .int_value = -1 }));
+    EXPECT_TRUE(database_delete_leaf(db, gone));
+    EXPECT_FALSE(database_delete_leaf(db, gone));
+    EXPECT_FALSE(database_find_child(db, dir, "sub"));
+    EXPECT_TRUE(database_find_child(db, sub, "leaf 7")); // but new nodes are usable
+    EXPECT_TRUE(database_get_leaf_value(db, old)->int_value == 1);
+    EXPECT_TRUE(database_find_child(db, dir, "gone"));
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(database_find_child(db, dir, "sub") == sub);
+    EXPECT_TRUE(database_get_leaf_value(db, old)->int_value == -1);
+    EXPECT_FALSE(database_find_child(db, dir, "gone"));
+
+    // an aborted transaction leaves no trace
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_TRUE(database_create_leaf(db, dir, "aborted", INT, (Value){ .int_value = 3 }));
+    EXPECT_TRUE(database_update_leaf(db, old, (Value){ .int_value = 3 }));
+    database_clear_directory(db, sub);
+    EXPECT_TRUE(database_find_child(db, sub, "leaf 7")); // not before the commit
+    database_abort(db);
+    EXPECT_FALSE(database_find_child(db, dir, "aborted"));
+    EXPECT_TRUE(database_get_leaf_value(db, old)->int_value == -1);
+    EXPECT_TRUE(database_find_child(db, database_find_child(db, dir, "sub"), "leaf 7"));
+
+    // a name taken by the time of the commit undoes all of it
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_TRUE(database_delete_leaf(db, old));
+    EXPECT_TRUE(database_create_leaf(db, dir, "twin", INT, (Value){ .int_value = 4 }));
+    EXPECT_TRUE(database_create_leaf(db, dir, "twin", INT, (Value){ .int_value = 5 }));
+    EXPECT_FALSE(database_commit(db));
+    EXPECT_FALSE(database_find_child(db, dir, "twin"));
+    EXPECT_TRUE(database_find_child(db, dir, "old") == old);
+
+    // a transaction cut short by a crash is dropped
+    database_shutdown_database(db);
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_transactions");
+        dir = database_find_child(db, NULL, "dir");
+        if (!db || !dir) _exit(1);
+        database_begin(db);
+        database_create_leaf(db, dir, "committed", INT, (Value){ .int_value = 5 });
+        database_commit(db);
+        database_begin(db);
+        database_create_leaf(db, dir, "uncommitted", INT, (Value){ .int_value = 6 });
+        database_sync(db);
+        _exit(0);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_transactions");
+    ASSERT_TRUE(db);
+    dir = database_find_child(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    EXPECT_TRUE(database_find_child(db, dir, "committed"));
+    EXPECT_FALSE(database_find_child(db, dir, "uncommitted"));
+    int count = 0;
+    Iterator it = database_get_directory_content_iterator(db, database_find_child(db, dir, "sub"));
+    do {
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == N);
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NTHREADS 4
+#define NTHREAD_NODES 2000
+
+typedef struct ThreadArgs {
+    Database* db;
+    int id;
+} ThreadArgs;
+
+void concurrent_writes(ThreadArgs const* args) {
+    char name[32];
+    sprintf(name, "dir%d", args->id);
+    Directory* dir = database_create_directory(args->db, NULL, name);
+    ASSERT_TRUE(dir);
+    Directory* shared = database_find_child(args->db, NULL, "shared");
+    ASSERT_TRUE(shared);
+    for (int i = 0; i < NTHREAD_NODES; ++i) {
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(args->db, dir, name, INT, (Value){ .int_value = i }));
+        sprintf(name, "leaf %d of %d", i, args->id);
+        Leaf* leaf = database_create_leaf(args->db, shared, name, INT, (Value){ .int_value = i });
+        ASSERT_TRUE(leaf);
+        if (i % 2) {
+            EXPECT_TRUE(database_delete_leaf(args->db, leaf));
+        }
+        if (i % 100 == 0) { // transactions keep everyone else out
+            ASSERT_TRUE(database_begin(args->db));
+            EXPECT_TRUE(database_update_leaf(args->db, database_find_child(args->db, dir, "leaf 0"),
+                                             (Value){ .int_value = -i }));
+            ASSERT_TRUE(database_commit(args->db));
+        }
+    }
+}
+
+void concurrent_reads(ThreadArgs const* args) {
+    for (int i = 0; i < NTHREAD_NODES * 4; ++i) {
+        char path[32];
+        sprintf(path, "/read/leaf %d", i % 100);
+        Leaf* leaf = database_resolve_path(args->db, path);
+        ASSERT_TRUE(leaf);
+        EXPECT_TRUE(database_get_leaf_value(args->db, leaf)->int_value == i % 100);
+        EXPECT_TRUE(database_find_child(args->db, database_find_child(args->db, NULL, "read"), path + 6) == leaf);
+    }
+}
+
+void* concurrent_writer(void* args) {
+    concurrent_writes(args);
+    return NULL;
+}
+
+void* concurrent_reader(void* args) {
+    concurrent_reads(args);
+    return NULL;
+}
+
+void run_concurrently(Database* db) {
+    ASSERT_TRUE(database_create_directory(db, NULL, "shared"));
+    Directory* read = database_create_directory(db, NULL, "read");
+    ASSERT_TRUE(read);
+    for (int i = 0; i < 100; ++i) {
+        char name[32];
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, read, name, INT, (Value){ .int_value = i }));
+    }
+    pthread_t threads[2 * NTHREADS];
+    ThreadArgs args[NTHREADS];
+    for (int i = 0; i < NTHREADS; ++i) {
+        args[i] = (ThreadArgs){ .db = db, .id = i };
+        ASSERT_TRUE(pthread_create(&threads[i], NULL, concurrent_writer, &args[i]) == 0);
+        ASSERT_TRUE(pthread_create(&threads[NTHREADS + i], NULL, concurrent_reader, &args[i]) == 0);
+    }
+    for (int i = 0; i < 2 * NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void test_concurrency() {
+    fprintf(stderr, "Testing concurrent access... ");
+
+    Database* db = database_create_database("test_concurrency", 1024);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    database_shutdown_database(db);
+
+    // replaying the log after a crash repeats the changes of all threads
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_concurrency");
+        if (!db) _exit(1);
+        run_concurrently(db);
+        _exit(database_sync(db) ? 0 : 1);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_concurrency");
+    ASSERT_TRUE(db);
+    int count = 0;
+    Iterator it = database_get_directory_content_iterator(db, database_find_child(db, NULL, "shared"));
+    do {
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NTHREADS * NTHREAD_NODES / 2);
+    for (int i = 0; i < NTHREADS; ++i) {
+        char path[32];
+        sprintf(path, "/dir%d/leaf %d", i, NTHREAD_NODES - 1);
+        EXPECT_TRUE(database_resolve_path(db, path));
+        sprintf(path, "/dir%d/leaf 0", i);
+        EXPECT_TRUE(database_get_leaf_value(db, database_resolve_path(db, path))->int_value
+                    == -(NTHREAD_NODES - 1) / 100 * 100);
+    }
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NSUB_WRITES 16
+#define NCLEARS 300
+
+typedef struct ClearArgs {
+    Database* db;
+    int id;
+    atomic_bool* stop;
+} ClearArgs;
+
+// Create and delete leaves in /dir/sub, which another thread keeps dropping
+void sub_writes(ClearArgs const* args) {
+    char name[32];
+    while (!*args->stop) {
+        ASSERT_TRUE(database_read_begin(args->db)); // keeps the handles valid
+        Directory* sub = database_resolve_path(args->db, "/dir/sub");
+        for (int i = 0; sub && i < NSUB_WRITES; ++i) {
+            sprintf(name, "leaf %d of %d", i, args->id);
+            Leaf* leaf = database_create_leaf(args->db, sub, name, INT, (Value){ .int_value = i });
+            if (leaf && i % 2) database_delete_leaf(args->db, leaf);
+        }
+        database_read_end(args->db);
+    }
+}
+
+void* sub_writer(void* args) {
+    sub_writes(args);
+    return NULL;
+}
+
+uint64_t heap_blocks(Database* db) {
+    DatabaseStats stats;
+    if (!database_get_stats(db, &stats)) return 0;
+    uint64_t res = 0;
+    for (size_t i = 0; i < ALLOC_NCLASSES; i++) res += stats.heap.live_blocks[i];
+    return res;
+}
+
+void test_concurrent_clear() {
+    fprintf(stderr, "Testing concurrent clear... ");
+
+    // clearing a directory waits for the changes below it, so that nothing
+    // is linked into a dropped subdirectory or retired twice
+    Database* db = database_create_database("test_concurrent_clear", 1024);
+    ASSERT_TRUE(db);
+    Directory* dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir && database_create_directory(db, dir, "sub") && database_resolve_path(db, "/dir/sub"));
+    database_clear_directory(db, NULL);
+    EXPECT_TRUE(database_checkpoint(db)); // frees what was retired
+    uint64_t live = heap_blocks(db); // the root and its index
+    dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    atomic_bool stop = false;
+    pthread_t threads[NTHREADS];
+    ClearArgs args[NTHREADS];
+    for (int i = 0; i < NTHREADS; ++i) {
+        args[i] = (ClearArgs){ .db = db, .id = i, .stop = &stop };
+        ASSERT_TRUE(pthread_create(&threads[i], NULL, sub_writer, &args[i]) == 0);
+    }
+    for (int i = 0; i < NCLEARS; ++i) {
+        EXPECT_TRUE(database_create_directory(db, dir, "sub"));
+        sched_yield(); // for the writers to fill it
+        database_clear_directory(db, dir);
+    }
+    stop = true;
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    database_clear_directory(db, NULL);
+    EXPECT_TRUE(database_checkpoint(db));
+    EXPECT_TRUE(heap_blocks(db) == live);
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NRECREATES 300
+
+// Update /records/key, which another thread keeps deleting and creating again
+void key_updates(ClearArgs const* args) {
+    char str[64];
+    for (int i = 0; !*args->stop; ++i) {
+        ASSERT_TRUE(database_read_begin(args->db)); // keeps the handle valid
+        Leaf* leaf = database_resolve_path(args->db, "/records/key");
+        sprintf(str, "value %d of %d", i, args->id);
+        if (leaf) database_update_leaf(args->db, leaf, (Value){ .str_value = { .size = strlen(str), .data = str } });
+        database_read_end(args->db);
+    }
+}
+
+void* key_updater(void* args) {
+    key_updates(args);
+    return NULL;
+}
+
+void test_update_delete() {
+    fprintf(stderr, "Testing updates of deleted leaves... ");
+
+    // a handle kept by a read section outlives the deletion of its leaf,
+    // and updating the leaf through it fails rather than reviving it
+    Database* db = database_create_database("test_update_delete", 1024);
+    ASSERT_TRUE(db);
+    Directory* records = database_create_directory(db, NULL, "records");
+    ASSERT_TRUE(records && database_read_begin(db));
+    Leaf* leaf = database_create_leaf(db, records, "key", INT, (Value){ .int_value = 1 });
+    ASSERT_TRUE(leaf && database_delete_leaf(db, leaf));
+    EXPECT_FALSE(database_update_leaf(db, leaf, (Value){ .int_value = 2 }));
+    database_read_end(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    database_shutdown_database(db);
+
+    // so updates racing with deletes log nothing for the deleted leaves,
+    // and the log replays after a crash
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_update_delete");
+        if (!db) _exit(1);
+        records = database_find_child(db, NULL, "records");
+        atomic_bool stop = false;
+        pthread_t threads[NTHREADS];
+        ClearArgs args[NTHREADS];
+        for (int i = 0; i < NTHREADS; ++i) {
+            args[i] = (ClearArgs){ .db = db, .id = i, .stop = &stop };
+            if (pthread_create(&threads[i], NULL, key_updater, &args[i]) != 0) _exit(1);
+        }
+        for (int i = 0; i < NRECREATES; ++i) {
+            leaf = database_find_child(db, records, "key");
+            if (leaf && !database_delete_leaf(db, leaf)) _exit(1);
+            if (!database_create_leaf(db, records, "key", STR, (Value){ .str_value = { .size = 7, .data = "created" } })) {
+                _exit(1);
+            }
+            sched_yield(); // for the updaters to find it
+        }
+        stop = true;
+        for (int i = 0; i < NTHREADS; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        _exit(database_sync(db) ? 0 : 1);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_update_delete");
+    ASSERT_TRUE(db);
+    records = database_find_child(db, NULL, "records");
+    ASSERT_TRUE(records);
+    Iterator it = database_get_directory_content_iterator(db, records);
+    ASSERT_TRUE(iterator_is_valid(&it) && strcmp(iterator_get_name(&it), "key") == 0);
+    EXPECT_FALSE(iterator_has_next(&it));
+    char const* value = iterator_get_value(&it)->str_value.data;
+    EXPECT_TRUE(strcmp(value, "created") == 0 || strncmp(value, "value ", 6) == 0);
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+void fill_directory(ThreadArgs const* args) {
+    char name[32];
+    sprintf(name, "dir%d", args->id);
+    Directory* dir = database_find_child(args->db, NULL, name);
+    ASSERT_TRUE(dir);
+    for (int i = 0; i < NTHREAD_NODES; ++i) {
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(args->db, dir, name, STR, (Value){ .str_value = { .size = 1, .data = "x" } }));
+    }
+}
+
+void* directory_filler(void* args) {
+    fill_directory(args);
+    return NULL;
+}
+
+// Fill a directory per thread, then delete all of them from this thread
+void fill_and_clear(Database* db) {
+    pthread_t threads[NTHREADS];
+    ThreadArgs args[NTHREADS];
+    for (int i = 0; i < NTHREADS; ++i) {
+        char name[32];
+        sprintf(name, "dir%d", i);
+        ASSERT_TRUE(database_create_directory(db, NULL, name));
+        args[i] = (ThreadArgs){ .db = db, .id = i };
+        ASSERT_TRUE(pthread_create(&threads[i], NULL, directory_filler, &args[i]) == 0);
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    Directory* dir = database_find_child(db, NULL, "dir0");
+    ASSERT_TRUE(dir);
+    int count = 0;
+    Iterator it = database_get_directory_content_iterator(db, dir);
+    do {
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NTHREAD_NODES);
+    database_clear_directory(db, NULL);
+}
+
+void test_thread_caches() {
+    fprintf(stderr, "Testing thread caches... ");
+
+    // blocks cached by threads that are gone are not lost, so filling the
+    // database again does not make the file grow
+    Database* db = database_create_database("test_thread_caches", 1024);
+    ASSERT_TRUE(db);
+    fill_and_clear(db);
+    database_shutdown_database(db);
+    struct stat st;
+    ASSERT_TRUE(stat("test_thread_caches", &st) == 0);
+    off_t size = st.st_size;
+    for (int i = 0; i < 64; ++i) {
+        db = database_open_database("test_thread_caches");
+        ASSERT_TRUE(db);
+        fill_and_clear(db);
+        database_shutdown_database(db);
+    }
+    ASSERT_TRUE(stat("test_thread_caches", &st) == 0);
+    EXPECT_TRUE(st.st_size == size);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NHOT_LEAVES 64
+
+// Is this a value written by a hot_writer?
+bool is_hot_value(Value value) {
+    return strlen(value.str_value.data) == value.str_value.size && strncmp(value.str_value.data, "value ", 6) == 0;
+}
+
+void hot_writes(ThreadArgs const* args) {
+    Directory* hot = database_find_child(args->db, NULL, "hot");
+    char name[32], str[64];
+    for (int i = 0; i < NTHREAD_NODES; ++i) {
+        sprintf(name, "leaf %d", i % NHOT_LEAVES);
+        sprintf(str, i % 3 ? "value %d" : "value %d, long enough to leave the node", i);
+        Value value = { .str_value = { .size = strlen(str), .data = str } };
+        EXPECT_TRUE(database_update_leaf(args->db, database_find_child(args->db, hot, name), value));
+        sprintf(name, "tmp %d of %d", i, args->id);
+        Leaf* tmp = database_create_leaf(args->db, hot, name, STR, value);
+        ASSERT_TRUE(tmp);
+        EXPECT_TRUE(database_delete_leaf(args->db, tmp));
+    }
+}
+
+// Walk the directory while it changes; everything seen must stay readable
+void hot_reads(ThreadArgs const* args) {
+    Directory* hot = database_find_child(args->db, NULL, "hot");
+    for (int i = 0; i < NTHREAD_NODES / 4; ++i) {
+        ASSERT_TRUE(database_read_begin(args->db));
+        int count = 0;
+        Iterator it = database_get_directory_content_iterator(args->db, hot);
+        do {
+            Value value;
+            EXPECT_TRUE(database_read_leaf_value(args->db, iterator_get(&it), &value) && is_hot_value(value));
+            count += strncmp(iterator_get_name(&it), "leaf ", 5) == 0;
+        } while (iterator_next(&it));
+        EXPECT_TRUE(count == NHOT_LEAVES);
+        Value value;
+        ASSERT_TRUE(database_read_leaf_value(args->db, database_find_child(args->db, hot, "leaf 7"), &value));
+        char copy[64];
+        strcpy(copy, value.str_value.data);
+        sched_yield(); // let the writers replace it
+        EXPECT_TRUE(strcmp(copy, value.str_value.data) == 0);
+        database_read_end(args->db);
+    }
+}
+
+void* hot_writer(void* args) {
+    hot_writes(args);
+    return NULL;
+}
+
+void* hot_reader(void* args) {
+    hot_reads(args);
+    return NULL;
+}
+
+// Look up and read while another thread has a transaction open
+void* txn_reader(void* args) {
+    Database* db = ((ThreadArgs const*) args)->db;
+    if (!database_read_begin(db)) return NULL;
+    Value value;
+    Leaf* leaf = database_resolve_path(db, "/cold/leaf 3");
+    bool ok = leaf && database_read_leaf_value(db, leaf, &value) && value.int_value == 3
+        && database_read_leaf_value(db, database_find_child(db, database_find_child(db, NULL, "hot"), "leaf 7"), &value)
+        && strcmp(value.str_value.data, "new") != 0;
+    database_read_end(db);
+    return ok ? args : NULL;
+}
+
+void test_lock_free_reads() {
+    fprintf(stderr, "Testing lock-free reads... ");
+
+    Database* db = database_create_database("test_lock_free_reads", 1024);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    Directory* hot = database_create_directory(db, NULL, "hot");
+    ASSERT_TRUE(hot);
+    for (int i = 0; i < NHOT_LEAVES; ++i) {
+        char name[32];
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, hot, name, STR, (Value){ .str_value = { .size = 7, .data = "value 0" } }));
+    }
+    database_shutdown_database(db);
+
+    // the log says which retired blocks were freed, so replay frees the same
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_lock_free_reads");
+        if (!db) _exit(1);
+        pthread_t threads[NTHREADS];
+        ThreadArgs args[NTHREADS];
+        for (int i = 0; i < NTHREADS; ++i) {
+            args[i] = (ThreadArgs){ .db = db, .id = i };
+            ASSERT_TRUE(pthread_create(&threads[i], NULL, i % 2 ? hot_reader : hot_writer, &args[i]) == 0);
+        }
+        for (int i = 0; i < NTHREADS; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        _exit(database_sync(db) ? 0 : 1);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_lock_free_reads");
+    ASSERT_TRUE(db);
+    int count = 0;
+    Iterator it = database_get_directory_content_iterator(db, database_find_child(db, NULL, "hot"));
+    do {
+        ++count;
+        EXPECT_TRUE(is_hot_value(*iterator_get_value(&it)));
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NHOT_LEAVES);
+
+    // readers do not wait for transactions
+    Directory* cold = database_create_directory(db, NULL, "cold");
+    ASSERT_TRUE(cold);
+    for (int i = 0; i < 10; ++i) {
+        char name[32];
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, cold, name, INT, (Value){ .int_value = i }));
+    }
+    Leaf* leaf = database_find_child(db, database_find_child(db, NULL, "hot"), "leaf 7");
+    ASSERT_TRUE(database_begin(db));
+    ASSERT_TRUE(database_update_leaf(db, leaf, (Value){ .str_value = { .size = 3, .data = "new" } }));
+    pthread_t reader;
+    ThreadArgs args = { .db = db, .id = 0 };
+    void* res;
+    ASSERT_TRUE(pthread_create(&reader, NULL, txn_reader, &args) == 0);
+    ASSERT_TRUE(pthread_join(reader, &res) == 0);
+    EXPECT_TRUE(res == &args);
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, "new") == 0);
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NSCAN_LEAVES 1000
+#define NSUB_LEAVES 10
+
+typedef struct SnapshotArgs {
+    Database* db;
+    Snapshot* snapshot;
+    atomic_bool done;
+} SnapshotArgs;
+
+Value scan_value(char const* fmt, int i, char* buf) {
+    sprintf(buf, fmt, i);
+    return (Value){ .str_value = { .size = strlen(buf), .data = buf } };
+}
+
+// Change, delete and add leaves of the directory that snapshot readers walk
+void scan_writes(SnapshotArgs* args) {
+    Directory* scan = database_find_child(args->db, NULL, "scan");
+    ASSERT_TRUE(scan);
+    char name[32], str[64];
+    for (int i = 0; i < NSCAN_LEAVES; ++i) {
+        sprintf(name, "leaf %d", i);
+        Leaf* leaf = database_find_child(args->db, scan, name);
+        ASSERT_TRUE(leaf);
+        if (i % 2) {
+            EXPECT_TRUE(database_delete_leaf(args->db, leaf));
+        } else {
+            EXPECT_TRUE(database_update_leaf(args->db, leaf, scan_value("changed %d, long enough to leave the node", i, str)));
+        }
+        sprintf(name, "new %d", i);
+        ASSERT_TRUE(database_create_leaf(args->db, scan, name, STR, scan_value("new %d", i, str)));
+        if (i == NSCAN_LEAVES / 2) {
+            Directory* sub = database_find_child(args->db, scan, "sub");
+            database_clear_directory(args->db, sub);
+            EXPECT_TRUE(database_delete_directory(args->db, sub));
+        }
+    }
+    args->done = true;
+}
+
+void* scan_writer(void* args) {
+    scan_writes(args);
+    return NULL;
+}
+
+// Walk the directory as the snapshot taken before scan_writes sees it
+void scan_reads(Database* db, Snapshot const* snapshot) {
+    Directory* scan = database_find_child(db, NULL, "scan");
+    int count = 0;
+    char str[64];
+    Iterator it = database_get_snapshot_iterator(snapshot, scan);
+    do {
+        char const* name = iterator_get_name(&it);
+        if (strcmp(name, "sub") == 0) {
+            int nsub = 0;
+            Iterator sub = database_get_snapshot_iterator(snapshot, iterator_get(&it));
+            do {
+                ++nsub;
+            } while (iterator_next(&sub));
+            EXPECT_TRUE(nsub == NSUB_LEAVES);
+            continue;
+        }
+        int i;
+        ASSERT_TRUE(sscanf(name, "leaf %d", &i) == 1);
+        EXPECT_TRUE(strcmp(iterator_get_value(&it)->str_value.data, scan_value("value %d", i, str).str_value.data) == 0);
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NSCAN_LEAVES);
+}
+
+void scan_with_writer(Database* db) {
+    SnapshotArgs args = { .db = db, .snapshot = database_snapshot(db), .done = false };
+    ASSERT_TRUE(args.snapshot);
+    pthread_t writer;
+    ASSERT_TRUE(pthread_create(&writer, NULL, scan_writer, &args) == 0);
+    while (!args.done) scan_reads(db, args.snapshot);
+    pthread_join(writer, NULL);
+    scan_reads(db, args.snapshot);
+
+    // a newer snapshot keeps the nodes it sees when the older one goes
+    Snapshot* newer = database_snapshot(db);
+    ASSERT_TRUE(newer);
+    Directory* scan = database_find_child(db, NULL, "scan");
+    for (int i = 0; i < NSCAN_LEAVES; i += 2) {
+        char name[32];
+        sprintf(name, "new %d", i);
+        EXPECT_TRUE(database_delete_leaf(db, database_find_child(db, scan, name)));
+    }
+    ASSERT_TRUE(database_release_snapshot(db, args.snapshot));
+    int count = 0;
+    Iterator it = database_get_snapshot_iterator(newer, scan);
+    do {
+        count += strncmp(iterator_get_name(&it), "new ", 4) == 0;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NSCAN_LEAVES);
+    // left open, replay buries the nodes again and frees them
+}
+
+void test_snapshots() {
+    fprintf(stderr, "Testing snapshots... ");
+
+    Database* db = database_create_database("test_snapshots", 1024);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    Directory* scan = database_create_directory(db, NULL, "scan");
+    ASSERT_TRUE(scan);
+    char name[32], str[64];
+    for (int i = 0; i < NSCAN_LEAVES; ++i) {
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, scan, name, STR, scan_value("value %d", i, str)));
+    }
+    Directory* sub = database_create_directory(db, scan, "sub");
+    ASSERT_TRUE(sub);
+    for (int i = 0; i < NSUB_LEAVES; ++i) {
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, sub, name, INT, (Value){ .int_value = i }));
+    }
+    database_shutdown_database(db);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        db = database_open_database("test_snapshots");
+        if (!db) _exit(1);
+        scan_with_writer(db);
+        _exit(database_sync(db) ? 0 : 1);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_snapshots");
+    ASSERT_TRUE(db);
+    scan = database_find_child(db, NULL, "scan");
+    ASSERT_TRUE(scan);
+    int count = 0;
+    Iterator it = database_get_directory_content_iterator(db, scan);
+    do {
+        int i;
+        ASSERT_TRUE(sscanf(iterator_get_name(&it), "%31s %d", name, &i) == 2);
+        EXPECT_TRUE(strcmp(name, "new") == 0 ? i % 2 : i % 2 == 0);
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NSCAN_LEAVES);
+    EXPECT_TRUE(!database_find_child(db, scan, "sub"));
+
+    // transactions show on commit, but not to snapshots taken before
+    Snapshot* snapshot = database_snapshot(db);
+    ASSERT_TRUE(snapshot);
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_TRUE(database_update_leaf(db, database_find_child(db, scan, "leaf 0"), scan_value("value %d", 0, str)));
+    EXPECT_TRUE(database_delete_leaf(db, database_find_child(db, scan, "new 1")));
+    EXPECT_TRUE(database_create_leaf(db, scan, "txn", INT, (Value){ .int_value = 1 }));
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(!database_checkpoint(db)); // deferred while the snapshot is open
+    count = 0;
+    it = database_get_snapshot_iterator(snapshot, scan);
+    do {
+        char const* leaf = iterator_get_name(&it);
+        EXPECT_TRUE(strcmp(leaf, "txn") != 0);
+        if (strcmp(leaf, "leaf 0") == 0) EXPECT_TRUE(strncmp(iterator_get_value(&it)->str_value.data, "changed", 7) == 0);
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NSCAN_LEAVES);
+    EXPECT_TRUE(!database_find_child(db, scan, "new 1"));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, database_find_child(db, scan, "leaf 0"))->str_value.data, "value 0") == 0);
+    ASSERT_TRUE(database_release_snapshot(db, snapshot));
+    EXPECT_TRUE(database_checkpoint(db));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+Value string_value(char const* str) {
+    return (Value) { .str_value = { .size = strlen(str), .data = (char*) str } };
+}
+
+void test_string_updates() {
+    fprintf(stderr, "Testing string updates... ");
+
+    Database* db = database_create_database("test_string_updates", 1024);
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_set_wal(db, true));
+    char const* longer = "a value long enough to leave the node, and then some more";
+    char const* shorter = "a shorter value, still out of the node";
+    Leaf* leaf = database_create_leaf(db, NULL, "leaf", STR, string_value(longer));
+    ASSERT_TRUE(leaf);
+
+    // a transaction writes a string that fits over the old one
+    char* data = database_get_leaf_value(db, leaf)->str_value.data;
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_TRUE(database_update_leaf(db, leaf, string_value(shorter)));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, longer) == 0);
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(database_get_leaf_value(db, leaf)->str_value.data == data);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, shorter) == 0);
+
+    // the last of many updates wins, whichever of them went in place
+    char str[256];
+    ASSERT_TRUE(database_begin(db));
+    for (int i = 0; i < 16; ++i) {
+        sprintf(str, "value %d%*s", i, i % 3 ? 10 : 100 + i, "!");
+        EXPECT_TRUE(database_update_leaf(db, leaf, string_value(str)));
+    }
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, str) == 0);
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_TRUE(database_update_leaf(db, leaf, string_value(shorter)));
+    database_abort(db);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, str) == 0);
+
+    // so does a plain update while nobody can be reading the old string
+    data = database_get_leaf_value(db, leaf)->str_value.data;
+    EXPECT_TRUE(database_update_leaf(db, leaf, string_value(shorter)));
+    EXPECT_TRUE(database_get_leaf_value(db, leaf)->str_value.data == data);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, shorter) == 0);
+    // but not while a thread is in a read section or a snapshot is open
+    ASSERT_TRUE(database_read_begin(db));
+    EXPECT_TRUE(database_update_leaf(db, leaf, string_value(str)));
+    EXPECT_TRUE(database_get_leaf_value(db, leaf)->str_value.data != data);
+    EXPECT_TRUE(strcmp(data, shorter) == 0);
+    database_read_end(db);
+    data = database_get_leaf_value(db, leaf)->str_value.data;
+    Snapshot* snapshot = database_snapshot(db);
+    ASSERT_TRUE(snapshot);
+    EXPECT_TRUE(database_update_leaf(db, leaf, string_value(shorter)));
+    EXPECT_TRUE(database_get_leaf_value(db, leaf)->str_value.data != data);
+    ASSERT_TRUE(database_release_snapshot(db, snapshot));
+    EXPECT_TRUE(database_update_leaf(db, leaf, string_value(str)));
+
+    // a string inside the node is written over there too, plainly or in a
+    // transaction, and leaves it only while someone can be reading it
+    Leaf* small = database_create_leaf(db, NULL, "small", STR, string_value("inline"));
+    ASSERT_TRUE(small);
+    data = database_get_leaf_value(db, small)->str_value.data;
+    EXPECT_TRUE(database_update_leaf(db, small, string_value("written over")));
+    EXPECT_TRUE(database_get_leaf_value(db, small)->str_value.data == data);
+    ASSERT_TRUE(database_begin(db));
+    EXPECT_TRUE(database_update_leaf(db, small, string_value("in a transaction")));
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(database_get_leaf_value(db, small)->str_value.data == data);
+    EXPECT_TRUE(strcmp(data, "in a transaction") == 0);
+    ASSERT_TRUE(database_read_begin(db));
+    EXPECT_TRUE(database_update_leaf(db, small, string_value("moved")));
+    EXPECT_TRUE(database_get_leaf_value(db, small)->str_value.data != data);
+    EXPECT_TRUE(strcmp(data, "in a transaction") == 0);
+    database_read_end(db);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, small)->str_value.data, "moved") == 0);
+
+    // and so do the updates of a leaf the transaction created
+    ASSERT_TRUE(database_begin(db));
+    Leaf* created = database_create_leaf(db, NULL, "created", STR, string_value(longer));
+    ASSERT_TRUE(created);
+    data = database_get_leaf_value(db, created)->str_value.data;
+    EXPECT_TRUE(database_update_leaf(db, created, string_value(shorter)));
+    EXPECT_TRUE(database_get_leaf_value(db, created)->str_value.data == data);
+    ASSERT_TRUE(database_commit(db));
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, created)->str_value.data, shorter) == 0);
+
+    // replaying the log does the same
+    database_shutdown_database(db);
+    db = database_open_database("test_string_updates");
+    ASSERT_TRUE(db);
+    leaf = database_find_child(db, NULL, "leaf");
+    created = database_find_child(db, NULL, "created");
+    ASSERT_TRUE(leaf && created);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, leaf)->str_value.data, str) == 0);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, created)->str_value.data, shorter) == 0);
+    small = database_find_child(db, NULL, "small");
+    ASSERT_TRUE(small);
+    EXPECT_TRUE(strcmp(database_get_leaf_value(db, small)->str_value.data, "moved") == 0);
+
+    // old strings are freed, so updating does not make the file grow
+    ASSERT_TRUE(database_set_wal(db, false));
+    for (int i = 0; i < 1000; ++i) {
+        sprintf(str, "value %d%*s", i, i % 100, "!");
+        EXPECT_TRUE(database_update_leaf(db, leaf, string_value(str)));
+    }
+    database_shutdown_database(db);
+    struct stat st;
+    ASSERT_TRUE(stat("test_string_updates", &st) == 0);
+    off_t size = st.st_size;
+    db = database_open_database("test_string_updates");
+    ASSERT_TRUE(db);
+    leaf = database_find_child(db, NULL, "leaf");
+    for (int i = 0; i < 100000; ++i) {
+        sprintf(str, "value %d%*s", i, i % 100, "!");
+        EXPECT_TRUE(database_update_leaf(db, leaf, string_value(str)));
+        if (i % 2 == 0) continue;
+        ASSERT_TRUE(database_begin(db));
+        EXPECT_TRUE(database_update_leaf(db, leaf, string_value(str + 1)));
+        ASSERT_TRUE(database_commit(db));
+    }
+    database_shutdown_database(db);
+    ASSERT_TRUE(stat("test_string_updates", &st) == 0);
+    EXPECT_TRUE(st.st_size == size);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define DEEP_TREE_DEPTH 200000
+
+// A chain of nested directories, each with a leaf that has its string out of the node
+void fill_deep(Database* db) {
+    Directory* dir = NULL;
+    for (int i = 0; i < DEEP_TREE_DEPTH; ++i) {
+        char name[32];
+        sprintf(name, "level %d", i);
+        dir = database_create_directory(db, dir, name);
+        ASSERT_TRUE(dir);
+        ASSERT_TRUE(database_create_leaf(db, dir, "leaf", STR, string_value("a string that does not fit into the node")));
+    }
+}
+
+void test_deep_clear() {
+    fprintf(stderr, "Testing deep clear... ");
+
+    // clearing does not recurse, and frees everything below
+    Database* db = database_create_database("test_deep_clear", 1024);
+    ASSERT_TRUE(db);
+    fill_deep(db);
+    ASSERT_TRUE(database_resolve_path(db, "level 0/level 1/level 2/leaf")); // cached
+    database_clear_directory(db, NULL);
+    EXPECT_FALSE(database_find_child(db, NULL, "level 0"));
+    EXPECT_FALSE(database_resolve_path(db, "level 0/level 1/level 2/leaf"));
+    database_shutdown_database(db);
+    struct stat st;
+    ASSERT_TRUE(stat("test_deep_clear", &st) == 0);
+    off_t size = st.st_size;
+    for (int i = 0; i < 3; ++i) {
+        db = database_open_database("test_deep_clear");
+        ASSERT_TRUE(db);
+        fill_deep(db);
+        database_clear_directory(db, NULL);
+        database_shutdown_database(db);
+    }
+    ASSERT_TRUE(stat("test_deep_clear", &st) == 0);
+    EXPECT_TRUE(st.st_size == size);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NCHUNK_LEAVES 1000
+
+// Fill two directories in turns, as if they were written to at the same time
+void fill_in_turns(Database* db, Directory* a, Directory* b) {
+    for (int i = 0; i < NCHUNK_LEAVES; ++i) {
+        char name[32];
+        sprintf(name, "leaf %d", i);
+        ASSERT_TRUE(database_create_leaf(db, a, name, INT, (Value){ .int_value = i }));
+        ASSERT_TRUE(database_create_leaf(db, b, name, INT, (Value){ .int_value = i }));
+    }
+}
+
+#define NODE_BYTES 80 // the size of a node, see include/internals.h
+
+// How many children lie right next to the one before them?
+int adjacent_children(Database* db, Directory* dir) {
+    int res = 0;
+    Iterator it = database_get_directory_content_iterator(db, dir);
+    char const* prev = NULL;
+    do {
+        char const* node = (char const*) iterator_get(&it);
+        if (prev && (prev - node == NODE_BYTES || node - prev == NODE_BYTES)) res++;
+        prev = node;
+    } while (iterator_next(&it));
+    return res;
+}
+
+// Replace a directory and fill it along with another one that is deleted then
+void recreate_directories(char const* filename) {
+    Database* db = database_open_database(filename);
+    ASSERT_TRUE(db);
+    Directory* a = database_find_child(db, NULL, "a");
+    database_clear_directory(db, a);
+    EXPECT_TRUE(database_delete_directory(db, a));
+    a = database_create_directory(db, NULL, "a");
+    Directory* d = database_create_directory(db, NULL, "d");
+    ASSERT_TRUE(a && d);
+    fill_in_turns(db, a, d);
+    database_clear_directory(db, d);
+    EXPECT_TRUE(database_delete_directory(db, d));
+    database_shutdown_database(db);
+}
+
+void test_directory_chunks() {
+    fprintf(stderr, "Testing directory chunks... ");
+
+    // the children of a directory lie together, whatever else is allocated
+    Database* db = database_create_database("test_directory_chunks", 1024);
+    ASSERT_TRUE(db);
+    Directory* a = database_create_directory(db, NULL, "a");
+    Directory* b = database_create_directory(db, NULL, "b");
+    ASSERT_TRUE(a && b);
+    fill_in_turns(db, a, b);
+    EXPECT_TRUE(adjacent_children(db, a) > NCHUNK_LEAVES * 9 / 10);
+    EXPECT_TRUE(adjacent_children(db, b) > NCHUNK_LEAVES * 9 / 10);
+
+    // and so they go together: clearing retires the chunks, not every child
+    DatabaseStats before, after;
+    ASSERT_TRUE(database_get_stats(db, &before));
+    database_clear_directory(db, a);
+    ASSERT_TRUE(database_get_stats(db, &after));
+    EXPECT_TRUE(after.heap.retired - before.heap.retired < NCHUNK_LEAVES / 10);
+    EXPECT_TRUE(after.heap.frees == before.heap.frees);
+
+    // and so they do after churn, and in a reopened file
+    EXPECT_TRUE(database_delete_directory(db, a));
+    database_shutdown_database(db);
+    db = database_open_database("test_directory_chunks");
+    ASSERT_TRUE(db);
+    a = database_create_directory(db, NULL, "a");
+    Directory* c = database_create_directory(db, NULL, "c");
+    ASSERT_TRUE(a && c);
+    fill_in_turns(db, a, c);
+    EXPECT_TRUE(adjacent_children(db, a) > NCHUNK_LEAVES * 9 / 10);
+
+    // a deleted child leaves its slot to the next child of its directory,
+    // not to whatever this thread allocates next
+    int reused = 0;
+    for (int i = 0; i < 64; ++i) {
+        Leaf* leaf = database_create_leaf(db, c, "churn", INT, (Value){ .int_value = i });
+        ASSERT_TRUE(leaf && database_begin(db) && database_delete_leaf(db, leaf));
+        ASSERT_TRUE(database_commit(db)); // frees the leaf right away
+        ASSERT_TRUE(database_create_leaf(db, NULL, "elsewhere", STR,
+                                         string_value("a string of a size that a node has too")));
+        reused += database_create_leaf(db, c, "churn", INT, (Value){ .int_value = i }) == leaf;
+    }
+    EXPECT_TRUE(reused == 64);
+
+    // chunks of deleted directories go back, so the file does not grow once
+    // it has room for the four directories a cycle holds at its peak
+    database_shutdown_database(db);
+    recreate_directories("test_directory_chunks");
+    struct stat st;
+    ASSERT_TRUE(stat("test_directory_chunks", &st) == 0);
+    off_t size = st.st_size;
+    for (int i = 0; i < 16; ++i) recreate_directories("test_directory_chunks");
+    ASSERT_TRUE(stat("test_directory_chunks", &st) == 0);
+    EXPECT_TRUE(st.st_size == size);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NJUNK_LEAVES 50000
+#define NKEPT_LEAVES 2000
+
+off_t file_size(char const* filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? st.st_size : -1;
+}
+
+// Fill the file with junk, then with what is kept, and delete the junk,
+// so that the kept nodes lie at the end of a file that is mostly empty
+void fill_for_compaction(Database* db) {
+    Directory* junk = database_create_directory(db, NULL, "junk");
+    ASSERT_TRUE(junk);
+    char name[32], str[64];
+    for (int i = 0; i < NJUNK_LEAVES; ++i) {
+        sprintf(name, "junk %d", i);
+        ASSERT_TRUE(database_create_leaf(db, junk, name, STR, string_value("junk that does not fit into the node")));
+    }
+    Directory* kept = database_find_child(db, NULL, "kept");
+    if (!kept) {
+        kept = database_create_directory(db, NULL, "kept");
+        ASSERT_TRUE(kept && database_set_ordered(db, kept, true) && database_set_unique_names(db, kept, true));
+        Directory* sub = database_create_directory(db, kept, "sub");
+        ASSERT_TRUE(sub && database_create_leaf(db, sub, "a leaf with a long name", INT, (Value){ .int_value = 7 }));
+    }
+    for (int i = 0; i < NKEPT_LEAVES; ++i) {
+        sprintf(name, "key%05d", (i * 7919) % NKEPT_LEAVES);
+        sprintf(str, "value %d, long enough to leave the node", (i * 7919) % NKEPT_LEAVES);
+        database_create_leaf(db, kept, name, STR, string_value(str)); // fails the second time
+    }
+    database_clear_directory(db, junk);
+    ASSERT_TRUE(database_delete_directory(db, junk));
+}
+
+void check_kept(Database* db) {
+    Directory* kept = database_find_child(db, NULL, "kept");
+    ASSERT_TRUE(kept);
+    int count = 0;
+    Iterator it = iterator_seek(kept, NULL);
+    do {
+        if (iterator_get_type(&it) == DIR) continue;
+        char str[64];
+        sprintf(str, "value %d, long enough to leave the node", count);
+        EXPECT_TRUE(strcmp(iterator_get_value(&it)->str_value.data, str) == 0);
+        ++count;
+    } while (iterator_next(&it));
+    EXPECT_TRUE(count == NKEPT_LEAVES);
+    Leaf const* leaf = database_find_child(db, kept, "key01234");
+    EXPECT_TRUE(leaf && strcmp(database_get_leaf_value(db, leaf)->str_value.data + 6, "1234, long enough to leave the node") == 0);
+    EXPECT_FALSE(database_create_leaf(db, kept, "key00042", INT, (Value){ .int_value = 42 }));
+    leaf = database_resolve_path(db, "kept/sub/a leaf with a long name");
+    EXPECT_TRUE(leaf && database_get_leaf_value(db, leaf)->int_value == 7);
+}
+
+void test_compaction() {
+    fprintf(stderr, "Testing compaction... ");
+
+    // the file shrinks to what is left, and all of it is still there
+    Database* db = database_create_database("test_compaction", 1024);
+    ASSERT_TRUE(db);
+    fill_for_compaction(db);
+    off_t size = file_size("test_compaction");
+    ASSERT_TRUE(database_compact(db));
+    EXPECT_TRUE(file_size("test_compaction") < size / 4);
+    check_kept(db);
+    database_shutdown_database(db);
+    db = database_open_database("test_compaction");
+    ASSERT_TRUE(db);
+    check_kept(db);
+
+    // compacting again finds nothing to move
+    size = file_size("test_compaction");
+    ASSERT_TRUE(database_compact(db));
+    EXPECT_TRUE(file_size("test_compaction") == size);
+
+    // with a log, the file shrinks on the checkpoint that follows
+    ASSERT_TRUE(database_set_wal(db, true));
+    fill_for_compaction(db);
+    size = file_size("test_compaction");
+    ASSERT_TRUE(database_compact(db));
+    EXPECT_TRUE(file_size("test_compaction") < size / 4);
+    check_kept(db);
+    database_shutdown_database(db);
+    pid_t pid = fork();
+    if (pid == 0) { // later changes are logged where the nodes are now
+        db = database_open_database("test_compaction");
+        if (!db) _exit(1);
+        fill_for_compaction(db);
+        database_compact(db);
+        database_create_leaf(db, database_find_child(db, NULL, "kept"), "after", INT, (Value){ .int_value = 1 });
+        database_sync(db);
+        _exit(0);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_compaction");
+    ASSERT_TRUE(db);
+    EXPECT_TRUE(database_find_child(db, database_find_child(db, NULL, "kept"), "after"));
+    ASSERT_TRUE(database_delete_leaf(db, database_find_child(db, database_find_child(db, NULL, "kept"), "after")));
+    check_kept(db);
+
+    // snapshots see the nodes where they are
+    Snapshot* snapshot = database_snapshot(db);
+    ASSERT_TRUE(snapshot);
+    EXPECT_FALSE(database_compact(db));
+    database_release_snapshot(db, snapshot);
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+#define NCOLUMN_LEAVES 20000
+
+// The aggregates of a directory of INT leaves agree with a walk over it
+bool aggregates_match(Database* db, Directory* dir) {
+    double sum = 0, min = 0, max = 0, count = 0;
+    Iterator it = database_get_directory_content_iterator(db, dir);
+    for (bool valid = iterator_is_valid(&it); valid; valid = iterator_next(&it)) {
+        double value = iterator_get_value(&it)->int_value;
+        min = count == 0 || value < min ? value : min;
+        max = count == 0 || value > max ? value : max;
+        sum += value;
+        count++;
+    }
+    double res[4];
+    bool ok = database_aggregate(db, dir, AGG_SUM, &res[0]) && database_aggregate(db, dir, AGG_COUNT, &res[3]);
+    if (count == 0) return ok && res[0] == 0 && res[3] == 0 && !database_aggregate(db, dir, AGG_MIN, &res[1]);
+    ok = ok && database_aggregate(db, dir, AGG_MIN, &res[1]) && database_aggregate(db, dir, AGG_MAX, &res[2]);
+    return ok && res[0] == sum && res[1] == min && res[2] == max && res[3] == count;
+}
+
+void test_columnar() {
+    fprintf(stderr, "Testing columnar directories... ");
+
+    Database* db = database_create_database("test_columnar", 1024);
+    ASSERT_TRUE(db);
+    Directory* metrics = database_create_directory(db, NULL, "metrics");
+    ASSERT_TRUE(metrics && database_set_columnar(db, metrics, INT));
+    Leaf* leaves[NCOLUMN_LEAVES];
+    char name[32];
+    for (int i = 0; i < NCOLUMN_LEAVES; i++) {
+        sprintf(name, "m%d", i);
+        leaves[i] = database_create_leaf(db, metrics, name, INT, (Value) { .int_value = (i * 7919) % 10007 - 5000 });
+        ASSERT_TRUE(leaves[i]);
+    }
+    EXPECT_TRUE(aggregates_match(db, metrics));
+
+    // only leaves of the type of the column go in
+    EXPECT_FALSE(database_create_leaf(db, metrics, "f", FLOAT, (Value) { .float_value = 1 }));
+    EXPECT_FALSE(database_create_leaf(db, metrics, "s", STR, string_value("s")));
+    EXPECT_FALSE(database_create_directory(db, metrics, "d"));
+    EXPECT_FALSE(database_set_columnar(db, metrics, FLOAT));
+
+    // updates and deletions show in the column
+    for (int i = 0; i < NCOLUMN_LEAVES; i += 3) {
+        EXPECT_TRUE(database_update_leaf(db, leaves[i], (Value) { .int_value = i }));
+    }
+    for (int i = 1; i < NCOLUMN_LEAVES; i += 5) {
+        EXPECT_TRUE(database_delete_leaf(db, leaves[i]));
+        leaves[i] = NULL;
+    }
+    EXPECT_TRUE(aggregates_match(db, metrics));
+
+    // a transaction changes the column on commit, and not at all if aborted
+    ASSERT_TRUE(database_begin(db));
+    database_create_leaf(db, metrics, "big", INT, (Value) { .int_value = 1000000 });
+    database_update_leaf(db, leaves[0], (Value) { .int_value = -1000000 });
+    database_delete_leaf(db, leaves[2]);
+    database_abort(db);
+    EXPECT_TRUE(aggregates_match(db, metrics));
+    ASSERT_TRUE(database_begin(db));
+    database_create_leaf(db, metrics, "big", INT, (Value) { .int_value = 1000000 });
+    database_update_leaf(db, leaves[0], (Value) { .int_value = -1000000 });
+    database_delete_leaf(db, leaves[2]);
+    leaves[2] = NULL;
+    ASSERT_TRUE(database_commit(db));
+    double res;
+    EXPECT_TRUE(database_aggregate(db, metrics, AGG_MAX, &res) && res == 1000000);
+    EXPECT_TRUE(database_aggregate(db, metrics, AGG_MIN, &res) && res == -1000000);
+    EXPECT_TRUE(aggregates_match(db, metrics));
+
+    // deleted nodes that snapshots still see are not counted
+    Snapshot* snapshot = database_snapshot(db);
+    ASSERT_TRUE(snapshot);
+    EXPECT_TRUE(database_delete_leaf(db, leaves[3]));
+    leaves[3] = NULL;
+    EXPECT_TRUE(aggregates_match(db, metrics));
+    database_release_snapshot(db, snapshot);
+
+    // directories without a column give the same answers
+    EXPECT_TRUE(database_set_columnar(db, metrics, 0));
+    EXPECT_TRUE(aggregates_match(db, metrics));
+    EXPECT_TRUE(database_set_columnar(db, metrics, INT));
+
+    // the column is kept in the file and in the log
+    ASSERT_TRUE(database_set_wal(db, true));
+    for (int i = 4; i < NCOLUMN_LEAVES; i += 5) {
+        EXPECT_TRUE(database_update_leaf(db, leaves[i], (Value) { .int_value = -i }));
+    }
+    database_shutdown_database(db);
+    pid_t pid = fork();
+    if (pid == 0) { // replay builds the same column
+        db = database_open_database("test_columnar");
+        if (!db) _exit(1);
+        Directory* flags = database_create_directory(db, NULL, "flags");
+        database_set_columnar(db, flags, BOOL);
+        for (int i = 0; i < 100; i++) {
+            sprintf(name, "b%d", i);
+            database_create_leaf(db, flags, name, BOOL, (Value) { .bool_value = i % 4 == 0 });
+        }
+        database_sync(db);
+        _exit(0);
+    }
+    int status;
+    ASSERT_TRUE(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    db = database_open_database("test_columnar");
+    ASSERT_TRUE(db);
+    metrics = database_find_child(db, NULL, "metrics");
+    EXPECT_TRUE(aggregates_match(db, metrics));
+    Directory* flags = database_find_child(db, NULL, "flags");
+    EXPECT_TRUE(database_aggregate(db, flags, AGG_SUM, &res) && res == 25);
+    EXPECT_TRUE(database_aggregate(db, flags, AGG_COUNT, &res) && res == 100);
+    EXPECT_FALSE(database_create_leaf(db, flags, "i", INT, (Value) { .int_value = 1 }));
+
+    // compaction moves the column and its leaves
+    ASSERT_TRUE(database_set_wal(db, false));
+    database_clear_directory(db, flags);
+    EXPECT_TRUE(database_aggregate(db, flags, AGG_COUNT, &res) && res == 0);
+    EXPECT_FALSE(database_aggregate(db, flags, AGG_MIN, &res));
+    ASSERT_TRUE(database_compact(db));
+    metrics = database_find_child(db, NULL, "metrics");
+    EXPECT_TRUE(aggregates_match(db, metrics));
+    database_clear_directory(db, metrics);
+    EXPECT_TRUE(aggregates_match(db, metrics));
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
 void example() {
     Database* db = database_create_database("example", 1024);
     Value v;
@@ -121,11 +1743,269 @@ void example() {
     database_shutdown_database(db);
 }
 
+// Checks that hold for the statistics of any heap
+bool heap_stats_consistent(AllocStats const* heap) {
+    uint64_t live = 0;
+    for (int i = 0; i < ALLOC_NCLASSES; i++) {
+        if (heap->live_bytes[i] != heap->live_blocks[i] * heap->class_size[i]) return false;
+        live += heap->live_bytes[i];
+    }
+    return live > 0 && live <= heap->used_bytes && heap->used_bytes <= heap->heap_bytes
+           && heap->free_bytes == heap->heap_bytes - heap->used_bytes && heap->largest_free <= heap->free_bytes
+           && heap->fragmentation >= 0 && heap->fragmentation < 1 && heap->mallocs >= heap->frees
+           && heap->heap_bytes <= heap->file_bytes && heap->narenas > 0;
+}
+
+void test_stats() {
+    fprintf(stderr, "Testing statistics... ");
+
+    Database* db = database_create_database("test_stats", 1024);
+    ASSERT_TRUE(db);
+    DatabaseStats stats;
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[0] == 1); // the root
+    EXPECT_TRUE(stats.nodes[1] == 0 && stats.nodes[2] == 0 && stats.nodes[3] == 0 && stats.nodes[4] == 0);
+
+    Directory* dir = database_create_directory(db, NULL, "dir");
+    ASSERT_TRUE(dir);
+    Leaf* leaves[10];
+    char name[32];
+    for (int i = 0; i < 10; i++) {
+        sprintf(name, "leaf%d", i);
+        leaves[i] = i % 2 ? database_create_leaf(db, dir, name, INT, (Value) { .int_value = i })
+                          : database_create_leaf(db, dir, name, STR, string_value("a value too long to be inline"));
+        ASSERT_TRUE(leaves[i]);
+    }
+    EXPECT_FALSE(database_create_leaf(db, leaves[1], "x", BOOL, (Value) { .bool_value = true }));
+    EXPECT_TRUE(database_update_leaf(db, leaves[1], (Value) { .int_value = -1 }));
+    EXPECT_TRUE(database_find_child(db, dir, "leaf3") == leaves[3]);
+    EXPECT_TRUE(database_delete_leaf(db, leaves[0]));
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[0] == 2 && stats.nodes[1] == 5 && stats.nodes[2] == 4);
+    EXPECT_TRUE(stats.ops[DB_OP_CREATE] == 12 && stats.ops[DB_OP_UPDATE] == 1);
+    EXPECT_TRUE(stats.ops[DB_OP_LOOKUP] == 1 && stats.ops[DB_OP_DELETE] == 1);
+    EXPECT_TRUE(heap_stats_consistent(&stats.heap));
+    EXPECT_TRUE(stats.heap.requested_bytes > 0 && stats.heap.rounding_bytes > 0);
+
+    // an aborted transaction leaves nothing behind, a committed one counts
+    ASSERT_TRUE(database_begin(db));
+    ASSERT_TRUE(database_create_leaf(db, dir, "float", FLOAT, (Value) { .float_value = 1 }));
+    ASSERT_TRUE(database_get_stats(db, &stats)); // not linked yet, but there
+    EXPECT_TRUE(stats.nodes[3] == 1);
+    database_abort(db);
+    ASSERT_TRUE(database_begin(db));
+    ASSERT_TRUE(database_create_leaf(db, dir, "bool", BOOL, (Value) { .bool_value = true }));
+    EXPECT_TRUE(database_delete_leaf(db, leaves[1]));
+    ASSERT_TRUE(database_commit(db));
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[1] == 4 && stats.nodes[3] == 0 && stats.nodes[4] == 1);
+    EXPECT_TRUE(stats.ops[DB_OP_COMMIT] == 1 && stats.ops[DB_OP_ABORT] == 1);
+
+    // deleted nodes that a snapshot sees are kept, and counted until released
+    Snapshot* snapshot = database_snapshot(db);
+    ASSERT_TRUE(snapshot);
+    database_clear_directory(db, dir);
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[1] == 4 && stats.snapshots == 1);
+    database_release_snapshot(db, snapshot);
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[1] == 0 && stats.nodes[2] == 0 && stats.nodes[4] == 0 && stats.snapshots == 0);
+
+    // threads count on their own
+    fill_and_clear(db);
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[0] == 1 && stats.nodes[2] == 0); // the root is all that is left
+    for (int i = 0; i < NTHREADS; ++i) {
+        sprintf(name, "dir%d", i);
+        ASSERT_TRUE(database_create_directory(db, NULL, name));
+    }
+    pthread_t threads[NTHREADS];
+    ThreadArgs args[NTHREADS];
+    for (int i = 0; i < NTHREADS; ++i) {
+        args[i] = (ThreadArgs) { .db = db, .id = i };
+        ASSERT_TRUE(pthread_create(&threads[i], NULL, directory_filler, &args[i]) == 0);
+    }
+    for (int i = 0; i < NTHREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(stats.nodes[0] == 1 + NTHREADS && stats.nodes[2] == NTHREADS * NTHREAD_NODES);
+    EXPECT_TRUE(heap_stats_consistent(&stats.heap));
+
+    // a database opened again counts what it holds, and so does its heap
+    DatabaseStats before = stats;
+    database_shutdown_database(db);
+    db = database_open_database("test_stats");
+    ASSERT_TRUE(db);
+    ASSERT_TRUE(database_get_stats(db, &stats));
+    EXPECT_TRUE(memcmp(stats.nodes, before.nodes, sizeof(stats.nodes)) == 0);
+    EXPECT_TRUE(stats.ops[DB_OP_CREATE] == 0);
+    EXPECT_TRUE(heap_stats_consistent(&stats.heap));
+    EXPECT_TRUE(stats.heap.mallocs == 0 && stats.heap.used_bytes == before.heap.used_bytes);
+    database_destroy_database(db);
+
+    fprintf(stderr, "OK\n");
+}
+
+typedef struct LogCapture {
+    int counts[LOG_LEVEL_OFF];
+    char last[LOG_LEVEL_OFF][256]; // message of each level
+} LogCapture;
+
+void capture_log(void* ctx, LogLevel level, char const* message) {
+    LogCapture* capture = ctx;
+    capture->counts[level]++;
+    snprintf(capture->last[level], sizeof(capture->last[level]), "%s", message);
+}
+
+void test_logging() {
+    fprintf(stderr, "Testing logging... ");
+
+    // quiet by default, then whatever the level lets through goes to the sink
+    LogCapture capture = { 0 };
+    log_set_sink(capture_log, &capture);
+    Database* db = database_create_database("test_logging", 1024);
+    ASSERT_TRUE(db);
+    EXPECT_TRUE(capture.counts[LOG_LEVEL_DEBUG] == 0 && capture.counts[LOG_LEVEL_INFO] == 0);
+    database_destroy_database(db);
+    log_set_level(LOG_LEVEL_DEBUG);
+    db = database_create_database("test_logging", 1024);
+    ASSERT_TRUE(db);
+    EXPECT_TRUE(capture.counts[LOG_LEVEL_DEBUG] > 0);
+    EXPECT_TRUE(strncmp(capture.last[LOG_LEVEL_DEBUG], "bd: ", 4) == 0);
+
+    // trace statements are there only if compiled in
+    log_set_level(LOG_LEVEL_TRACE);
+    ASSERT_TRUE(database_set_wal(db, true));
+    ASSERT_TRUE(database_create_leaf(db, NULL, "leaf", INT, (Value) { .int_value = 1 }));
+    EXPECT_TRUE((capture.counts[LOG_LEVEL_TRACE] > 0) == (LOG_MIN_LEVEL <= LOG_LEVEL_TRACE));
+    database_destroy_database(db);
+
+    // errors come through unless logging is off
+    log_set_level(LOG_LEVEL_WARN);
+    FILE* file = fopen("test_logging_invalid", "w");
+    ASSERT_TRUE(file);
+    fputs("not a database", file);
+    fclose(file);
+    EXPECT_FALSE(database_open_database("test_logging_invalid"));
+    EXPECT_TRUE(capture.counts[LOG_LEVEL_ERROR] == 1 && strstr(capture.last[LOG_LEVEL_ERROR], "test_logging_invalid"));
+    log_set_level(LOG_LEVEL_OFF);
+    EXPECT_FALSE(database_open_database("test_logging_invalid"));
+    EXPECT_TRUE(capture.counts[LOG_LEVEL_ERROR] == 1);
+    remove("test_logging_invalid");
+
+    log_set_level(LOG_LEVEL_WARN);
+    log_set_sink(NULL, NULL);
+    fprintf(stderr, "OK\n");
+}
+
+void count_event(void* ctx, TraceEvent const* event) {
+    int* counts = ctx;
+    counts[event->op]++;
+}
+
+void test_tracing() {
+    fprintf(stderr, "Testing tracing... ");
+
+    // events come only while tracing is on, and only if it is compiled in
+    Database* db = database_create_database("test_tracing", 1024);
+    ASSERT_TRUE(db);
+    static char big[3000];
+    memset(big, 'x', sizeof(big));
+    String big_str = { .size = sizeof(big), .data = big };
+    ASSERT_TRUE(database_create_leaf(db, NULL, "off", INT, (Value) { .int_value = 1 }));
+    trace_set_enabled(true);
+    Leaf* leaf = database_create_leaf(db, NULL, "leaf", STR, (Value) { .str_value = big_str });
+    ASSERT_TRUE(leaf);
+    EXPECT_TRUE(database_update_leaf(db, leaf, (Value) { .str_value = { .size = 5, .data = "value" } }));
+    EXPECT_TRUE(database_delete_leaf(db, leaf));
+    trace_set_enabled(false);
+    ASSERT_TRUE(database_create_leaf(db, NULL, "off again", INT, (Value) { .int_value = 1 }));
+
+    TraceEvent events[256];
+    size_t n = trace_drain(events, 256);
+    int counts[NTRACE_OPS] = { 0 };
+    bool split = false;
+    for (size_t i = 0; i < n; i++) {
+        counts[events[i].op]++;
+        if (events[i].op == TRACE_BD_ALLOC && !events[i].failed) {
+            EXPECT_TRUE(events[i].size_class >= 0);
+            split |= events[i].levels > 0;
+        }
+        if (events[i].op == TRACE_CREATE_LEAF) EXPECT_TRUE(events[i].size == sizeof(big));
+    }
+#ifdef TRACING
+    EXPECT_TRUE(counts[TRACE_CREATE_LEAF] == 1 && counts[TRACE_UPDATE_LEAF] == 1 && counts[TRACE_DELETE_NODE] == 1);
+    EXPECT_TRUE(counts[TRACE_BD_ALLOC] > 0 && split); // a fresh heap splits its blocks
+#else
+    EXPECT_TRUE(n == 0);
+#endif
+    EXPECT_TRUE(trace_drain(events, 256) == 0);
+
+    // a hook gets the events instead of the ring
+    int hooked[NTRACE_OPS] = { 0 };
+    trace_set_hook(count_event, hooked);
+    trace_set_enabled(true);
+    ASSERT_TRUE(database_create_leaf(db, NULL, "hooked", INT, (Value) { .int_value = 1 }));
+    trace_set_enabled(false);
+    trace_set_hook(NULL, NULL);
+#ifdef TRACING
+    EXPECT_TRUE(hooked[TRACE_CREATE_LEAF] == 1);
+#else
+    EXPECT_TRUE(hooked[TRACE_CREATE_LEAF] == 0);
+#endif
+    EXPECT_TRUE(trace_drain(events, 256) == 0);
+    database_destroy_database(db);
+
+    // when the ring is full the oldest events are lost, and counted
+    uint64_t lost = trace_lost();
+    enum { NEVENTS = 100000 };
+    for (uint64_t i = 0; i < NEVENTS; i++) {
+        trace_emit(&(TraceEvent) { .start_ns = i + 1, .op = TRACE_BD_FREE });
+    }
+    size_t drained = 0;
+    uint64_t last = 0;
+    bool ordered = true;
+    while ((n = trace_drain(events, 256)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            ordered &= events[i].start_ns > last;
+            last = events[i].start_ns;
+        }
+        drained += n;
+    }
+    EXPECT_TRUE(ordered && last == NEVENTS);
+    EXPECT_TRUE(drained > 0 && drained < NEVENTS && drained + (trace_lost() - lost) == NEVENTS);
+
+    fprintf(stderr, "OK\n");
+}
+
 int main() {
     fprintf(stderr, "Running example...\n");
     example();
     fprintf(stderr, "\nRunning tests...\n");
     test_insertions();
     test_deletions();
+    test_long_names_and_values();
+    test_find_child();
+    test_resolve_path();
+    test_ordered_directory();
+    test_reopen();
+    test_growth();
+    test_wal();
+    test_transactions();
+    test_concurrency();
+    test_concurrent_clear();
+    test_update_delete();
+    test_thread_caches();
+    test_lock_free_reads();
+    test_snapshots();
+    test_string_updates();
+    test_deep_clear();
+    test_directory_chunks();
+    test_compaction();
+    test_columnar();
+    test_stats();
+    test_logging();
+    test_tracing();
     return 0;
 }
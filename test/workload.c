@@ -0,0 +1,428 @@
+#include "database.h"
+#include "harness.h"
+#include "utils.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Workload mixes in the style of YCSB. Records are STR leaves named
+// "user<key>" with values of random lengths, spread over the directories
+// at the bottom of a tree of the given depth and fanout. The popularity
+// of keys follows a zipfian distribution, scrambled so that popular keys
+// are not next to each other. The records are loaded first, then threads
+// run the mix, and every type of operation gets its own latencies.
+//
+// Preset mixes, as in YCSB:
+//   a  50% reads, 50% updates
+//   b  95% reads, 5% updates
+//   c  reads only
+//   d  95% reads, 5% inserts, reads favour the newest records
+//   e  95% scans, 5% inserts
+//   f  50% reads, 50% read-modify-writes
+// "--mix read=N,update=N,insert=N,delete=N,scan=N,rmw=N" runs a custom one.
+
+typedef enum OpType {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_DELETE,
+    OP_SCAN,
+    OP_RMW,
+    NOPS,
+} OpType;
+
+char const* const op_names[NOPS] = { "read", "update", "insert", "delete", "scan", "rmw" };
+
+typedef struct Workload {
+    char const* name;
+    unsigned mix[NOPS]; // percents of the operations
+    bool latest;        // reads favour the newest records
+} Workload;
+
+Workload const presets[] = {
+    { "a", { [OP_READ] = 50, [OP_UPDATE] = 50 }, false },
+    { "b", { [OP_READ] = 95, [OP_UPDATE] = 5 }, false },
+    { "c", { [OP_READ] = 100 }, false },
+    { "d", { [OP_READ] = 95, [OP_INSERT] = 5 }, true },
+    { "e", { [OP_SCAN] = 95, [OP_INSERT] = 5 }, false },
+    { "f", { [OP_READ] = 50, [OP_RMW] = 50 }, false },
+};
+
+#define NPRESETS (sizeof(presets) / sizeof(presets[0]))
+#define VALUE_BYTES (1 << 16) // random text that values are taken from
+
+typedef struct Options {
+    size_t ops;        // operations per run, all threads together; the size of the dataset if 0
+    size_t threads;
+    size_t depth;      // of the directories above the records
+    size_t fanout;     // subdirectories of each directory
+    size_t value_min;  // bytes of a value
+    size_t value_max;
+    size_t scan_max;   // records a scan reads at most
+    double theta;      // skew of the zipfian distribution
+    bool custom;       // a custom mix was given
+    Workload mix;
+} Options;
+
+bool parse_mix(Workload* res, char const* value) {
+    *res = (Workload) { .name = "custom" };
+    char* copy = strdup(value);
+    if (!copy) return false;
+    bool ok = true;
+    unsigned total = 0;
+    for (char* item = strtok(copy, ","); item && ok; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        ok = eq != NULL;
+        if (!ok) break;
+        *eq = '\0';
+        size_t op = 0;
+        while (op < NOPS && strcmp(op_names[op], item) != 0) op++;
+        ok = op < NOPS;
+        if (ok) total += res->mix[op] = (unsigned) atoi(eq + 1);
+    }
+    free(copy);
+    return ok && total == 100;
+}
+
+bool parse_option(void* ctx, char const* arg, char const* value) {
+    Options* options = ctx;
+    size_t* counts[] = { &options->ops, &options->threads, &options->depth, &options->fanout,
+                         &options->value_min, &options->value_max, &options->scan_max };
+    char const* const names[] = { "--ops", "--threads", "--depth", "--fanout", "--value-min", "--value-max", "--scan-max" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            char* end;
+            *counts[i] = strtoull(value, &end, 10);
+            return *value && !*end;
+        }
+    }
+    if (strcmp(arg, "--theta") == 0) {
+        char* end;
+        options->theta = strtod(value, &end);
+        return *value && !*end && options->theta > 0 && options->theta < 1;
+    }
+    if (strcmp(arg, "--mix") == 0) return options->custom = parse_mix(&options->mix, value);
+    return false;
+}
+
+// xorshift64*, one per thread
+uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+double next_unit(uint64_t* state) { // in [0, 1)
+    return (double) (next_random(state) >> 11) / (double) (1ULL << 53);
+}
+
+uint64_t fnv_hash(uint64_t value) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++, value >>= 8) {
+        h ^= value & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Zipfian ranks over n items, by the method of Gray et al. that YCSB uses
+typedef struct Zipfian {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} Zipfian;
+
+void zipf_init(Zipfian* z, uint64_t n, double theta) {
+    double zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) zetan += 1 / pow((double) i, theta);
+    double zeta2 = 1 + 1 / pow(2, theta);
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zetan;
+    z->eta = (1 - pow(2.0 / (double) n, 1 - theta)) / (1 - zeta2 / zetan);
+}
+
+uint64_t zipf_next(Zipfian const* z, uint64_t* state) { // 0 is the most popular
+    double u = next_unit(state);
+    double uz = u * z->zetan;
+    if (uz < 1) return 0;
+    if (uz < 1 + pow(0.5, z->theta)) return 1;
+    uint64_t res = (uint64_t) ((double) z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return res < z->n ? res : z->n - 1;
+}
+
+typedef struct Run {
+    Database* db;
+    Options const* options;
+    Workload const* workload;
+    Directory** dirs;   // at the bottom of the tree
+    char** paths;       // of dirs
+    size_t ndirs;
+    Zipfian zipf;       // over the loaded records
+    size_t nloaded;
+    atomic_size_t next_key; // of the next record inserted
+    char const* text;   // values are taken from
+} Run;
+
+typedef struct Worker {
+    Run* run;
+    size_t n_ops;
+    uint64_t random;
+    Samples samples[NOPS];
+} Worker;
+
+size_t dir_of(Run const* run, size_t key) {
+    return fnv_hash(key) % run->ndirs;
+}
+
+String random_value(Run const* run, uint64_t* random) {
+    Options const* options = run->options;
+    size_t len = options->value_min + next_random(random) % (options->value_max - options->value_min + 1);
+    size_t offset = next_random(random) % (VALUE_BYTES - len);
+    return (String) { .size = len, .data = (char*) run->text + offset };
+}
+
+// A key to read, update or delete
+size_t pick_key(Run* run, uint64_t* random) {
+    size_t rank = zipf_next(&run->zipf, random);
+    if (run->workload->latest) {
+        size_t newest = atomic_load(&run->next_key) - 1;
+        return rank <= newest ? newest - rank : 0;
+    }
+    return fnv_hash(rank) % run->nloaded;
+}
+
+Leaf* find_record(Run* run, size_t key) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/user%zu", run->paths[dir_of(run, key)], key);
+    return database_resolve_path(run->db, path);
+}
+
+Leaf* insert_record(Run* run, size_t key, uint64_t* random) {
+    char name[32];
+    sprintf(name, "user%zu", key);
+    return database_create_leaf(run->db, run->dirs[dir_of(run, key)], name, STR,
+                                (Value) { .str_value = random_value(run, random) });
+}
+
+// One operation, inside a read section, so that records other threads
+// delete stay readable meanwhile; false if its record was not found
+bool run_op(Run* run, OpType op, uint64_t* random) {
+    Database* db = run->db;
+    Value value;
+    if (op == OP_INSERT) return insert_record(run, atomic_fetch_add(&run->next_key, 1), random);
+    size_t key = pick_key(run, random);
+    if (!database_read_begin(db)) return false;
+    Leaf* leaf = find_record(run, key);
+    bool ok = leaf != NULL;
+    if (ok && op == OP_READ) {
+        ok = database_read_leaf_value(db, leaf, &value);
+    } else if (ok && op == OP_UPDATE) {
+        ok = database_update_leaf(db, leaf, (Value) { .str_value = random_value(run, random) });
+    } else if (ok && op == OP_RMW) {
+        ok = database_read_leaf_value(db, leaf, &value)
+             && database_update_leaf(db, leaf, (Value) { .str_value = random_value(run, random) });
+    } else if (ok && op == OP_DELETE) {
+        ok = database_delete_leaf(db, leaf);
+    } else if (op == OP_SCAN) { // the records of a directory, from the first one
+        size_t len = 1 + next_random(random) % run->options->scan_max;
+        Iterator it = database_get_directory_content_iterator(db, run->dirs[dir_of(run, key)]);
+        for (bool valid = iterator_is_valid(&it); valid && len > 0; valid = iterator_next(&it), len--) {
+            ok = database_read_leaf_value(db, iterator_get(&it), &value) || ok;
+        }
+    }
+    database_read_end(db);
+    return ok;
+}
+
+OpType pick_op(Workload const* workload, uint64_t* random) {
+    unsigned roll = next_random(random) % 100;
+    size_t op = 0;
+    while (op < NOPS - 1 && roll >= workload->mix[op]) roll -= workload->mix[op++];
+    return op;
+}
+
+void* work(void* arg) {
+    Worker* worker = arg;
+    for (size_t j = 0; j < worker->n_ops; ++j) {
+        OpType op = pick_op(worker->run->workload, &worker->random);
+        BENCH_TIME(&worker->samples[op], run_op(worker->run, op, &worker->random));
+    }
+    return NULL;
+}
+
+// Build the directories, and their paths, level by level
+bool build_tree(Run* run) {
+    Options const* options = run->options;
+    run->ndirs = 1;
+    for (size_t level = 0; level < options->depth; ++level) run->ndirs *= options->fanout;
+    run->dirs = malloc(sizeof(Directory*) * run->ndirs);
+    run->paths = calloc(run->ndirs, sizeof(char*));
+    Directory** above = malloc(sizeof(Directory*) * run->ndirs);
+    char** above_paths = calloc(run->ndirs, sizeof(char*));
+    if (!run->dirs || !run->paths || !above || !above_paths) return false;
+    above[0] = database_get_root_directory(run->db);
+    above_paths[0] = strdup("");
+    size_t n = 1;
+    for (size_t level = 0; level < options->depth; ++level, n *= options->fanout) {
+        for (size_t i = 0; i < n * options->fanout; ++i) {
+            char name[32];
+            sprintf(name, "n%zu", i % options->fanout);
+            run->dirs[i] = database_create_directory(run->db, above[i / options->fanout], name);
+            run->paths[i] = malloc(strlen(above_paths[i / options->fanout]) + strlen(name) + 2);
+            if (!run->dirs[i] || !run->paths[i]) return false;
+            sprintf(run->paths[i], "%s/%s", above_paths[i / options->fanout], name);
+        }
+        for (size_t i = 0; i < n; ++i) free(above_paths[i]);
+        memcpy(above, run->dirs, sizeof(Directory*) * n * options->fanout);
+        for (size_t i = 0; i < n * options->fanout; ++i) above_paths[i] = strdup(run->paths[i]);
+    }
+    if (options->depth == 0) {
+        run->dirs[0] = above[0];
+        run->paths[0] = above_paths[0];
+    } else {
+        for (size_t i = 0; i < run->ndirs; ++i) free(above_paths[i]);
+    }
+    free(above);
+    free(above_paths);
+    return true;
+}
+
+void free_tree(Run* run) {
+    for (size_t i = 0; i < run->ndirs && run->paths; ++i) free(run->paths[i]);
+    free(run->paths);
+    free(run->dirs);
+}
+
+// Load the records in transactions, which is how bulk loads are done
+bool load(BenchConfig* config, Run* run) {
+    size_t const BATCH = 1000;
+    uint64_t random = 1;
+    Samples samples;
+    samples_init(&samples);
+    uint64_t begin = bench_now();
+    bool ok = true;
+    for (size_t key = 0; key < config->size && ok; key += BATCH) {
+        uint64_t batch_begin = bench_now();
+        ok = database_begin(run->db);
+        for (size_t j = key; j < key + BATCH && j < config->size && ok; ++j) ok = insert_record(run, j, &random);
+        ok = database_commit(run->db) && ok;
+        samples_add(&samples, bench_now() - batch_begin);
+    }
+    char name[64];
+    sprintf(name, "%s/load_batch", run->workload->name);
+    bench_report(config, name, 1, &samples, bench_now() - begin);
+    samples_free(&samples);
+    atomic_store(&run->next_key, config->size);
+    return ok;
+}
+
+void run_workload(BenchConfig* config, Options const* options, Workload const* workload, char const* text) {
+    char filename[64];
+    sprintf(filename, "workload_%s", workload->name);
+    Run run = { .options = options, .workload = workload, .nloaded = config->size, .text = text };
+    run.db = database_create_database(filename, 0);
+    ASSERT_TRUE(run.db);
+    ASSERT_TRUE(build_tree(&run));
+    ASSERT_TRUE(load(config, &run));
+    zipf_init(&run.zipf, config->size, options->theta);
+
+    size_t n_threads = options->threads;
+    Worker* workers = calloc(n_threads, sizeof(Worker));
+    pthread_t* threads = malloc(sizeof(pthread_t) * n_threads);
+    ASSERT_TRUE(workers && threads);
+    Samples samples[NOPS];
+    for (size_t op = 0; op < NOPS; ++op) samples_init(&samples[op]);
+    uint64_t wall = 0;
+    size_t n_ops = options->ops ? options->ops : config->size;
+    for (size_t rep = 0; rep < config->warmup + config->reps; ++rep) {
+        if (rep == config->warmup) {
+            for (size_t op = 0; op < NOPS; ++op) samples_clear(&samples[op]);
+            wall = 0;
+        }
+        for (size_t i = 0; i < n_threads; ++i) {
+            workers[i].run = &run;
+            workers[i].n_ops = n_ops / n_threads;
+            workers[i].random = fnv_hash(rep * n_threads + i + 1);
+            for (size_t op = 0; op < NOPS; ++op) samples_init(&workers[i].samples[op]);
+        }
+        uint64_t begin = bench_now();
+        for (size_t i = 0; i < n_threads; ++i) {
+            ASSERT_TRUE(pthread_create(&threads[i], NULL, work, &workers[i]) == 0);
+        }
+        for (size_t i = 0; i < n_threads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        wall += bench_now() - begin;
+        for (size_t i = 0; i < n_threads; ++i) {
+            for (size_t op = 0; op < NOPS; ++op) {
+                samples_merge(&samples[op], &workers[i].samples[op]);
+                samples_free(&workers[i].samples[op]);
+            }
+        }
+    }
+
+    // each type of operation, and all of them together
+    Samples all;
+    samples_init(&all);
+    char name[64];
+    for (size_t op = 0; op < NOPS; ++op) {
+        if (samples[op].len == 0) continue;
+        samples_merge(&all, &samples[op]);
+        sprintf(name, "%s/%s", workload->name, op_names[op]);
+        bench_report(config, name, n_threads, &samples[op], wall);
+        samples_free(&samples[op]);
+    }
+    sprintf(name, "%s/all", workload->name);
+    bench_report(config, name, n_threads, &all, wall);
+    samples_free(&all);
+    free(workers);
+    free(threads);
+    free_tree(&run);
+    database_destroy_database(run.db);
+}
+
+int main(int argc, char** argv) {
+    Options options = {
+        .ops = 0, .threads = 4, .depth = 2, .fanout = 16, .value_min = 16, .value_max = 512,
+        .scan_max = 100, .theta = 0.99, .custom = false,
+    };
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, parse_option, &options,
+                          "[--ops N] [--threads N] [--depth N] [--fanout N] [--value-min N] [--value-max N] "
+                          "[--scan-max N] [--theta X] [--mix read=N,update=N,insert=N,delete=N,scan=N,rmw=N]")) {
+        return 1;
+    }
+    if (options.threads == 0 || options.fanout == 0 || options.scan_max == 0
+        || options.value_min > options.value_max || options.value_max >= VALUE_BYTES) {
+        fprintf(stderr, "Invalid options.\n");
+        return 1;
+    }
+
+    char* text = malloc(VALUE_BYTES);
+    if (!text) return 1;
+    uint64_t random = 42;
+    for (size_t i = 0; i < VALUE_BYTES; ++i) text[i] = (char) ('a' + next_random(&random) % 26);
+
+    bench_begin(&config);
+    if (options.custom) {
+        fprintf(stderr, "Running workload custom...\n");
+        run_workload(&config, &options, &options.mix, text);
+    }
+    for (size_t i = 0; i < NPRESETS; ++i) {
+        if (options.custom || !bench_selected(&config, presets[i].name)) continue;
+        fprintf(stderr, "Running workload %s...\n", presets[i].name);
+        run_workload(&config, &options, &presets[i], text);
+    }
+    bench_end(&config);
+    free(text);
+    return 0;
+}